@@ -6,42 +6,296 @@
 #include "util.h"
 
 IPCClient *
-ipc_client_new(int fd)
+ipc_client_new(int fd, Pool *pool, Pool *chunk_pool)
 {
-  IPCClient *c = (IPCClient *)malloc(sizeof(IPCClient));
+  IPCClient *c = (IPCClient *)poolalloc(pool);
 
   if (c == NULL) return NULL;
 
   // Initialize struct
   memset(&c->event, 0, sizeof(struct epoll_event));
 
-  c->buffer_size = 0;
   c->buffer = NULL;
+  c->buffer_cap = 0;
+  c->buffer_start = 0;
+  c->buffer_len = 0;
+  c->buffer_offset = 0;
+  c->buffer_size = 0;
+  c->recv_header_read = 0;
+  c->recv_type = 0;
+  c->recv_size = 0;
+  c->recv_read = 0;
+  c->recv_buffer = NULL;
+  c->recv_has_id = 0;
+  c->recv_id = 0;
+  c->reply_has_id = 0;
+  c->reply_id = 0;
+  c->arena = (IPCArena){
+      .chunks = NULL, .current = NULL, .last = NULL, .pool = chunk_pool};
+  c->flush_queued = 0;
+  c->flush_next = NULL;
+  c->epoll_type = IPC_EPOLL_CLIENT;
   c->fd = fd;
-  c->event.data.fd = fd;
+  c->event.data.ptr = c;
   c->next = NULL;
   c->prev = NULL;
   c->subscriptions = 0;
+  for (int i = 0; i < IPC_CLIENT_EVENTS; i++) {
+    c->filters[i] = (IPCEventFilter){.monitor = -1, .window = 0, .fields = 0};
+    c->rates[i] = (IPCEventRate){.start = 0, .count = 0};
+  }
+  c->event_round = 0;
+  c->held = NULL;
+  c->held_len = 0;
+  c->held_cap = 0;
+  c->congested = 0;
+  c->congested_since = 0;
+  c->format = 0;
+  c->bytes_queued = 0;
+  c->bytes_written = 0;
+  c->events_sent = 0;
+  c->buffer_size_max = 0;
 
   return c;
 }
 
+IPCFrame *
+ipc_frame_new(uint32_t size)
+{
+  IPCFrame *f = (IPCFrame *)malloc(sizeof(IPCFrame) + size);
+
+  if (f == NULL) return NULL;
+
+  f->refcount = 1;
+  f->size = size;
+
+  return f;
+}
+
+IPCFrame *
+ipc_frame_ref(IPCFrame *f)
+{
+  f->refcount++;
+  return f;
+}
+
 void
-ipc_list_add_client(IPCClientList *list, IPCClient *nc)
+ipc_frame_unref(IPCFrame *f)
 {
-  DEBUG("Adding client with fd %d to list\n", nc->fd);
+  if (--f->refcount == 0) free(f);
+}
+
+int
+ipc_client_queue_frame(IPCClient *c, IPCFrame *f)
+{
+  if (c->buffer_len == c->buffer_cap) {
+    // Grow the ring, unwrapping it so the front is at the start again
+    uint32_t cap = c->buffer_cap ? c->buffer_cap * 2 : 8;
+    IPCFrame **ring = (IPCFrame **)malloc(cap * sizeof(IPCFrame *));
+
+    if (ring == NULL) return -1;
+
+    for (uint32_t i = 0; i < c->buffer_len; i++)
+      ring[i] = c->buffer[(c->buffer_start + i) & (c->buffer_cap - 1)];
+
+    free(c->buffer);
+    c->buffer = ring;
+    c->buffer_cap = cap;
+    c->buffer_start = 0;
+  }
+
+  c->buffer[(c->buffer_start + c->buffer_len) & (c->buffer_cap - 1)] =
+      ipc_frame_ref(f);
+  c->buffer_len++;
+  c->buffer_size += f->size;
+
+  return 0;
+}
+
+void
+ipc_client_dequeue_frame(IPCClient *c)
+{
+  if (c->buffer_len == 0) return;
+
+  IPCFrame *f = c->buffer[c->buffer_start];
+
+  c->buffer_start = (c->buffer_start + 1) & (c->buffer_cap - 1);
+  c->buffer_len--;
+
+  // Part of the frame may already have been written
+  c->buffer_size -= f->size - c->buffer_offset;
+  c->buffer_offset = 0;
+
+  ipc_frame_unref(f);
+}
+
+void
+ipc_client_clear_queue(IPCClient *c)
+{
+  while (c->buffer_len) ipc_client_dequeue_frame(c);
+}
+
+int
+ipc_client_fill_iovec(IPCClient *c, struct iovec *iov, int max)
+{
+  int n = 0;
+  uint32_t offset = c->buffer_offset;
+
+  for (; n < max && n < c->buffer_len; n++) {
+    IPCFrame *f = c->buffer[(c->buffer_start + n) & (c->buffer_cap - 1)];
+    iov[n].iov_base = f->data + offset;
+    iov[n].iov_len = f->size - offset;
+    offset = 0;
+  }
+
+  return n;
+}
+
+void
+ipc_client_consume_queue(IPCClient *c, size_t n)
+{
+  while (n > 0 && c->buffer_len) {
+    IPCFrame *f = c->buffer[c->buffer_start];
+    const size_t remaining = f->size - c->buffer_offset;
+
+    if (n < remaining) {
+      // Partial write, only move the offset
+      c->buffer_offset += n;
+      c->buffer_size -= n;
+      return;
+    }
+
+    n -= remaining;
+    ipc_client_dequeue_frame(c);
+  }
+}
+
+// Bytes in front of every arena allocation that record its size
+#define IPC_ARENA_HEADER IPC_ARENA_ALIGN
+
+static size_t
+ipc_arena_round(size_t n)
+{
+  return (n + IPC_ARENA_ALIGN - 1) & ~(size_t)(IPC_ARENA_ALIGN - 1);
+}
+
+static void
+ipc_arena_free_chunk(IPCArena *a, IPCArenaChunk *chunk)
+{
+  if (a->pool && chunk->size == IPC_ARENA_CHUNK)
+    poolfree(a->pool, chunk);
+  else
+    free(chunk);
+}
+
+void *
+ipc_arena_alloc(IPCArena *a, size_t size)
+{
+  const size_t base = ipc_arena_round(sizeof(IPCArenaChunk));
+  IPCArenaChunk *chunk = a->current;
+
+  if (size > SIZE_MAX / 2) return NULL;
+
+  const size_t need = IPC_ARENA_HEADER + ipc_arena_round(size);
+
+  if (chunk == NULL || chunk->size - chunk->used < need) {
+    const size_t chunk_size = MAX(IPC_ARENA_CHUNK, base + need);
+
+    if (a->pool && chunk_size == IPC_ARENA_CHUNK)
+      chunk = (IPCArenaChunk *)poolalloc(a->pool);
+    else
+      chunk = (IPCArenaChunk *)malloc(chunk_size);
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    chunk->size = chunk_size;
+    chunk->used = base;
+
+    // Chunks are only ever appended, so the current chunk is the last one
+    if (a->current)
+      a->current->next = chunk;
+    else
+      a->chunks = chunk;
+    a->current = chunk;
+  }
+
+  char *p = (char *)chunk + chunk->used;
+  *(size_t *)p = size;
+  chunk->used += need;
+  a->last = p + IPC_ARENA_HEADER;
+
+  return a->last;
+}
+
+void *
+ipc_arena_realloc(IPCArena *a, void *ptr, size_t size)
+{
+  if (ptr == NULL) return ipc_arena_alloc(a, size);
+
+  size_t *old_size = (size_t *)((char *)ptr - IPC_ARENA_HEADER);
+  if (size <= *old_size) return ptr;
+  if (size > SIZE_MAX / 2) return NULL;
+
+  if (ptr == a->last) {
+    IPCArenaChunk *chunk = a->current;
+    const size_t grow = ipc_arena_round(size) - ipc_arena_round(*old_size);
 
-  if (*list == NULL) {
-    // List is empty, point list at first client
-    *list = nc;
+    if (chunk->size - chunk->used >= grow) {
+      chunk->used += grow;
+      *old_size = size;
+      return ptr;
+    }
+  }
+
+  void *p = ipc_arena_alloc(a, size);
+  if (p != NULL) memcpy(p, ptr, *old_size);
+
+  return p;
+}
+
+void
+ipc_arena_reset(IPCArena *a)
+{
+  IPCArenaChunk *chunk = a->chunks;
+
+  if (chunk == NULL) return;
+
+  // Only a first chunk of the usual size is worth keeping, one that was made
+  // bigger for a single large allocation is released with the rest
+  if (chunk->size == IPC_ARENA_CHUNK) {
+    chunk->used = ipc_arena_round(sizeof(IPCArenaChunk));
+    chunk = chunk->next;
+    a->chunks->next = NULL;
+    a->current = a->chunks;
   } else {
-    IPCClient *c;
-    // Go to last client in list
-    for (c = *list; c && c->next; c = c->next)
-      ;
-    c->next = nc;
-    nc->prev = c;
+    a->chunks = a->current = NULL;
   }
+
+  while (chunk != NULL) {
+    IPCArenaChunk *next = chunk->next;
+    ipc_arena_free_chunk(a, chunk);
+    chunk = next;
+  }
+
+  a->last = NULL;
+}
+
+void
+ipc_arena_free(IPCArena *a)
+{
+  ipc_arena_reset(a);
+  if (a->chunks) ipc_arena_free_chunk(a, a->chunks);
+  a->chunks = a->current = NULL;
+}
+
+void
+ipc_list_add_client(IPCClientList *list, IPCClient *nc)
+{
+  DEBUG("Adding client with fd %d to list\n", nc->fd);
+
+  nc->prev = NULL;
+  nc->next = *list;
+  if (*list != NULL) (*list)->prev = nc;
+  *list = nc;
 }
 
 void
@@ -1,9 +1,104 @@
 #ifndef IPC_CLIENT_H_
 #define IPC_CLIENT_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+
+// Number of bytes reserved for a partially received message header
+#define IPC_CLIENT_HEADER_MAX 32
+// Number of event types a client can keep a subscription filter for
+#define IPC_CLIENT_EVENTS 8
+// Size of the chunk of a client's scratch arena that is kept across messages
+#define IPC_ARENA_CHUNK 4096
+// Alignment of every allocation from a scratch arena
+#define IPC_ARENA_ALIGN 16
+
+/**
+ * Kind of object pointed at by the data.ptr of an epoll event. Every object
+ * registered with epoll starts with one of these so the event loop can
+ * dispatch on it directly instead of looking up the file descriptor.
+ */
+typedef enum IPCEpollType {
+  IPC_EPOLL_DISPLAY,
+  IPC_EPOLL_SOCKET,
+  IPC_EPOLL_CLIENT,
+  IPC_EPOLL_TIMER
+} IPCEpollType;
+
+/**
+ * Restricts which events of a subscribed type are sent to a client, which
+ * fields of the event are included and how often events are sent
+ */
+typedef struct IPCEventFilter {
+  // Monitor that the event must concern, -1 for any monitor
+  int monitor;
+  // Client window that the event must concern, 0 for any window
+  unsigned long window;
+  // IPCEventField bits of the fields to include, 0 for all fields
+  unsigned int fields;
+  // Non-zero to merge events about the same thing while the client has
+  // messages it hasn't read yet, keeping the old side of the first one
+  int conflate;
+  // Maximum number of events sent to the client per second, 0 for no limit
+  unsigned int max_rate;
+} IPCEventFilter;
+
+/**
+ * Number of events of one type sent to a client in the current one second
+ * window of its rate limit
+ */
+typedef struct IPCEventRate {
+  // Start of the window in milliseconds of CLOCK_MONOTONIC
+  uint64_t start;
+  unsigned int count;
+} IPCEventRate;
+
+struct IPCEventData;
+
+typedef struct IPCFrame IPCFrame;
+/**
+ * An encoded IPC message (header followed by payload). Frames are immutable
+ * once built and are reference counted so the same frame can be queued on the
+ * buffers of any number of clients. The frame is freed when the last reference
+ * is dropped.
+ */
+struct IPCFrame {
+  unsigned int refcount;
+  uint32_t size;
+  char data[];
+};
+
+struct Pool;
+
+typedef struct IPCArenaChunk IPCArenaChunk;
+/**
+ * A block of memory that arena allocations are carved from
+ */
+struct IPCArenaChunk {
+  IPCArenaChunk *next;
+  size_t size;
+  size_t used;
+};
+
+/**
+ * Scratch memory for handling a single message. Allocations are never freed
+ * individually, the whole arena is reset once the message has been handled.
+ * The first chunk is kept across resets so handling a typical message does
+ * not need to go back to malloc at all.
+ */
+typedef struct IPCArena {
+  IPCArenaChunk *chunks;
+  // Chunk that allocations are currently taken from
+  IPCArenaChunk *current;
+  // Most recent allocation, which can be grown in place
+  void *last;
+  // Pool of IPC_ARENA_CHUNK sized chunks, shared by the arenas of all clients.
+  // NULL to take every chunk from malloc.
+  struct Pool *pool;
+} IPCArena;
 
 typedef struct IPCClient IPCClient;
 /**
@@ -11,12 +106,66 @@ typedef struct IPCClient IPCClient;
  * linked list
  */
 struct IPCClient {
+  // Must be the first member, see IPCEpollType
+  IPCEpollType epoll_type;
   int fd;
   int subscriptions;
+  // Filter of each subscribed event, indexed by the bit of the IPCEvent
+  IPCEventFilter filters[IPC_CLIENT_EVENTS];
+  // Last event round in which the client was sent the event being dispatched
+  unsigned int event_round;
+  // Rate limit state of each subscribed event, indexed like filters
+  IPCEventRate rates[IPC_CLIENT_EVENTS];
+  // Events held back by conflation or a rate limit, at most one per event
+  // type and monitor or window
+  struct IPCEventData *held;
+  uint32_t held_len;
+  uint32_t held_cap;
+  // Set while the queue is above the high watermark and hasn't drained below
+  // the low watermark yet, along with when the client became congested
+  int congested;
+  uint64_t congested_since;
+  // IPCFormat replies and events are encoded in for this client
+  int format;
+  // Counters reported by IPC_TYPE_GET_STATS
+  uint64_t bytes_queued;
+  uint64_t bytes_written;
+  uint64_t events_sent;
+  uint32_t buffer_size_max;
 
-  char *buffer;
+  // Ring of frames waiting to be written to the client. The ring's capacity
+  // is always a power of 2 and is kept for the lifetime of the client so it
+  // can be reused without going back to malloc.
+  IPCFrame **buffer;
+  uint32_t buffer_cap;
+  uint32_t buffer_start;
+  uint32_t buffer_len;
+  // Number of bytes of the frame at the front of the ring already written
+  uint32_t buffer_offset;
+  // Total number of bytes pending in the ring
   uint32_t buffer_size;
 
+  // State of the message currently being received. Reading resumes from here
+  // whenever the client's socket becomes readable again.
+  uint8_t recv_header[IPC_CLIENT_HEADER_MAX];
+  uint32_t recv_header_read;
+  uint8_t recv_type;
+  uint32_t recv_size;
+  uint32_t recv_read;
+  char *recv_buffer;
+  // Request ID from the header extension of the message being received
+  int recv_has_id;
+  uint32_t recv_id;
+  // Request ID of the message being handled, echoed in the replies to it
+  int reply_has_id;
+  uint32_t reply_id;
+  // Scratch memory for receiving and parsing the message being handled
+  IPCArena arena;
+  // Set while the client is on the list of clients that have frames to write
+  // at the end of the event loop iteration, see ipc_flush_clients
+  int flush_queued;
+  IPCClient *flush_next;
+
   struct epoll_event event;
   IPCClient *next;
   IPCClient *prev;
@@ -29,13 +178,129 @@ typedef IPCClient *IPCClientList;
  * initialize struct.
  *
  * @param fd File descriptor of IPC client
+ * @param pool Pool to allocate the IPCClient from, it must go back to the same
+ *   pool once the client is dropped
+ * @param chunk_pool Pool of the chunks of the client's scratch arena
+ *
+ * @return Address to allocated IPCClient struct, NULL on failure
+ */
+IPCClient *ipc_client_new(int fd, struct Pool *pool, struct Pool *chunk_pool);
+
+/**
+ * Allocate a new frame with room for the specified number of bytes. The frame
+ * is returned with a reference count of 1.
+ *
+ * @param size Size of the frame data in bytes (header and payload)
+ *
+ * @return Address to allocated IPCFrame, NULL on failure
+ */
+IPCFrame *ipc_frame_new(uint32_t size);
+
+/**
+ * Take a new reference to a frame
+ *
+ * @param f Address of the IPCFrame
+ *
+ * @return The same frame
+ */
+IPCFrame *ipc_frame_ref(IPCFrame *f);
+
+/**
+ * Drop a reference to a frame. The frame is freed once the last reference is
+ * dropped.
+ *
+ * @param f Address of the IPCFrame
+ */
+void ipc_frame_unref(IPCFrame *f);
+
+/**
+ * Append a frame to the end of a client's outgoing queue. The queue takes its
+ * own reference to the frame.
+ *
+ * @param c Address of the IPCClient
+ * @param f Address of the IPCFrame
+ *
+ * @return 0 on success, -1 if the frame could not be queued
+ */
+int ipc_client_queue_frame(IPCClient *c, IPCFrame *f);
+
+/**
+ * Remove the frame at the front of a client's outgoing queue and drop the
+ * queue's reference to it
+ *
+ * @param c Address of the IPCClient
+ */
+void ipc_client_dequeue_frame(IPCClient *c);
+
+/**
+ * Remove all frames from a client's outgoing queue
+ *
+ * @param c Address of the IPCClient
+ */
+void ipc_client_clear_queue(IPCClient *c);
+
+/**
+ * Describe the pending bytes of a client's outgoing queue as an array of
+ * iovecs suitable for writev()
+ *
+ * @param c Address of the IPCClient
+ * @param iov Array of iovecs to fill
+ * @param max Maximum number of iovecs to fill
+ *
+ * @return Number of iovecs filled
+ */
+int ipc_client_fill_iovec(IPCClient *c, struct iovec *iov, int max);
+
+/**
+ * Mark the specified number of bytes at the front of a client's outgoing queue
+ * as written. Fully written frames are removed from the queue.
+ *
+ * @param c Address of the IPCClient
+ * @param n Number of bytes written
+ */
+void ipc_client_consume_queue(IPCClient *c, size_t n);
+
+/**
+ * Allocate memory from an arena. The memory stays valid until the arena is
+ * reset.
+ *
+ * @param a Address of the IPCArena
+ * @param size Number of bytes to allocate
+ *
+ * @return Address of the allocated memory, NULL on failure
+ */
+void *ipc_arena_alloc(IPCArena *a, size_t size);
+
+/**
+ * Resize memory allocated from an arena. The most recent allocation is grown
+ * in place when its chunk has room, anything else is copied to a new
+ * allocation.
+ *
+ * @param a Address of the IPCArena
+ * @param ptr Address returned by ipc_arena_alloc or ipc_arena_realloc, or NULL
+ * @param size New size in bytes
+ *
+ * @return Address of the resized memory, NULL on failure
+ */
+void *ipc_arena_realloc(IPCArena *a, void *ptr, size_t size);
+
+/**
+ * Release everything allocated from an arena. The first chunk is kept for
+ * reuse, any others are freed.
+ *
+ * @param a Address of the IPCArena
+ */
+void ipc_arena_reset(IPCArena *a);
+
+/**
+ * Free all memory held by an arena
  *
- * @return Address to allocated IPCClient struct
+ * @param a Address of the IPCArena
  */
-IPCClient *ipc_client_new(int fd);
+void ipc_arena_free(IPCArena *a);
 
 /**
- * Add an IPC Client to the specified list
+ * Add an IPC Client to the front of the specified list
  *
  * @param list Address of the list to add the client to
  * @param nc Address of the IPCClient
@@ -0,0 +1,196 @@
+#include "cbor_gen.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// CBOR major types, already shifted into the high 3 bits of the initial byte
+#define CBOR_UINT 0x00
+#define CBOR_NINT 0x20
+#define CBOR_TEXT 0x60
+#define CBOR_ARRAY 0x80
+#define CBOR_MAP 0xa0
+
+// Simple values and special initial bytes
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT64 0xfb
+#define CBOR_INDEFINITE 0x1f
+#define CBOR_BREAK 0xff
+
+struct cbor_gen_t {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/**
+ * Make sure there is room for at least n more bytes in the output buffer
+ *
+ * Returns 0 if there is enough space in the buffer
+ * Returns -1 if the buffer could not be grown
+ */
+static int
+cbor_gen_reserve(cbor_gen g, size_t n)
+{
+  if (g->len + n <= g->cap) return 0;
+
+  size_t cap = g->cap ? g->cap : 256;
+  while (cap < g->len + n) cap *= 2;
+
+  unsigned char *buf = realloc(g->buf, cap);
+  if (buf == NULL) return -1;
+
+  g->buf = buf;
+  g->cap = cap;
+  return 0;
+}
+
+/**
+ * Write an initial byte with the specified major type followed by the argument
+ * in the shortest encoding that can hold it.
+ *
+ * Returns 0 on success
+ * Returns -1 if the buffer could not be grown
+ */
+static int
+cbor_gen_head(cbor_gen g, unsigned char major, uint64_t arg)
+{
+  int nbytes;
+
+  if (cbor_gen_reserve(g, 9) < 0) return -1;
+
+  if (arg < 24) {
+    g->buf[g->len++] = major | arg;
+    return 0;
+  } else if (arg <= UINT8_MAX) {
+    g->buf[g->len++] = major | 24;
+    nbytes = 1;
+  } else if (arg <= UINT16_MAX) {
+    g->buf[g->len++] = major | 25;
+    nbytes = 2;
+  } else if (arg <= UINT32_MAX) {
+    g->buf[g->len++] = major | 26;
+    nbytes = 4;
+  } else {
+    g->buf[g->len++] = major | 27;
+    nbytes = 8;
+  }
+
+  // Arguments are stored in network byte order
+  for (int i = nbytes - 1; i >= 0; i--)
+    g->buf[g->len++] = (arg >> (i * 8)) & 0xff;
+
+  return 0;
+}
+
+/**
+ * Write a single byte to the output buffer
+ *
+ * Returns 0 on success
+ * Returns -1 if the buffer could not be grown
+ */
+static int
+cbor_gen_byte(cbor_gen g, unsigned char byte)
+{
+  if (cbor_gen_reserve(g, 1) < 0) return -1;
+  g->buf[g->len++] = byte;
+  return 0;
+}
+
+cbor_gen
+cbor_gen_alloc(void)
+{
+  return calloc(1, sizeof(struct cbor_gen_t));
+}
+
+void
+cbor_gen_free(cbor_gen g)
+{
+  if (g == NULL) return;
+  free(g->buf);
+  free(g);
+}
+
+void
+cbor_gen_get_buf(cbor_gen g, const unsigned char **buf, size_t *len)
+{
+  *buf = g->buf;
+  *len = g->len;
+}
+
+void
+cbor_gen_clear(cbor_gen g)
+{
+  g->len = 0;
+}
+
+int
+cbor_gen_integer(cbor_gen g, long long num)
+{
+  if (num < 0) return cbor_gen_head(g, CBOR_NINT, -1 - num);
+  return cbor_gen_head(g, CBOR_UINT, num);
+}
+
+int
+cbor_gen_double(cbor_gen g, double num)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &num, sizeof(bits));
+  if (cbor_gen_reserve(g, 9) < 0) return -1;
+
+  g->buf[g->len++] = CBOR_FLOAT64;
+  for (int i = 7; i >= 0; i--) g->buf[g->len++] = (bits >> (i * 8)) & 0xff;
+
+  return 0;
+}
+
+int
+cbor_gen_bool(cbor_gen g, int boolean)
+{
+  return cbor_gen_byte(g, boolean ? CBOR_TRUE : CBOR_FALSE);
+}
+
+int
+cbor_gen_null(cbor_gen g)
+{
+  return cbor_gen_byte(g, CBOR_NULL);
+}
+
+int
+cbor_gen_string(cbor_gen g, const unsigned char *str, size_t len)
+{
+  if (cbor_gen_head(g, CBOR_TEXT, len) < 0 || cbor_gen_reserve(g, len) < 0)
+    return -1;
+
+  memcpy(g->buf + g->len, str, len);
+  g->len += len;
+
+  return 0;
+}
+
+int
+cbor_gen_map_open(cbor_gen g)
+{
+  return cbor_gen_byte(g, CBOR_MAP | CBOR_INDEFINITE);
+}
+
+int
+cbor_gen_map_close(cbor_gen g)
+{
+  return cbor_gen_byte(g, CBOR_BREAK);
+}
+
+int
+cbor_gen_array_open(cbor_gen g)
+{
+  return cbor_gen_byte(g, CBOR_ARRAY | CBOR_INDEFINITE);
+}
+
+int
+cbor_gen_array_close(cbor_gen g)
+{
+  return cbor_gen_byte(g, CBOR_BREAK);
+}
@@ -0,0 +1,60 @@
+#ifndef CBOR_GEN_H_
+#define CBOR_GEN_H_
+
+#include <stddef.h>
+
+/**
+ * Minimal CBOR (RFC 7049) generator with an interface modelled after
+ * yajl_gen. Maps and arrays are written with indefinite lengths so that they
+ * can be streamed in the same way as their JSON counterparts.
+ */
+typedef struct cbor_gen_t *cbor_gen;
+
+/**
+ * Allocate a new CBOR generator with an empty output buffer
+ *
+ * @return Address to allocated generator, NULL on failure
+ */
+cbor_gen cbor_gen_alloc(void);
+
+/**
+ * Free the generator and its output buffer
+ *
+ * @param g Generator to free
+ */
+void cbor_gen_free(cbor_gen g);
+
+/**
+ * Get the output buffer of the generator. The buffer is owned by the generator
+ * and stays valid until the generator is cleared or freed.
+ *
+ * @param g Generator
+ * @param buf Address to store the address of the output buffer at
+ * @param len Address to store the length of the output buffer at
+ */
+void cbor_gen_get_buf(cbor_gen g, const unsigned char **buf, size_t *len);
+
+/**
+ * Empty the output buffer of the generator, keeping the allocated memory so
+ * the generator can be reused for another message.
+ *
+ * @param g Generator
+ */
+void cbor_gen_clear(cbor_gen g);
+
+/**
+ * The following functions append a single item to the output buffer.
+ *
+ * @return 0 on success, -1 if the output buffer could not be grown
+ */
+int cbor_gen_integer(cbor_gen g, long long num);
+int cbor_gen_double(cbor_gen g, double num);
+int cbor_gen_bool(cbor_gen g, int boolean);
+int cbor_gen_null(cbor_gen g);
+int cbor_gen_string(cbor_gen g, const unsigned char *str, size_t len);
+int cbor_gen_map_open(cbor_gen g);
+int cbor_gen_map_close(cbor_gen g);
+int cbor_gen_array_open(cbor_gen g);
+int cbor_gen_array_close(cbor_gen g);
+
+#endif  // CBOR_GEN_H_
@@ -5,6 +5,7 @@ static const unsigned int borderpx  = 1;        /* border pixel of windows */
 static const unsigned int snap      = 32;       /* snap pixel */
 static const int showbar            = 1;        /* 0 means no bar */
 static const int topbar             = 1;        /* 0 means bottom bar */
+static const unsigned int statusinterval = 0; /* min ms between status redraws, 0 for none */
 static const char *fonts[]          = { "monospace:size=10" };
 static const char dmenufont[]       = "monospace:size=10";
 static const char col_gray1[]       = "#222222";
@@ -114,6 +115,15 @@ static Button buttons[] = {
 };
 
 static const char *ipcsockpath = "/tmp/dwm.sock";
+static const char *ipcstatepath = NULL; /* state snapshot for read-only consumers, e.g. "/tmp/dwm.state", NULL for none */
+static const int ipcbeautify = 1; /* 0 means replies and events are compact JSON */
+static const unsigned int ipcdebounce = 0; /* ms to collect changes before sending IPC events */
+static const unsigned int ipchighwater = 1 << 20; /* bytes queued for an IPC client before its events are held back, 0 for no limit */
+static const unsigned int ipclowwater = 256 << 10; /* bytes queued below which held back events are sent again */
+static const unsigned int ipcevictgrace = 5000; /* ms above ipchighwater before the IPC client is dropped, 0 to never drop */
+static const int ipcbacklog = 64; /* IPC connections waiting to be accepted before new ones are refused */
+static const int ipcedgetriggered = 0; /* 1 means IPC clients are edge triggered epoll events */
+static const unsigned int epollevents = 64; /* epoll events handled per event loop wakeup */
 static IPCCommand ipccommands[] = {
   IPCCOMMAND(  view,                1,      {ARG_TYPE_UINT}   ),
   IPCCOMMAND(  toggleview,          1,      {ARG_TYPE_UINT}   ),
@@ -128,6 +138,7 @@ static IPCCommand ipccommands[] = {
   IPCCOMMAND(  togglefloating,      1,      {ARG_TYPE_NONE}   ),
   IPCCOMMAND(  setmfact,            1,      {ARG_TYPE_FLOAT}  ),
   IPCCOMMAND(  setlayoutsafe,       1,      {ARG_TYPE_PTR}    ),
+  IPCCOMMAND(  setstatus,           1,      {ARG_TYPE_STR}    ),
   IPCCOMMAND(  quit,                1,      {ARG_TYPE_NONE}   )
 };
 
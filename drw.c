@@ -71,6 +71,8 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -88,11 +90,13 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
@@ -166,6 +170,86 @@ xfont_free(Fnt *font)
 	free(font);
 }
 
+static void
+drw_clearcache(Drw *drw)
+{
+	memset(drw->fontcache, 0, sizeof(drw->fontcache));
+	memset(drw->widthcache, 0, sizeof(drw->widthcache));
+}
+
+/* Load a fallback font for a codepoint that no font of the set has and append
+ * it to the set. Returns the font drawing the codepoint, which is the first
+ * font of the set if no fallback has it either. */
+static Fnt *
+xfont_fallback(Drw *drw, long codepoint)
+{
+	Fnt *font, *curfont;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, codepoint);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (!match)
+		return drw->fonts;
+
+	font = xfont_create(drw, NULL, match);
+	if (!font || !XftCharExists(drw->dpy, font->xfont, codepoint)) {
+		xfont_free(font);
+		return drw->fonts;
+	}
+
+	for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+		; /* NOP */
+	curfont->next = font;
+	/* the new font can change how other codepoints are drawn */
+	drw_clearcache(drw);
+
+	return font;
+}
+
+/* Find the font drawing a codepoint: the first font of the set that has it,
+ * or else a fallback font, see xfont_fallback. */
+static Fnt *
+xfont_find(Drw *drw, long codepoint)
+{
+	size_t i = (unsigned long)codepoint % DRW_FONTCACHE;
+	Fnt *font;
+
+	if (drw->fontcache[i].font && drw->fontcache[i].codepoint == codepoint)
+		return drw->fontcache[i].font;
+
+	for (font = drw->fonts; font; font = font->next)
+		if (XftCharExists(drw->dpy, font->xfont, codepoint))
+			break;
+	if (!font)
+		font = xfont_fallback(drw, codepoint);
+
+	drw->fontcache[i].codepoint = codepoint;
+	drw->fontcache[i].font = font;
+
+	return font;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -181,6 +265,7 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	drw_clearcache(drw);
 	return (drw->fonts = ret);
 }
 
@@ -225,8 +310,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw) {
 		drw->fonts = set;
+		drw_clearcache(drw);
+	}
 }
 
 void
@@ -254,17 +341,11 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	char buf[1024];
 	int ty;
 	unsigned int ew;
-	XftDraw *d = NULL;
 	Fnt *usedfont, *curfont, *nextfont;
 	size_t i, len;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -274,9 +355,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
@@ -288,23 +366,12 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			if ((curfont = xfont_find(drw, utf8codepoint)) != usedfont) {
+				nextfont = curfont;
 				break;
-			else
-				charexists = 0;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
 		}
 
 		if (utf8strlen) {
@@ -322,7 +389,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
+					XftDrawStringUtf8(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
 					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
 				}
 				x += ew;
@@ -330,51 +397,10 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			}
 		}
 
-		if (!*text) {
+		if (!*text)
 			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
-		}
+		usedfont = nextfont;
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -386,15 +412,33 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 		return;
 
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	size_t i, len;
+	unsigned long hash = 5381;
+	unsigned int w;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+
+	for (len = 0; text[len]; len++)
+		hash = hash * 33 + (unsigned char)text[len];
+	if (len >= sizeof(drw->widthcache[0].text))
+		return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+
+	i = hash % DRW_WIDTHCACHE;
+	if (drw->widthcache[i].w && !strcmp(drw->widthcache[i].text, text))
+		return drw->widthcache[i].w;
+
+	/* measuring can load a fallback font, which empties the cache */
+	w = drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	memcpy(drw->widthcache[i].text, text, len + 1);
+	drw->widthcache[i].w = w;
+
+	return w;
 }
 
 void
@@ -15,15 +15,29 @@ typedef struct Fnt {
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
 typedef XftColor Clr;
 
+#define DRW_FONTCACHE  256 /* codepoints whose font is remembered */
+#define DRW_WIDTHCACHE 64  /* strings whose width is remembered */
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	/* caches of the font drawing a codepoint and of the width of short
+	 * strings, emptied whenever the fontset changes */
+	struct {
+		long codepoint;
+		Fnt *font;
+	} fontcache[DRW_FONTCACHE];
+	struct {
+		char text[64];
+		unsigned int w;
+	} widthcache[DRW_WIDTHCACHE];
 } Drw;
 
 /* Drawable abstraction */
@@ -0,0 +1,347 @@
+// Load generator and latency benchmark for the dwm IPC socket
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <yajl/yajl_gen.h>
+
+#include "dwm-ipc.h"
+
+static const char *prog_name;
+
+#define BENCH_DEFAULT_SUBSCRIBERS 4
+#define BENCH_DEFAULT_REQUESTERS 4
+#define BENCH_DEFAULT_REQUESTS 1000
+
+typedef enum BenchRequest {
+  BENCH_GET_MONITORS = 0,
+  BENCH_RUN_COMMAND = 1,
+  BENCH_SUBSCRIBE = 2,
+  BENCH_REQUEST_LAST
+} BenchRequest;
+
+static const char *bench_request_names[] = {"get_monitors", "run_command",
+                                            "subscribe"};
+
+/**
+ * Samples of a single measurement in microseconds
+ */
+typedef struct BenchSamples {
+  double *values;
+  size_t len;
+  size_t cap;
+} BenchSamples;
+
+typedef struct BenchConn {
+  int fd;
+  int is_subscriber;
+  // Number of requests sent so far, also selects the next request type
+  unsigned int sent;
+  // Reply to the request sent at request_time is pending
+  int pending;
+  BenchRequest request;
+  struct timespec request_time;
+} BenchConn;
+
+static BenchSamples request_samples[BENCH_REQUEST_LAST];
+static BenchSamples event_samples;
+// Time the last state changing command was sent, used to measure the latency
+// of the events that it causes
+static struct timespec last_command_time;
+static int last_command_valid = 0;
+
+static double
+elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e6 +
+         (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void
+add_sample(BenchSamples *s, double value)
+{
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->values = realloc(s->values, s->cap * sizeof(double));
+    if (s->values == NULL) err(EXIT_FAILURE, "Failed to allocate samples");
+  }
+  s->values[s->len++] = value;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(const BenchSamples *s, double p)
+{
+  if (s->len == 0) return 0;
+  size_t i = (size_t)(p * (s->len - 1) + 0.5);
+  return s->values[i];
+}
+
+static void
+print_samples(const char *name, BenchSamples *s)
+{
+  qsort(s->values, s->len, sizeof(double), compare_double);
+  printf("%-16s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, s->len,
+         percentile(s, 0.50), percentile(s, 0.99), percentile(s, 0.999),
+         s->len ? s->values[s->len - 1] : 0);
+}
+
+/**
+ * Send the next request of the mix on a requester connection. Requests cycle
+ * through get_monitors, a view command that alternates between the first two
+ * tags, and subscribing/unsubscribing from an event.
+ */
+static void
+send_request(BenchConn *c)
+{
+  const unsigned char *msg = (const unsigned char *)"";
+  size_t msg_size = 1;
+  IPCMessageType type = IPC_TYPE_GET_MONITORS;
+  yajl_gen gen = yajl_gen_alloc(NULL);
+  // Every other round of the mix undoes the previous one
+  const int round = (c->sent / BENCH_REQUEST_LAST) % 2;
+
+  c->request = c->sent % BENCH_REQUEST_LAST;
+
+  if (c->request == BENCH_RUN_COMMAND) {
+    type = IPC_TYPE_RUN_COMMAND;
+    // clang-format off
+    YMAP(
+      YSTR("command"); YSTR("view");
+      YSTR("args"); YARR(
+        YINT(1 << round);
+      )
+    )
+    // clang-format on
+  } else if (c->request == BENCH_SUBSCRIBE) {
+    const char *action = round ? "unsubscribe" : "subscribe";
+    type = IPC_TYPE_SUBSCRIBE;
+    // clang-format off
+    YMAP(
+      YSTR("event"); YSTR(IPC_EVENT_FOCUSED_TITLE_CHANGE);
+      YSTR("action"); YSTR(action);
+    )
+    // clang-format on
+  }
+
+  if (type != IPC_TYPE_GET_MONITORS) yajl_gen_get_buf(gen, &msg, &msg_size);
+
+  sock_fd = c->fd;
+  clock_gettime(CLOCK_MONOTONIC, &c->request_time);
+  send_message(type, msg_size, (uint8_t *)msg);
+
+  if (c->request == BENCH_RUN_COMMAND) {
+    last_command_time = c->request_time;
+    last_command_valid = 1;
+  }
+
+  c->sent++;
+  c->pending = 1;
+  yajl_gen_free(gen);
+}
+
+/**
+ * Read one message from a connection and record its latency
+ */
+static void
+handle_message(BenchConn *c)
+{
+  IPCMessageType type;
+  uint32_t size;
+  char *msg;
+  struct timespec now;
+
+  sock_fd = c->fd;
+  read_socket(&type, &size, &msg);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  free(msg);
+
+  if (type == IPC_TYPE_EVENT) {
+    if (c->is_subscriber && last_command_valid)
+      add_sample(&event_samples, elapsed_us(&last_command_time, &now));
+  } else if (c->pending) {
+    add_sample(&request_samples[c->request],
+               elapsed_us(&c->request_time, &now));
+    c->pending = 0;
+  }
+}
+
+static void
+subscribe_all(BenchConn *c)
+{
+  const char *events[] = {IPC_EVENT_TAG_CHANGE, IPC_EVENT_CLIENT_FOCUS_CHANGE,
+                          IPC_EVENT_LAYOUT_CHANGE};
+
+  sock_fd = c->fd;
+  for (int i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+    const unsigned char *msg;
+    size_t msg_size;
+    yajl_gen gen = yajl_gen_alloc(NULL);
+
+    // clang-format off
+    YMAP(
+      YSTR("event"); YSTR(events[i]);
+      YSTR("action"); YSTR("subscribe");
+    )
+    // clang-format on
+
+    yajl_gen_get_buf(gen, &msg, &msg_size);
+    send_message(IPC_TYPE_SUBSCRIBE, msg_size, (uint8_t *)msg);
+    flush_socket_reply();
+    yajl_gen_free(gen);
+  }
+}
+
+static void
+print_bench_usage()
+{
+  printf("usage: %s [-s <socket>] [-n <subscribers>] [-m <requesters>] "
+         "[-r <requests>]\n",
+         prog_name);
+  puts("Measure the latency and throughput of the dwm IPC socket.");
+  puts("");
+  puts("Each requester keeps one request in flight, cycling through");
+  puts("get_monitors, run_command view and subscribe/unsubscribe. Event");
+  puts("latency is measured from the most recent run_command until a");
+  puts("subscriber receives the event. Latencies are in microseconds.");
+  puts("");
+  puts("Options:");
+  puts("  -s, --socket <path>             Socket of dwm to connect to");
+  puts("  -n, --subscribers <n>           Number of subscriber connections");
+  puts("  -m, --requesters <n>            Number of requester connections");
+  puts("  -r, --requests <n>              Requests sent by each requester");
+  puts("  -h, --help                      Display this message");
+}
+
+int
+main(int argc, char *argv[])
+{
+  prog_name = argv[0];
+  int o, option_index = 0;
+  char *socket_path = NULL;
+  int nsubscribers = BENCH_DEFAULT_SUBSCRIBERS;
+  int nrequesters = BENCH_DEFAULT_REQUESTERS;
+  unsigned int nrequests = BENCH_DEFAULT_REQUESTS;
+
+  static struct option long_options[] = {
+      {"socket", required_argument, 0, 's'},
+      {"subscribers", required_argument, 0, 'n'},
+      {"requesters", required_argument, 0, 'm'},
+      {"requests", required_argument, 0, 'r'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  while ((o = getopt_long(argc, argv, "s:n:m:r:h", long_options,
+                          &option_index)) != -1) {
+    if (o == 's') {
+      free(socket_path);
+      socket_path = strdup(optarg);
+    } else if (o == 'n' && is_unsigned_int(optarg)) {
+      nsubscribers = atoi(optarg);
+    } else if (o == 'm' && is_unsigned_int(optarg)) {
+      nrequesters = atoi(optarg);
+    } else if (o == 'r' && is_unsigned_int(optarg)) {
+      nrequests = atoi(optarg);
+    } else if (o == 'h') {
+      print_bench_usage();
+      return 0;
+    } else {
+      errx(EXIT_FAILURE, "Invalid option. Try '%s --help'", prog_name);
+    }
+  }
+
+  const int nconns = nsubscribers + nrequesters;
+  BenchConn *conns = calloc(nconns, sizeof(BenchConn));
+  struct pollfd *fds = calloc(nconns, sizeof(struct pollfd));
+  if (conns == NULL || fds == NULL)
+    err(EXIT_FAILURE, "Failed to allocate connections");
+
+  for (int i = 0; i < nconns; i++) {
+    if ((conns[i].fd = connect_to_socket(socket_path)) == -1)
+      err(EXIT_FAILURE, "Failed to connect to socket");
+    conns[i].is_subscriber = i < nsubscribers;
+    if (conns[i].is_subscriber) subscribe_all(&conns[i]);
+    fds[i].fd = conns[i].fd;
+    fds[i].events = POLLIN;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  end = start;
+
+  int active = 0;
+  if (nrequests > 0) {
+    for (int i = nsubscribers; i < nconns; i++) send_request(&conns[i]);
+    active = nrequesters;
+  }
+
+  // Run until all requests were answered and no more events arrived for 100ms
+  for (;;) {
+    int n = poll(fds, nconns, active > 0 ? -1 : 100);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err(EXIT_FAILURE, "Failed to poll sockets");
+    } else if (n == 0) {
+      break;
+    }
+
+    for (int i = 0; i < nconns; i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+
+      BenchConn *c = &conns[i];
+      int was_pending = c->pending;
+
+      handle_message(c);
+
+      if (!was_pending || c->pending) continue;
+
+      if (c->sent < nrequests)
+        send_request(c);
+      else if (--active == 0)
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+  }
+
+  BenchSamples all = {0};
+  for (int i = 0; i < BENCH_REQUEST_LAST; i++)
+    for (size_t j = 0; j < request_samples[i].len; j++)
+      add_sample(&all, request_samples[i].values[j]);
+
+  const double seconds = elapsed_us(&start, &end) / 1e6;
+
+  printf("%d subscribers, %d requesters, %u requests each\n", nsubscribers,
+         nrequesters, nrequests);
+  printf("%zu requests in %.3f s (%.1f requests/s), %zu events received\n",
+         all.len, seconds, seconds > 0 ? all.len / seconds : 0,
+         event_samples.len);
+  puts("");
+  printf("%-16s %8s %10s %10s %10s %10s\n", "latency (us)", "count", "p50",
+         "p99", "p999", "max");
+  for (int i = 0; i < BENCH_REQUEST_LAST; i++)
+    print_samples(bench_request_names[i], &request_samples[i]);
+  print_samples("all requests", &all);
+  print_samples("event delivery", &event_samples);
+
+  for (int i = 0; i < nconns; i++) close(conns[i].fd);
+  for (int i = 0; i < BENCH_REQUEST_LAST; i++) free(request_samples[i].values);
+  free(event_samples.values);
+  free(all.values);
+  free(conns);
+  free(fds);
+  free(socket_path);
+
+  return 0;
+}
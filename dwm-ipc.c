@@ -0,0 +1,308 @@
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dwm-ipc.h"
+
+static const char *DEFAULT_SOCKET_PATH = "/tmp/dwm.sock";
+int sock_fd = -1;
+unsigned int messages_sent = 0;
+int use_request_id = 0;
+uint32_t request_id = 0;
+int reply_has_id = 0;
+uint32_t reply_id = 0;
+
+static int
+recv_message(uint8_t *msg_type, uint32_t *reply_size, uint8_t **reply)
+{
+  uint32_t read_bytes = 0;
+  const int32_t to_read = sizeof(dwm_ipc_header_t);
+  char header[to_read];
+  char *walk = header;
+
+  // Try to read header
+  while (read_bytes < to_read) {
+    ssize_t n = read(sock_fd, header + read_bytes, to_read - read_bytes);
+
+    if (n == 0) {
+      if (read_bytes == 0) {
+        warnx("Unexpectedly reached EOF while reading header.");
+        warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.",
+              read_bytes, to_read);
+        return -2;
+      } else {
+        warnx("Unexpectedly reached EOF while reading header.");
+        warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.",
+              read_bytes, to_read);
+        return -3;
+      }
+    } else if (n == -1) {
+      return -1;
+    }
+
+    read_bytes += n;
+  }
+
+  // Check if magic string in header matches
+  if (memcmp(walk, IPC_MAGIC, IPC_MAGIC_LEN) != 0) {
+    warnx("Invalid magic string. Got '%.*s', expected '%s'",
+         IPC_MAGIC_LEN, walk, IPC_MAGIC);
+    return -3;
+  }
+
+  walk += IPC_MAGIC_LEN;
+
+  // Extract reply size
+  memcpy(reply_size, walk, sizeof(uint32_t));
+  walk += sizeof(uint32_t);
+
+  // Extract message type
+  memcpy(msg_type, walk, sizeof(uint8_t));
+  walk += sizeof(uint8_t);
+
+  // Read the header extension with the request ID of the reply
+  reply_has_id = (*msg_type & IPC_TYPE_FLAG_REQUEST_ID) != 0;
+  *msg_type &= ~IPC_TYPE_FLAG_REQUEST_ID;
+
+  if (reply_has_id) {
+    dwm_ipc_header_ext_t ext;
+
+    read_bytes = 0;
+    while (read_bytes < sizeof(ext)) {
+      ssize_t n = read(sock_fd, (char *)&ext + read_bytes,
+                       sizeof(ext) - read_bytes);
+
+      if (n == 0) {
+        warnx("Unexpectedly reached EOF while reading header extension.");
+        return -3;
+      } else if (n == -1) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        return -1;
+      }
+
+      read_bytes += n;
+    }
+
+    if (ext.version != IPC_HEADER_EXT_VERSION) {
+      warnx("Unsupported header extension version %" PRIu8, ext.version);
+      return -3;
+    }
+    reply_id = ext.request_id;
+  }
+
+  (*reply) = malloc(*reply_size);
+
+  // Extract payload
+  read_bytes = 0;
+  while (read_bytes < *reply_size) {
+    ssize_t n = read(sock_fd, *reply + read_bytes, *reply_size - read_bytes);
+
+    if (n == 0) {
+      warnx("Unexpectedly reached EOF while reading payload.");
+      warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " bytes.",
+            read_bytes, *reply_size);
+      free(*reply);
+      return -2;
+    } else if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      free(*reply);
+      return -1;
+    }
+
+    read_bytes += n;
+  }
+
+  return 0;
+}
+
+int
+read_socket(IPCMessageType *msg_type, uint32_t *msg_size, char **msg)
+{
+  int ret = -1;
+  uint8_t type;
+
+  while (ret != 0) {
+    ret = recv_message(&type, msg_size, (uint8_t **)msg);
+
+    if (ret < 0) {
+      // Try again (non-fatal error)
+      if (ret == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+
+      err(EXIT_FAILURE, "Error receiving response from socket. The connection might have been lost.");
+      exit(2);
+    }
+  }
+
+  *msg_type = type;
+  return 0;
+}
+
+static ssize_t
+write_socket(const void *buf, size_t count)
+{
+  size_t written = 0;
+
+  while (written < count) {
+    const ssize_t n =
+        write(sock_fd, ((uint8_t *)buf) + written, count - written);
+
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      else
+        return n;
+    }
+    written += n;
+  }
+  return written;
+}
+
+int
+connect_to_socket(const char *socket_path)
+{
+  struct sockaddr_un addr;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) {
+    err(EXIT_FAILURE, "Could not create socket");
+  }
+
+  // Initialize struct to 0
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+
+  addr.sun_family = AF_UNIX;
+  if (socket_path != NULL) {
+    strcpy(addr.sun_path, socket_path);
+  } else {
+    strcpy(addr.sun_path, DEFAULT_SOCKET_PATH);
+  }
+
+  if (connect(sock, (const struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+int
+send_message(IPCMessageType msg_type, uint32_t msg_size, uint8_t *msg)
+{
+  dwm_ipc_header_t header = {
+      .magic = IPC_MAGIC_ARR, .size = msg_size, .type = msg_type};
+  dwm_ipc_header_ext_t ext = {.version = IPC_HEADER_EXT_VERSION,
+                              .request_id = request_id};
+
+  size_t header_size = sizeof(dwm_ipc_header_t);
+  size_t ext_size = use_request_id ? sizeof(dwm_ipc_header_ext_t) : 0;
+  size_t total_size = header_size + ext_size + msg_size;
+
+  uint8_t buffer[total_size];
+
+  if (use_request_id) header.type |= IPC_TYPE_FLAG_REQUEST_ID;
+
+  // Copy header to buffer
+  memcpy(buffer, &header, header_size);
+  // Copy header extension to buffer
+  memcpy(buffer + header_size, &ext, ext_size);
+  // Copy message to buffer
+  memcpy(buffer + header_size + ext_size, msg, header.size);
+
+  write_socket(buffer, total_size);
+  messages_sent++;
+
+  return 0;
+}
+
+int
+is_float(const char *s)
+{
+  size_t len = strlen(s);
+  int is_dot_used = 0;
+  int is_minus_used = 0;
+
+  // Floats can only have one decimal point in between or digits
+  // Optionally, floats can also be below zero (negative)
+  for (int i = 0; i < len; i++) {
+    if (isdigit(s[i]))
+      continue;
+    else if (!is_dot_used && s[i] == '.' && i != 0 && i != len - 1) {
+      is_dot_used = 1;
+      continue;
+    } else if (!is_minus_used && s[i] == '-' && i == 0) {
+      is_minus_used = 1;
+      continue;
+    } else
+      return 0;
+  }
+
+  return 1;
+}
+
+int
+is_unsigned_int(const char *s)
+{
+  size_t len = strlen(s);
+
+  // Unsigned int can only have digits
+  for (int i = 0; i < len; i++) {
+    if (isdigit(s[i]))
+      continue;
+    else
+      return 0;
+  }
+
+  return 1;
+}
+
+int
+is_signed_int(const char *s)
+{
+  size_t len = strlen(s);
+
+  // Signed int can only have digits and a negative sign at the start
+  for (int i = 0; i < len; i++) {
+    if (isdigit(s[i]))
+      continue;
+    else if (i == 0 && s[i] == '-') {
+      continue;
+    } else
+      return 0;
+  }
+
+  return 1;
+}
+
+void
+flush_socket_reply(void)
+{
+  IPCMessageType reply_type;
+  uint32_t reply_size;
+  char *reply;
+
+  read_socket(&reply_type, &reply_size, &reply);
+
+  free(reply);
+}
+
+void
+print_socket_reply(void)
+{
+  IPCMessageType reply_type;
+  uint32_t reply_size;
+  char *reply;
+
+  read_socket(&reply_type, &reply_size, &reply);
+
+  printf("%.*s\n", reply_size, reply);
+  fflush(stdout);
+  free(reply);
+}
@@ -0,0 +1,134 @@
+/* See LICENSE file for copyright and license details. */
+// IPC framing shared by dwm-msg and dwm-bench
+#ifndef DWM_IPC_H_
+#define DWM_IPC_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <yajl/yajl_gen.h>
+
+
+#define IPC_MAGIC "DWM-IPC"
+// clang-format off
+#define IPC_MAGIC_ARR { 'D', 'W', 'M', '-', 'I', 'P', 'C' }
+// clang-format on
+#define IPC_MAGIC_LEN 7  // Not including null char
+
+#define IPC_TYPE_FLAG_REQUEST_ID 0x40
+#define IPC_HEADER_EXT_VERSION 1
+
+#define IPC_EVENT_TAG_CHANGE "tag_change_event"
+#define IPC_EVENT_CLIENT_FOCUS_CHANGE "client_focus_change_event"
+#define IPC_EVENT_LAYOUT_CHANGE "layout_change_event"
+#define IPC_EVENT_MONITOR_FOCUS_CHANGE "monitor_focus_change_event"
+#define IPC_EVENT_FOCUSED_TITLE_CHANGE "focused_title_change_event"
+#define IPC_EVENT_FOCUSED_STATE_CHANGE "focused_state_change_event"
+
+#define YSTR(str) yajl_gen_string(gen, (unsigned char *)str, strlen(str))
+#define YINT(num) yajl_gen_integer(gen, num)
+#define YDOUBLE(num) yajl_gen_double(gen, num)
+#define YBOOL(v) yajl_gen_bool(gen, v)
+#define YNULL() yajl_gen_null(gen)
+#define YARR(body)                                                             \
+  {                                                                            \
+    yajl_gen_array_open(gen);                                                  \
+    body;                                                                      \
+    yajl_gen_array_close(gen);                                                 \
+  }
+#define YMAP(body)                                                             \
+  {                                                                            \
+    yajl_gen_map_open(gen);                                                    \
+    body;                                                                      \
+    yajl_gen_map_close(gen);                                                   \
+  }
+
+typedef enum IPCMessageType {
+  IPC_TYPE_RUN_COMMAND = 0,
+  IPC_TYPE_GET_MONITORS = 1,
+  IPC_TYPE_GET_TAGS = 2,
+  IPC_TYPE_GET_LAYOUTS = 3,
+  IPC_TYPE_GET_DWM_CLIENT = 4,
+  IPC_TYPE_SUBSCRIBE = 5,
+  IPC_TYPE_EVENT = 6,
+  IPC_TYPE_HANDSHAKE = 7,
+  IPC_TYPE_RUN_BATCH = 8,
+  IPC_TYPE_GET_CHANGES_SINCE = 9,
+  IPC_TYPE_GET_COMMANDS = 10,
+  IPC_TYPE_GET_STATS = 11
+} IPCMessageType;
+
+// Every IPC message must begin with this
+typedef struct dwm_ipc_header {
+  uint8_t magic[IPC_MAGIC_LEN];
+  uint32_t size;
+  uint8_t type;
+} __attribute((packed)) dwm_ipc_header_t;
+
+// Follows the header of messages with IPC_TYPE_FLAG_REQUEST_ID set
+typedef struct dwm_ipc_header_ext {
+  uint8_t version;
+  uint32_t request_id;
+} __attribute((packed)) dwm_ipc_header_ext_t;
+
+extern int sock_fd;
+// Number of messages written to the socket so far
+extern unsigned int messages_sent;
+// Request ID attached to messages sent while use_request_id is set
+extern int use_request_id;
+extern uint32_t request_id;
+// Request ID echoed in the header of the last received message, if any
+extern int reply_has_id;
+extern uint32_t reply_id;
+
+/**
+ * Connect to the dwm IPC socket at socket_path, or the default socket path if
+ * socket_path is NULL.
+ *
+ * Returns the socket file descriptor, or -1 if the connection failed
+ */
+int connect_to_socket(const char *socket_path);
+
+/**
+ * Send a message of type msg_type with the specified payload to sock_fd. The
+ * message carries request_id if use_request_id is set.
+ *
+ * Returns 0
+ */
+int send_message(IPCMessageType msg_type, uint32_t msg_size, uint8_t *msg);
+
+/**
+ * Read the next message from sock_fd. The payload is allocated with malloc
+ * and must be freed by the caller. Exits on a fatal socket error.
+ *
+ * Returns 0
+ */
+int read_socket(IPCMessageType *msg_type, uint32_t *msg_size, char **msg);
+
+/**
+ * Read the next message from sock_fd and discard it
+ */
+void flush_socket_reply(void);
+
+/**
+ * Read the next message from sock_fd and print its payload to stdout
+ */
+void print_socket_reply(void);
+
+/**
+ * Returns 1 if s is a decimal number, 0 otherwise
+ */
+int is_float(const char *s);
+
+/**
+ * Returns 1 if s only contains digits, 0 otherwise
+ */
+int is_unsigned_int(const char *s);
+
+/**
+ * Returns 1 if s only contains digits with an optional leading '-', 0
+ * otherwise
+ */
+int is_signed_int(const char *s);
+
+#endif  // DWM_IPC_H_
@@ -1,324 +1,208 @@
 #include <getopt.h>
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <unistd.h>
 #include <yajl/yajl_gen.h>
 
-#define IPC_MAGIC "DWM-IPC"
-// clang-format off
-#define IPC_MAGIC_ARR { 'D', 'W', 'M', '-', 'I', 'P', 'C' }
-// clang-format on
-#define IPC_MAGIC_LEN 7  // Not including null char
-
-#define IPC_EVENT_TAG_CHANGE "tag_change_event"
-#define IPC_EVENT_CLIENT_FOCUS_CHANGE "client_focus_change_event"
-#define IPC_EVENT_LAYOUT_CHANGE "layout_change_event"
-#define IPC_EVENT_MONITOR_FOCUS_CHANGE "monitor_focus_change_event"
-#define IPC_EVENT_FOCUSED_TITLE_CHANGE "focused_title_change_event"
-#define IPC_EVENT_FOCUSED_STATE_CHANGE "focused_state_change_event"
-
-#define YSTR(str) yajl_gen_string(gen, (unsigned char *)str, strlen(str))
-#define YINT(num) yajl_gen_integer(gen, num)
-#define YDOUBLE(num) yajl_gen_double(gen, num)
-#define YBOOL(v) yajl_gen_bool(gen, v)
-#define YNULL() yajl_gen_null(gen)
-#define YARR(body)                                                             \
-  {                                                                            \
-    yajl_gen_array_open(gen);                                                  \
-    body;                                                                      \
-    yajl_gen_array_close(gen);                                                 \
-  }
-#define YMAP(body)                                                             \
-  {                                                                            \
-    yajl_gen_map_open(gen);                                                    \
-    body;                                                                      \
-    yajl_gen_map_close(gen);                                                   \
-  }
+#include "dwm-ipc.h"
 
 const char *prog_name;
 
 typedef unsigned long Window;
 
-const char *DEFAULT_SOCKET_PATH = "/tmp/dwm.sock";
-static int sock_fd = -1;
 static unsigned int ignore_reply = 0;
+// Sequence number of the last event received, -1 to not replay events
+static long since_seq = -1;
 
-typedef enum IPCMessageType {
-  IPC_TYPE_RUN_COMMAND = 0,
-  IPC_TYPE_GET_MONITORS = 1,
-  IPC_TYPE_GET_TAGS = 2,
-  IPC_TYPE_GET_LAYOUTS = 3,
-  IPC_TYPE_GET_DWM_CLIENT = 4,
-  IPC_TYPE_SUBSCRIBE = 5,
-  IPC_TYPE_EVENT = 6
-} IPCMessageType;
+// Set in --stdin mode, where replies are read by the main loop as they arrive
+static int stdin_mode = 0;
 
-// Every IPC message must begin with this
-typedef struct dwm_ipc_header {
-  uint8_t magic[IPC_MAGIC_LEN];
-  uint32_t size;
-  uint8_t type;
-} __attribute((packed)) dwm_ipc_header_t;
+/**
+ * Wait for the reply to the message that was just sent. In --stdin mode the
+ * reply is read later by the main loop instead.
+ */
+static void
+receive_reply(int print)
+{
+  if (stdin_mode) return;
 
+  if (print)
+    print_socket_reply();
+  else
+    flush_socket_reply();
+}
 
-static int
-recv_message(uint8_t *msg_type, uint32_t *reply_size, uint8_t **reply)
+static void
+gen_command(yajl_gen gen, const char *name, char *args[], int argc)
 {
-  uint32_t read_bytes = 0;
-  const int32_t to_read = sizeof(dwm_ipc_header_t);
-  char header[to_read];
-  char *walk = header;
-
-  // Try to read header
-  while (read_bytes < to_read) {
-    ssize_t n = read(sock_fd, header + read_bytes, to_read - read_bytes);
-
-    if (n == 0) {
-      if (read_bytes == 0) {
-        warnx("Unexpectedly reached EOF while reading header.");
-        warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.",
-              read_bytes, to_read);
-        return -2;
-      } else {
-        warnx("Unexpectedly reached EOF while reading header.");
-        warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.",
-              read_bytes, to_read);
-        return -3;
+  // Command format:
+  // {
+  //   "command": "<name>",
+  //   "args": [ ... ]
+  // }
+  // clang-format off
+  YMAP(
+    YSTR("command"); YSTR(name);
+    YSTR("args"); YARR(
+      for (int i = 0; i < argc; i++) {
+        if (is_signed_int(args[i])) {
+          long long num = atoll(args[i]);
+          YINT(num);
+        } else if (is_float(args[i])) {
+          float num = atof(args[i]);
+          YDOUBLE(num);
+        } else {
+          YSTR(args[i]);
+        }
       }
-    } else if (n == -1) {
-      return -1;
-    }
-
-    read_bytes += n;
-  }
+    )
+  )
+  // clang-format on
+}
 
-  // Check if magic string in header matches
-  if (memcmp(walk, IPC_MAGIC, IPC_MAGIC_LEN) != 0) {
-    warnx("Invalid magic string. Got '%.*s', expected '%s'",
-         IPC_MAGIC_LEN, walk, IPC_MAGIC);
-    return -3;
-  }
+static int
+run_command(const char *name, char *args[], int argc)
+{
+  const unsigned char *msg;
+  size_t msg_size;
 
-  walk += IPC_MAGIC_LEN;
+  yajl_gen gen = yajl_gen_alloc(NULL);
 
-  // Extract reply size
-  memcpy(reply_size, walk, sizeof(uint32_t));
-  walk += sizeof(uint32_t);
+  gen_command(gen, name, args, argc);
 
-  // Extract message type
-  memcpy(msg_type, walk, sizeof(uint8_t));
-  walk += sizeof(uint8_t);
+  yajl_gen_get_buf(gen, &msg, &msg_size);
 
-  (*reply) = malloc(*reply_size);
+  send_message(IPC_TYPE_RUN_COMMAND, msg_size, (uint8_t *)msg);
 
-  // Extract payload
-  read_bytes = 0;
-  while (read_bytes < *reply_size) {
-    ssize_t n = read(sock_fd, *reply + read_bytes, *reply_size - read_bytes);
+  receive_reply(!ignore_reply);
 
-    if (n == 0) {
-      warnx("Unexpectedly reached EOF while reading payload.");
-      warnx("Read %" PRIu32 " bytes, expected %" PRIu32 " bytes.",
-            read_bytes, *reply_size);
-      free(*reply);
-      return -2;
-    } else if (n == -1) {
-      if (errno == EINTR || errno == EAGAIN) continue;
-      free(*reply);
-      return -1;
-    }
-
-    read_bytes += n;
-  }
+  yajl_gen_free(gen);
 
   return 0;
 }
 
+/**
+ * Send several commands in one IPC_TYPE_RUN_BATCH message. Commands and their
+ * arguments are given as a single list, with commands separated by a ","
+ * argument.
+ */
 static int
-read_socket(IPCMessageType *msg_type, uint32_t *msg_size, char **msg)
+run_batch(char *args[], int argc)
 {
-  int ret = -1;
-
-  while (ret != 0) {
-    ret = recv_message((uint8_t *)msg_type, msg_size, (uint8_t **)msg);
+  const unsigned char *msg;
+  size_t msg_size;
 
-    if (ret < 0) {
-      // Try again (non-fatal error)
-      if (ret == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+  yajl_gen gen = yajl_gen_alloc(NULL);
 
-      err(EXIT_FAILURE, "Error receiving response from socket. The connection might have been lost.");
-      exit(2);
-    }
+  // Message format:
+  // [
+  //   { "command": "<name>", "args": [ ... ] },
+  //   ...
+  // ]
+  yajl_gen_array_open(gen);
+  for (int start = 0, i = 0; i <= argc; i++) {
+    if (i < argc && strcmp(args[i], ",") != 0) continue;
+    if (i > start)
+      gen_command(gen, args[start], args + start + 1, i - start - 1);
+    start = i + 1;
   }
+  yajl_gen_array_close(gen);
 
-  return 0;
-}
+  yajl_gen_get_buf(gen, &msg, &msg_size);
 
-static ssize_t
-write_socket(const void *buf, size_t count)
-{
-  size_t written = 0;
+  send_message(IPC_TYPE_RUN_BATCH, msg_size, (uint8_t *)msg);
 
-  while (written < count) {
-    const ssize_t n =
-        write(sock_fd, ((uint8_t *)buf) + written, count - written);
+  receive_reply(!ignore_reply);
 
-    if (n == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-        continue;
-      else
-        return n;
-    }
-    written += n;
-  }
-  return written;
+  yajl_gen_free(gen);
+
+  return 0;
 }
 
-int
-connect_to_socket(const char *socket_path)
+static int
+get_monitors(int monitor, char *fields[], int fields_len)
 {
-  struct sockaddr_un addr;
-
-  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sock == -1) {
-    err(EXIT_FAILURE, "Could not create socket");
-  }
+  const unsigned char *msg = (const unsigned char *)"";
+  size_t msg_size = 1;
 
-  // Initialize struct to 0
-  memset(&addr, 0, sizeof(struct sockaddr_un));
+  yajl_gen gen = yajl_gen_alloc(NULL);
 
-  addr.sun_family = AF_UNIX;
-  if (socket_path != NULL) {
-    strcpy(addr.sun_path, socket_path);
-  } else {
-    strcpy(addr.sun_path, DEFAULT_SOCKET_PATH);
-  }
+  // Message format, empty to get all fields of all monitors:
+  // {
+  //   "monitor": <monitor>,
+  //   "fields": [ "<field>", ... ]
+  // }
+  if (monitor >= 0 || fields_len > 0) {
+    // clang-format off
+    YMAP(
+      if (monitor >= 0) {
+        YSTR("monitor"); YINT(monitor);
+      }
+      if (fields_len > 0) {
+        YSTR("fields"); YARR(
+          for (int i = 0; i < fields_len; i++) YSTR(fields[i]);
+        )
+      }
+    )
+    // clang-format on
 
-  if (connect(sock, (const struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
-    close(sock);
-    return -1;
+    yajl_gen_get_buf(gen, &msg, &msg_size);
   }
 
-  return sock;
-}
-
-static int
-send_message(IPCMessageType msg_type, uint32_t msg_size, uint8_t *msg)
-{
-  dwm_ipc_header_t header = {
-      .magic = IPC_MAGIC_ARR, .size = msg_size, .type = msg_type};
-
-  size_t header_size = sizeof(dwm_ipc_header_t);
-  size_t total_size = header_size + msg_size;
+  send_message(IPC_TYPE_GET_MONITORS, msg_size, (uint8_t *)msg);
 
-  uint8_t buffer[total_size];
+  receive_reply(1);
 
-  // Copy header to buffer
-  memcpy(buffer, &header, header_size);
-  // Copy message to buffer
-  memcpy(buffer + header_size, msg, header.size);
-
-  write_socket(buffer, total_size);
+  yajl_gen_free(gen);
 
   return 0;
 }
 
 static int
-is_float(const char *s)
+get_tags()
 {
-  size_t len = strlen(s);
-  int is_dot_used = 0;
-  int is_minus_used = 0;
-
-  // Floats can only have one decimal point in between or digits
-  // Optionally, floats can also be below zero (negative)
-  for (int i = 0; i < len; i++) {
-    if (isdigit(s[i]))
-      continue;
-    else if (!is_dot_used && s[i] == '.' && i != 0 && i != len - 1) {
-      is_dot_used = 1;
-      continue;
-    } else if (!is_minus_used && s[i] == '-' && i == 0) {
-      is_minus_used = 1;
-      continue;
-    } else
-      return 0;
-  }
+  send_message(IPC_TYPE_GET_TAGS, 1, (uint8_t *)"");
+  receive_reply(1);
 
-  return 1;
+  return 0;
 }
 
 static int
-is_unsigned_int(const char *s)
+get_layouts()
 {
-  size_t len = strlen(s);
-
-  // Unsigned int can only have digits
-  for (int i = 0; i < len; i++) {
-    if (isdigit(s[i]))
-      continue;
-    else
-      return 0;
-  }
+  send_message(IPC_TYPE_GET_LAYOUTS, 1, (uint8_t *)"");
+  receive_reply(1);
 
-  return 1;
+  return 0;
 }
 
 static int
-is_signed_int(const char *s)
-{
-  size_t len = strlen(s);
-
-  // Signed int can only have digits and a negative sign at the start
-  for (int i = 0; i < len; i++) {
-    if (isdigit(s[i]))
-      continue;
-    else if (i == 0 && s[i] == '-') {
-      continue;
-    } else
-      return 0;
-  }
-
-  return 1;
-}
-
-static void
-flush_socket_reply()
+get_commands()
 {
-  IPCMessageType reply_type;
-  uint32_t reply_size;
-  char *reply;
-
-  read_socket(&reply_type, &reply_size, &reply);
+  send_message(IPC_TYPE_GET_COMMANDS, 1, (uint8_t *)"");
+  receive_reply(1);
 
-  free(reply);
+  return 0;
 }
 
-static void
-print_socket_reply()
+static int
+get_stats()
 {
-  IPCMessageType reply_type;
-  uint32_t reply_size;
-  char *reply;
-
-  read_socket(&reply_type, &reply_size, &reply);
+  send_message(IPC_TYPE_GET_STATS, 1, (uint8_t *)"");
+  receive_reply(1);
 
-  printf("%.*s\n", reply_size, reply);
-  fflush(stdout);
-  free(reply);
+  return 0;
 }
 
 static int
-run_command(const char *name, char *args[], int argc)
+get_dwm_client(Window win, char *fields[], int fields_len)
 {
   const unsigned char *msg;
   size_t msg_size;
@@ -327,36 +211,25 @@ run_command(const char *name, char *args[], int argc)
 
   // Message format:
   // {
-  //   "command": "<name>",
-  //   "args": [ ... ]
+  //   "client_window_id": "<win>",
+  //   "fields": [ "<field>", ... ]
   // }
   // clang-format off
   YMAP(
-    YSTR("command"); YSTR(name);
-    YSTR("args"); YARR(
-      for (int i = 0; i < argc; i++) {
-        if (is_signed_int(args[i])) {
-          long long num = atoll(args[i]);
-          YINT(num);
-        } else if (is_float(args[i])) {
-          float num = atof(args[i]);
-          YDOUBLE(num);
-        } else {
-          YSTR(args[i]);
-        }
-      }
-    )
+    YSTR("client_window_id"); YINT(win);
+    if (fields_len > 0) {
+      YSTR("fields"); YARR(
+        for (int i = 0; i < fields_len; i++) YSTR(fields[i]);
+      )
+    }
   )
   // clang-format on
 
   yajl_gen_get_buf(gen, &msg, &msg_size);
 
-  send_message(IPC_TYPE_RUN_COMMAND, msg_size, (uint8_t *)msg);
+  send_message(IPC_TYPE_GET_DWM_CLIENT, msg_size, (uint8_t *)msg);
 
-  if (!ignore_reply)
-    print_socket_reply();
-  else
-    flush_socket_reply();
+  receive_reply(1);
 
   yajl_gen_free(gen);
 
@@ -364,33 +237,7 @@ run_command(const char *name, char *args[], int argc)
 }
 
 static int
-get_monitors()
-{
-  send_message(IPC_TYPE_GET_MONITORS, 1, (uint8_t *)"");
-  print_socket_reply();
-  return 0;
-}
-
-static int
-get_tags()
-{
-  send_message(IPC_TYPE_GET_TAGS, 1, (uint8_t *)"");
-  print_socket_reply();
-
-  return 0;
-}
-
-static int
-get_layouts()
-{
-  send_message(IPC_TYPE_GET_LAYOUTS, 1, (uint8_t *)"");
-  print_socket_reply();
-
-  return 0;
-}
-
-static int
-get_dwm_client(Window win)
+get_changes_since(unsigned long generation)
 {
   const unsigned char *msg;
   size_t msg_size;
@@ -399,19 +246,19 @@ get_dwm_client(Window win)
 
   // Message format:
   // {
-  //   "client_window_id": "<win>"
+  //   "generation": <generation>
   // }
   // clang-format off
   YMAP(
-    YSTR("client_window_id"); YINT(win);
+    YSTR("generation"); YINT(generation);
   )
   // clang-format on
 
   yajl_gen_get_buf(gen, &msg, &msg_size);
 
-  send_message(IPC_TYPE_GET_DWM_CLIENT, msg_size, (uint8_t *)msg);
+  send_message(IPC_TYPE_GET_CHANGES_SINCE, msg_size, (uint8_t *)msg);
 
-  print_socket_reply();
+  receive_reply(1);
 
   yajl_gen_free(gen);
 
@@ -429,12 +276,16 @@ subscribe(const char *event)
   // Message format:
   // {
   //   "event": "<event>",
-  //   "action": "subscribe"
+  //   "action": "subscribe",
+  //   "since_seq": <since_seq>
   // }
   // clang-format off
   YMAP(
     YSTR("event"); YSTR(event);
     YSTR("action"); YSTR("subscribe");
+    if (since_seq >= 0) {
+      YSTR("since_seq"); YINT(since_seq);
+    }
   )
   // clang-format on
 
@@ -442,12 +293,264 @@ subscribe(const char *event)
 
   send_message(IPC_TYPE_SUBSCRIBE, msg_size, (uint8_t *)msg);
 
-  if (!ignore_reply)
-    print_socket_reply();
+  receive_reply(!ignore_reply);
+
+  yajl_gen_free(gen);
+
+  return 0;
+}
+
+/**
+ * Convert the name of a message type given to -t to its IPCMessageType
+ *
+ * Returns 0 if the name is a known message type
+ * Returns -1 otherwise
+ */
+static int
+message_type_stoi(const char *name, IPCMessageType *type)
+{
+  if (strcasecmp(name, "command") == 0 || strcasecmp(name, "run_command") == 0)
+    *type = IPC_TYPE_RUN_COMMAND;
+  else if (strcasecmp(name, "run_batch") == 0)
+    *type = IPC_TYPE_RUN_BATCH;
+  else if (strcasecmp(name, "get_monitors") == 0)
+    *type = IPC_TYPE_GET_MONITORS;
+  else if (strcasecmp(name, "get_tags") == 0)
+    *type = IPC_TYPE_GET_TAGS;
+  else if (strcasecmp(name, "get_layouts") == 0)
+    *type = IPC_TYPE_GET_LAYOUTS;
+  else if (strcasecmp(name, "get_dwm_client") == 0)
+    *type = IPC_TYPE_GET_DWM_CLIENT;
+  else if (strcasecmp(name, "get_commands") == 0)
+    *type = IPC_TYPE_GET_COMMANDS;
+  else if (strcasecmp(name, "get_stats") == 0)
+    *type = IPC_TYPE_GET_STATS;
+  else if (strcasecmp(name, "get_changes_since") == 0)
+    *type = IPC_TYPE_GET_CHANGES_SINCE;
+  else if (strcasecmp(name, "subscribe") == 0)
+    *type = IPC_TYPE_SUBSCRIBE;
   else
-    flush_socket_reply();
+    return -1;
+  return 0;
+}
 
+/**
+ * Send a message of the specified type with the given arguments, which are in
+ * the same form as on the command line.
+ *
+ * Returns 0 if the message was sent
+ * Returns -1 if the arguments are invalid, error is set to the reason
+ */
+static int
+send_request(IPCMessageType type, char *args[], int argc, const char **error)
+{
+  if (type == IPC_TYPE_RUN_COMMAND) {
+    if (argc < 1) {
+      *error = "No command specified";
+      return -1;
+    }
+    // Command arguments are everything after command name
+    run_command(args[0], args + 1, argc - 1);
+  } else if (type == IPC_TYPE_RUN_BATCH) {
+    if (argc < 1) {
+      *error = "No command specified";
+      return -1;
+    }
+    run_batch(args, argc);
+  } else if (type == IPC_TYPE_GET_MONITORS) {
+    // An optional monitor number comes before the fields
+    if (argc > 0 && is_unsigned_int(args[0]))
+      get_monitors(atoi(args[0]), args + 1, argc - 1);
+    else
+      get_monitors(-1, args, argc);
+  } else if (type == IPC_TYPE_GET_TAGS) {
+    get_tags();
+  } else if (type == IPC_TYPE_GET_LAYOUTS) {
+    get_layouts();
+  } else if (type == IPC_TYPE_GET_COMMANDS) {
+    get_commands();
+  } else if (type == IPC_TYPE_GET_STATS) {
+    get_stats();
+  } else if (type == IPC_TYPE_GET_DWM_CLIENT) {
+    if (argc < 1) {
+      *error = "Expected the window id";
+      return -1;
+    } else if (!is_unsigned_int(args[0])) {
+      *error = "Expected unsigned integer argument";
+      return -1;
+    }
+    get_dwm_client(atol(args[0]), args + 1, argc - 1);
+  } else if (type == IPC_TYPE_GET_CHANGES_SINCE) {
+    if (argc < 1) {
+      *error = "Expected the generation";
+      return -1;
+    } else if (!is_unsigned_int(args[0])) {
+      *error = "Expected unsigned integer argument";
+      return -1;
+    }
+    get_changes_since(strtoul(args[0], NULL, 10));
+  } else if (type == IPC_TYPE_SUBSCRIBE) {
+    if (argc < 1) {
+      *error = "Expected event name";
+      return -1;
+    }
+    for (int i = 0; i < argc; i++) subscribe(args[i]);
+  }
+
+  return 0;
+}
+
+/**
+ * Print an error for an input line in the same format as the replies of dwm
+ */
+static void
+print_line_error(unsigned int line, const char *reason)
+{
+  const unsigned char *msg;
+  size_t msg_size;
+  yajl_gen gen = yajl_gen_alloc(NULL);
+
+  // clang-format off
+  YMAP(
+    YSTR("result"); YSTR("error");
+    YSTR("reason"); YSTR(reason);
+  )
+  // clang-format on
+
+  yajl_gen_get_buf(gen, &msg, &msg_size);
+  printf("%u\t%.*s\n", line, (int)msg_size, msg);
+  fflush(stdout);
   yajl_gen_free(gen);
+}
+
+/**
+ * Send the request on an input line of --stdin mode. The line consists of the
+ * message type followed by its arguments separated by whitespace, as they
+ * would be given on the command line.
+ */
+static void
+handle_stdin_line(char *text, unsigned int line)
+{
+  IPCMessageType type = IPC_TYPE_RUN_COMMAND;
+  const char *error = NULL;
+  // A line of n characters has at most n / 2 + 1 words
+  char **args = malloc((strlen(text) / 2 + 1) * sizeof(char *));
+  int argc = 0;
+
+  if (args == NULL) err(EXIT_FAILURE, "Failed to allocate arguments");
+
+  for (char *tok = strtok(text, " \t\r"); tok; tok = strtok(NULL, " \t\r"))
+    args[argc++] = tok;
+
+  if (argc == 0) {
+    free(args);
+    return;
+  }
+
+  // Replies are matched to their line by the request ID
+  request_id = line;
+
+  if (message_type_stoi(args[0], &type) < 0)
+    print_line_error(line, "Unknown message type");
+  else if (send_request(type, args + 1, argc - 1, &error) < 0)
+    print_line_error(line, error);
+
+  free(args);
+}
+
+/**
+ * Keep the connection open and read newline-delimited requests from stdin.
+ * Requests are sent as soon as they are read without waiting for replies of
+ * earlier requests. Every request carries its line number as request ID, which
+ * dwm echoes in the reply, so each reply is printed with the line number of
+ * its request, and events are printed with "event". Runs until stdin is closed
+ * and all replies have been received.
+ */
+static int
+run_stdin()
+{
+  unsigned int replies = 0;
+  char *input = NULL;
+  size_t input_len = 0, input_cap = 0;
+  unsigned int line = 0;
+  int stdin_open = 1;
+
+  // Ask for compact JSON so that every message fits on a single output line
+  const char *handshake = "{\"format\":\"json\",\"beautify\":false}";
+  send_message(IPC_TYPE_HANDSHAKE, strlen(handshake) + 1, (uint8_t *)handshake);
+  flush_socket_reply();
+
+  use_request_id = 1;
+  const unsigned int handshake_sent = messages_sent;
+
+  while (stdin_open || handshake_sent + replies < messages_sent) {
+    struct pollfd fds[] = {{sock_fd, POLLIN, 0},
+                           {STDIN_FILENO, stdin_open ? POLLIN : 0, 0}};
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      err(EXIT_FAILURE, "Failed to poll");
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      IPCMessageType type;
+      uint32_t size;
+      char *msg;
+
+      read_socket(&type, &size, &msg);
+
+      // Replies to success messages are suppressed the same way as without
+      // --stdin
+      const int print =
+          !ignore_reply || (type != IPC_TYPE_RUN_COMMAND &&
+                            type != IPC_TYPE_RUN_BATCH &&
+                            type != IPC_TYPE_SUBSCRIBE);
+
+      if (type == IPC_TYPE_EVENT) {
+        printf("event\t%.*s\n", size, msg);
+      } else {
+        replies++;
+        if (print && reply_has_id)
+          printf("%" PRIu32 "\t%.*s\n", reply_id, size, msg);
+        else if (print)
+          printf("?\t%.*s\n", size, msg);
+      }
+      fflush(stdout);
+      free(msg);
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP)) {
+      if (input_cap - input_len < BUFSIZ) {
+        input_cap = input_cap ? input_cap * 2 : BUFSIZ * 2;
+        input = realloc(input, input_cap);
+        if (input == NULL) err(EXIT_FAILURE, "Failed to allocate input");
+      }
+
+      ssize_t n = read(STDIN_FILENO, input + input_len, input_cap - input_len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) err(EXIT_FAILURE, "Failed to read stdin");
+
+      input_len += n;
+      // Treat a final line without a newline as complete at EOF
+      if (n == 0) {
+        stdin_open = 0;
+        if (input_len > 0 && input[input_len - 1] != '\n')
+          input[input_len++] = '\n';
+      }
+
+      char *start = input, *end;
+      while ((end = memchr(start, '\n', input + input_len - start)) != NULL) {
+        *end = '\0';
+        handle_stdin_line(start, ++line);
+        start = end + 1;
+      }
+
+      input_len -= start - input;
+      memmove(input, start, input_len);
+    }
+  }
+
+  free(input);
 
   return 0;
 }
@@ -470,19 +573,35 @@ usage_error(const char *format, ...)
 static void
 print_usage()
 {
-  printf("usage: %s [-s <socket>] [-i] [-m] [-t <command>] <message>\n", prog_name);
+  printf("usage: %s [-s <socket>] [-i] [-m] [-S <seq>] [-t <command>] <message>\n", prog_name);
   puts("Communicate with DWM, the suckless window manager.");
   puts("");
   puts("Commands:");
   puts("  -t run_command <name> [args...] Run an IPC command");
   puts("");
-  puts("  -t get_monitors                 Get monitor properties");
+  puts("  -t run_batch <name> [args...] [, <name> [args...]]...");
+  puts("                                  Run several IPC commands at once");
+  puts("");
+  puts("  -t get_monitors [monitor] [fields...]");
+  puts("                                  Get monitor properties, optionally");
+  puts("                                  of one monitor and only the fields");
+  puts("                                  given");
   puts("");
   puts("  -t get_tags                     Get list of tags");
   puts("");
   puts("  -t get_layouts                  Get list of layouts");
   puts("");
-  puts("  -t get_dwm_client <window_id>   Get dwm client proprties");
+  puts("  -t get_commands                 Get list of IPC commands and events");
+  puts("");
+  puts("  -t get_stats                    Get IPC and event loop statistics");
+  puts("");
+  puts("  -t get_dwm_client <window_id> [fields...]");
+  puts("                                  Get dwm client proprties, optionally");
+  puts("                                  only the fields given");
+  puts("");
+  puts("  -t get_changes_since <generation>");
+  puts("                                  Get monitors and clients changed or");
+  puts("                                  removed since the generation");
   puts("");
   puts("  -t subscribe [events...]        Subscribe to specified events");
   puts("                                  Options: " IPC_EVENT_TAG_CHANGE ",");
@@ -495,11 +614,23 @@ print_usage()
   puts("Other options:");
   puts("  -h, --help                      Display this message");
   puts("  -i, --ignore-reply              Don't print \"success\" reply messages from");
-  puts("                                    run_command and subscribe.");
+  puts("                                    run_command, run_batch and subscribe.");
   puts("  -m, --monitor                   Use with the subscribe command to keep");
   puts("                                    listening for dwm events instead of exiting");
   puts("                                    immediately after recieving a reply (which");
   puts("                                    is thedefault behavior)."); 
+  puts("  -S, --since <seq>               Use with the subscribe command to first");
+  puts("                                    receive the events after the \"seq\" of");
+  puts("                                    the last event received, if dwm still");
+  puts("                                    has them.");
+  puts("  -c, --stdin                     Keep the connection open and read one");
+  puts("                                    message per line from stdin, given as");
+  puts("                                    the type followed by its arguments, for");
+  puts("                                    example \"run_command view 2\". Requests");
+  puts("                                    are not delayed by replies. Each reply");
+  puts("                                    is printed on one line after the input");
+  puts("                                    line number of its request and a tab,");
+  puts("                                    events after \"event\" and a tab.");
   puts("");
 }
 
@@ -517,36 +648,30 @@ main(int argc, char *argv[])
     {"type", required_argument, 0, 't'},
     {"ignore-reply", no_argument, 0, 'i'},
     {"monitor", no_argument, 0, 'm'},
+    {"since", required_argument, 0, 'S'},
+    {"stdin", no_argument, 0, 'c'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}};
 
-  char *options_string = "+s:t:him";
+  char *options_string = "+s:t:himS:c";
 
   while ((o = getopt_long(argc, argv, options_string, long_options, &option_index)) != -1) {
     if (o == 's') {
       free(socket_path);
       socket_path = strdup(optarg);
     } else if (o == 't') {
-      if (strcasecmp(optarg, "command") == 0) {
-        message_type = IPC_TYPE_RUN_COMMAND;
-      } else if (strcasecmp(optarg, "run_command") == 0) {
-        message_type = IPC_TYPE_RUN_COMMAND;
-      } else if (strcasecmp(optarg, "get_monitors") == 0) {
-        message_type = IPC_TYPE_GET_MONITORS;
-      } else if (strcasecmp(optarg, "get_tags") == 0) {
-        message_type = IPC_TYPE_GET_TAGS;
-      } else if (strcasecmp(optarg, "get_layouts") == 0) {
-        message_type = IPC_TYPE_GET_LAYOUTS;
-      } else if (strcasecmp(optarg, "get_dwm_client") == 0) {
-        message_type = IPC_TYPE_GET_DWM_CLIENT;
-      } else if (strcasecmp(optarg, "subscribe") == 0) {
-        message_type = IPC_TYPE_SUBSCRIBE;
-      } else
-        usage_error("Unknown message type (known types: command, get_monitors, get_tags, get_layouts, get_dwm_client, subscribe)");
+      if (message_type_stoi(optarg, &message_type) < 0)
+        usage_error("Unknown message type (known types: command, run_batch, get_monitors, get_tags, get_layouts, get_commands, get_stats, get_dwm_client, get_changes_since, subscribe)");
     } else if (o == 'i') {
       ignore_reply = 1;
     } else if (o == 'm') {
       monitor = 1;
+    } else if (o == 'S') {
+      if (!is_unsigned_int(optarg))
+        usage_error("Expected unsigned integer argument for --since");
+      since_seq = atol(optarg);
+    } else if (o == 'c') {
+      stdin_mode = 1;
     } else if (o == 'h') {
       print_usage();
       return 0;
@@ -557,6 +682,10 @@ main(int argc, char *argv[])
 
   if (monitor && message_type != IPC_TYPE_SUBSCRIBE)
     usage_error("The monitor option -m is used with \"-t subscribe\" exclusively.");
+  if (since_seq >= 0 && message_type != IPC_TYPE_SUBSCRIBE && !stdin_mode)
+    usage_error("The since option -S is used with \"-t subscribe\" exclusively.");
+  if (stdin_mode && optind < argc)
+    usage_error("Messages are read from stdin with --stdin");
 
   sock_fd = connect_to_socket(socket_path);
   if (sock_fd == -1) {
@@ -564,35 +693,13 @@ main(int argc, char *argv[])
     return 1;
   }
 
-  if (message_type == IPC_TYPE_RUN_COMMAND) {
-    if (optind >= argc) usage_error("No command specified");
-    // Command name
-    char *command = argv[optind];
-    // Command arguments are everything after command name
-    char **command_args = argv + ++optind;
-    // Number of command arguments
-    int command_argc = argc - optind;
-    run_command(command, command_args, command_argc);
-  } else if (message_type == IPC_TYPE_GET_MONITORS) {
-    get_monitors();
-  } else if (message_type == IPC_TYPE_GET_TAGS) {
-    get_tags();
-  } else if (message_type == IPC_TYPE_GET_LAYOUTS) {
-    get_layouts();
-  } else if (message_type == IPC_TYPE_GET_DWM_CLIENT) {
-  if (optind < argc) {
-      if (is_unsigned_int(argv[optind])) {
-        Window win = atol(argv[optind]);
-        get_dwm_client(win);
-      } else
-        usage_error("Expected unsigned integer argument");
-    } else
-      usage_error("Expected the window id");
-  } else if (message_type == IPC_TYPE_SUBSCRIBE) {
-    if (optind < argc) {
-      for (int j = optind; j < argc; j++) subscribe(argv[j]);
-    } else
-      usage_error("Expected event name");
+  if (stdin_mode) return run_stdin();
+
+  const char *error = NULL;
+  if (send_request(message_type, argv + optind, argc - optind, &error) < 0)
+    usage_error("%s", error);
+
+  if (message_type == IPC_TYPE_SUBSCRIBE) {
     // Keep listening for events forever
     do {
       print_socket_reply();
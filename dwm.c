@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -57,6 +58,7 @@
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
 #define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define HASHWIN(W, N)           (((W) ^ ((W) >> 16)) & ((N) - 1))
 
 /* enums */
 enum { CurNormal, CurResize, CurMove, CurLast }; /* cursor */
@@ -65,6 +67,7 @@ enum { NetSupported, NetWMName, NetWMState, NetWMCheck,
        NetWMFullscreen, NetActiveWindow, NetWMWindowType,
        NetWMWindowTypeDialog, NetClientList, NetLast }; /* EWMH atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
+enum { StatusNone, StatusRoot, StatusText }; /* pending status updates */
 enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
 
@@ -108,9 +111,12 @@ struct Client {
 	int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen;
 	Client *next;
 	Client *snext;
+	Client *hnext; /* next client in the same clienthash bucket */
 	Monitor *mon;
 	Window win;
 	ClientState prevstate;
+	unsigned long gen; /* generation of the last change, see ipc.c */
+	unsigned long long genhash;
 };
 
 typedef struct {
@@ -126,6 +132,12 @@ typedef struct {
 } Layout;
 
 
+typedef struct {
+	int x, w;
+	unsigned long long key; /* hash of what was drawn */
+	int dirty;
+} BarSeg;
+
 struct Monitor {
 	char ltsymbol[16];
 	char lastltsymbol[16];
@@ -139,6 +151,8 @@ struct Monitor {
 	unsigned int sellt;
 	unsigned int tagset[2];
 	TagState tagstate;
+	unsigned int occ, urg; /* tags with clients, tags with urgent clients */
+	int ntagged[32], nurgent[32]; /* clients per tag, see struct NumTags */
 	int showbar;
 	int topbar;
 	Client *clients;
@@ -147,8 +161,12 @@ struct Monitor {
 	Client *stack;
 	Monitor *next;
 	Window barwin;
+	BarSeg bar[32 + 3]; /* tags, layout symbol, title and status */
+	int barredraw; /* repaint every segment on the next drawbar */
 	const Layout *lt[2];
 	const Layout *lastlt;
+	unsigned long gen; /* generation of the last change, see ipc.c */
+	unsigned long long genhash;
 };
 
 typedef struct {
@@ -166,7 +184,9 @@ static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interac
 static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
 static void attach(Client *c);
+static void attachhash(Client *c);
 static void attachstack(Client *c);
+static int barseg(Monitor *m, unsigned int i, int x, int w, unsigned long flags, const char *text);
 static void buttonpress(XEvent *e);
 static void checkotherwm(void);
 static void cleanup(void);
@@ -175,15 +195,18 @@ static void clientmessage(XEvent *e);
 static void configure(Client *c);
 static void configurenotify(XEvent *e);
 static void configurerequest(XEvent *e);
+static void counttags(Client *c, int n);
 static Monitor *createmon(void);
 static void destroynotify(XEvent *e);
 static void detach(Client *c);
+static void detachhash(Client *c);
 static void detachstack(Client *c);
 static Monitor *dirtomon(int dir);
 static void drawbar(Monitor *m);
 static void drawbars(void);
 static void enternotify(XEvent *e);
 static void expose(XEvent *e);
+static int flushstatus(void);
 static void focus(Client *c);
 static void focusin(XEvent *e);
 static void focusmon(const Arg *arg);
@@ -195,6 +218,7 @@ static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
 static void grabbuttons(Client *c, int focused);
 static void grabkeys(void);
 static int handlexevent(struct epoll_event *ev);
+static void holdarrange(int hold);
 static void incnmaster(const Arg *arg);
 static void keypress(XEvent *e);
 static void killclient(const Arg *arg);
@@ -223,6 +247,7 @@ static void setfullscreen(Client *c, int fullscreen);
 static void setlayout(const Arg *arg);
 static void setlayoutsafe(const Arg *arg);
 static void setmfact(const Arg *arg);
+static void setstatus(const Arg *arg);
 static void setup(void);
 static void setupepoll(void);
 static void seturgent(Client *c, int urg);
@@ -260,6 +285,9 @@ static void zoom(const Arg *arg);
 /* variables */
 static const char broken[] = "broken";
 static char stext[256];
+static char nextstext[256]; /* status text set through setstatus */
+static int statuspending = StatusNone;
+static long long laststatus; /* ms on the monotonic clock */
 static int screen;
 static int sw, sh;           /* X display screen geometry width, height */
 static int bh, blw = 0;      /* bar geometry */
@@ -291,15 +319,24 @@ static Clr **scheme;
 static Display *dpy;
 static Drw *drw;
 static Monitor *mons, *selmon, *lastselmon;
+static Monitor *heldmon; /* monitor to arrange after holdarrange, NULL = all */
+static int arrangeheld, arrangepending;
+static int syncheld; /* resizeclient leaves the XSync to the end of arrange */
+static Client **clienthash; /* managed clients by window, see wintoclient */
+static Pool clientpool = { sizeof(Client), 32 };
+static unsigned int hashsize, nhashed;
 static Window root, wmcheckwin;
 
 #include "ipc.h"
 
+static IPCEpollType dpy_epoll_type = IPC_EPOLL_DISPLAY;
+
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
 #ifdef VERSION
 #include "IPCClient.c"
+#include "cbor_gen.c"
 #include "yajl_dumps.c"
 #include "ipc.c"
 #endif
@@ -413,6 +450,14 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 void
 arrange(Monitor *m)
 {
+	if (arrangeheld) {
+		heldmon = (!arrangepending || heldmon == m) ? m : NULL;
+		arrangepending = 1;
+		return;
+	}
+	/* queue the configures of all windows, then wait for the server
+	 * once, in restack or below */
+	syncheld++;
 	if (m)
 		showhide(m->stack);
 	else for (m = mons; m; m = m->next)
@@ -420,8 +465,12 @@ arrange(Monitor *m)
 	if (m) {
 		arrangemon(m);
 		restack(m);
-	} else for (m = mons; m; m = m->next)
-		arrangemon(m);
+	} else {
+		for (m = mons; m; m = m->next)
+			arrangemon(m);
+		XSync(dpy, False);
+	}
+	syncheld--;
 }
 
 void
@@ -437,6 +486,32 @@ attach(Client *c)
 {
 	c->next = c->mon->clients;
 	c->mon->clients = c;
+	counttags(c, 1);
+}
+
+void
+attachhash(Client *c)
+{
+	unsigned int i, n;
+	Client **t, *h;
+
+	if (nhashed >= hashsize) { /* keep at most one client per bucket on average */
+		n = hashsize ? hashsize * 2 : 64;
+		t = ecalloc(n, sizeof(Client *));
+		for (i = 0; i < hashsize; i++)
+			while ((h = clienthash[i])) {
+				clienthash[i] = h->hnext;
+				h->hnext = t[HASHWIN(h->win, n)];
+				t[HASHWIN(h->win, n)] = h;
+			}
+		free(clienthash);
+		clienthash = t;
+		hashsize = n;
+	}
+	i = HASHWIN(c->win, hashsize);
+	c->hnext = clienthash[i];
+	clienthash[i] = c;
+	nhashed++;
 }
 
 void
@@ -446,6 +521,21 @@ attachstack(Client *c)
 	c->mon->stack = c;
 }
 
+int
+barseg(Monitor *m, unsigned int i, int x, int w, unsigned long flags, const char *text)
+{
+	BarSeg *s = &m->bar[i];
+	unsigned long long key = (14695981039346656037ULL ^ flags) * 1099511628211ULL;
+
+	for (; text && *text; text++)
+		key = (key ^ (unsigned char)*text) * 1099511628211ULL;
+	s->dirty = m->barredraw || s->x != x || s->w != w || s->key != key;
+	s->x = x;
+	s->w = w;
+	s->key = key;
+	return s->dirty;
+}
+
 void
 buttonpress(XEvent *e)
 {
@@ -512,6 +602,8 @@ cleanup(void)
 	for (m = mons; m; m = m->next)
 		while (m->stack)
 			unmanage(m->stack, 0);
+	free(clienthash);
+	pooldestroy(&clientpool);
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	while (mons)
 		cleanupmon(mons);
@@ -545,6 +637,7 @@ cleanupmon(Monitor *mon)
 	}
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	ipc_monitor_removed(mon->num);
 	free(mon);
 }
 
@@ -666,6 +759,29 @@ configurerequest(XEvent *e)
 	XSync(dpy, False);
 }
 
+void
+counttags(Client *c, int n)
+{
+	unsigned int i;
+	Monitor *m = c->mon;
+
+	/* adds n to the per-tag counters of c's monitor, c must be attached */
+	for (i = 0; i < LENGTH(tags); i++) {
+		if (!(c->tags & 1 << i))
+			continue;
+		if ((m->ntagged[i] += n))
+			m->occ |= 1 << i;
+		else
+			m->occ &= ~(1 << i);
+		if (!c->isurgent)
+			continue;
+		if ((m->nurgent[i] += n))
+			m->urg |= 1 << i;
+		else
+			m->urg &= ~(1 << i);
+	}
+}
+
 Monitor *
 createmon(void)
 {
@@ -680,6 +796,7 @@ createmon(void)
 	m->lt[0] = &layouts[0];
 	m->lt[1] = &layouts[1 % LENGTH(layouts)];
 	strncpy(m->ltsymbol, layouts[0].symbol, sizeof m->ltsymbol);
+	m->barredraw = 1;
 	return m;
 }
 
@@ -700,6 +817,17 @@ detach(Client *c)
 
 	for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next);
 	*tc = c->next;
+	counttags(c, -1);
+}
+
+void
+detachhash(Client *c)
+{
+	Client **tc;
+
+	for (tc = &clienthash[HASHWIN(c->win, hashsize)]; *tc && *tc != c; tc = &(*tc)->hnext);
+	*tc = c->hnext;
+	nhashed--;
 }
 
 void
@@ -737,48 +865,75 @@ drawbar(Monitor *m)
 	int x, w, tw = 0;
 	int boxs = drw->fonts->h / 9;
 	int boxw = drw->fonts->h / 6 + 2;
-	unsigned int i, occ = 0, urg = 0;
-	Client *c;
+	unsigned int i, j, occ = m->occ, urg = m->urg;
+	unsigned int lt = LENGTH(tags), ti = lt + 1, st = lt + 2;
+	Client *c = m->sel;
+	uint64_t start = ipc_stats_time();
+
+	/* find the segments that changed since they were last drawn */
+	if (m == selmon) /* status is only drawn on selected monitor */
+		tw = TEXTW(stext) - lrpad + 2; /* 2px right padding */
+	barseg(m, st, m->ww - tw, tw, 0, m == selmon ? stext : NULL);
+	for (i = 0, x = 0; i < LENGTH(tags); x += m->bar[i++].w)
+		barseg(m, i, x, TEXTW(tags[i]), (m->tagset[m->seltags] >> i & 1)
+			| (urg >> i & 1) << 1 | (occ >> i & 1) << 2
+			| (m == selmon && selmon->sel && selmon->sel->tags >> i & 1) << 3, NULL);
+	w = blw = TEXTW(m->ltsymbol);
+	barseg(m, lt, x, w, 0, m->ltsymbol);
+	x += w;
+	barseg(m, ti, x, m->ww - tw - x, c ? 1 | (m == selmon) << 1
+		| c->isfloating << 2 | c->isfixed << 3 : 0, c ? c->name : NULL);
+	/* a status too long to fit is overdrawn by everything in front of it */
+	if (m->bar[st].dirty && m->ww - tw < x)
+		for (i = 0; i < st; i++)
+			m->bar[i].dirty = 1;
 
 	/* draw status first so it can be overdrawn by tags later */
-	if (m == selmon) { /* status is only drawn on selected monitor */
+	if (m->bar[st].dirty && tw) {
 		drw_setscheme(drw, scheme[SchemeNorm]);
-		tw = TEXTW(stext) - lrpad + 2; /* 2px right padding */
 		drw_text(drw, m->ww - tw, 0, tw, bh, 0, stext, 0);
 	}
 
-	for (c = m->clients; c; c = c->next) {
-		occ |= c->tags;
-		if (c->isurgent)
-			urg |= c->tags;
-	}
-	x = 0;
 	for (i = 0; i < LENGTH(tags); i++) {
-		w = TEXTW(tags[i]);
+		if (!m->bar[i].dirty)
+			continue;
+		x = m->bar[i].x;
 		drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
-		drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
+		drw_text(drw, x, 0, m->bar[i].w, bh, lrpad / 2, tags[i], urg & 1 << i);
 		if (occ & 1 << i)
 			drw_rect(drw, x + boxs, boxs, boxw, boxw,
 				m == selmon && selmon->sel && selmon->sel->tags & 1 << i,
 				urg & 1 << i);
-		x += w;
 	}
-	w = blw = TEXTW(m->ltsymbol);
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+	if (m->bar[lt].dirty) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_text(drw, m->bar[lt].x, 0, m->bar[lt].w, bh, lrpad / 2, m->ltsymbol, 0);
+	}
 
-	if ((w = m->ww - tw - x) > bh) {
-		if (m->sel) {
+	x = m->bar[ti].x;
+	if (m->bar[ti].dirty && (w = m->bar[ti].w) > bh) {
+		if (c) {
 			drw_setscheme(drw, scheme[m == selmon ? SchemeSel : SchemeNorm]);
-			drw_text(drw, x, 0, w, bh, lrpad / 2, m->sel->name, 0);
-			if (m->sel->isfloating)
-				drw_rect(drw, x + boxs, boxs, boxw, boxw, m->sel->isfixed, 0);
+			drw_text(drw, x, 0, w, bh, lrpad / 2, c->name, 0);
+			if (c->isfloating)
+				drw_rect(drw, x + boxs, boxs, boxw, boxw, c->isfixed, 0);
 		} else {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_rect(drw, x, 0, w, bh, 1, 1);
 		}
+	} else {
+		m->bar[ti].dirty = 0;
+	}
+
+	/* copy each run of adjacent repainted segments to the bar window */
+	for (i = 0; i <= st; i = j + 1) {
+		for (j = i; j <= st && m->bar[j].dirty; j++)
+			m->bar[j].dirty = 0;
+		if (j > i && (w = m->bar[j - 1].x + m->bar[j - 1].w - m->bar[i].x) > 0)
+			drw_map(drw, m->barwin, m->bar[i].x, 0, w, bh);
 	}
-	drw_map(drw, m->barwin, 0, 0, m->ww, bh);
+	m->barredraw = 0;
+	ipc_stats_drawbar(start);
 }
 
 void
@@ -815,8 +970,29 @@ expose(XEvent *e)
 	Monitor *m;
 	XExposeEvent *ev = &e->xexpose;
 
-	if (ev->count == 0 && (m = wintomon(ev->window)))
+	if (ev->count == 0 && (m = wintomon(ev->window))) {
+		m->barredraw = 1;
 		drawbar(m);
+	}
+}
+
+int
+flushstatus(void)
+{
+	struct timespec ts;
+	long long now;
+
+	if (statuspending == StatusNone)
+		return 0;
+	if (statusinterval) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+		if (now - laststatus < statusinterval)
+			return statusinterval - (now - laststatus);
+		laststatus = now;
+	}
+	updatestatus();
+	return 0;
 }
 
 void
@@ -1007,13 +1183,17 @@ handlexevent(struct epoll_event *ev)
 {
 	if (ev->events & EPOLLIN) {
 		XEvent ev;
+		unsigned int n = 0;
 		while (running && XPending(dpy)) {
 			XNextEvent(dpy, &ev);
+			n++;
 			if (handler[ev.type]) {
 				handler[ev.type](&ev); /* call handler */
-				ipc_send_events(mons, &lastselmon, selmon);
 			}
 		}
+		ipc_stats_x_events(n);
+		if (n)
+			ipc_mark_changed();
 	} else if (ev-> events & EPOLLHUP) {
 		return -1;
 	}
@@ -1021,6 +1201,21 @@ handlexevent(struct epoll_event *ev)
 	return 0;
 }
 
+void
+holdarrange(int hold)
+{
+	/* arrange() calls between holdarrange(1) and holdarrange(0) are
+	 * merged into a single arrange() when the outermost hold ends */
+	if (hold) {
+		arrangeheld++;
+		return;
+	}
+	if (--arrangeheld > 0 || !arrangepending)
+		return;
+	arrangepending = 0;
+	arrange(heldmon);
+}
+
 void
 incnmaster(const Arg *arg)
 {
@@ -1079,7 +1274,8 @@ manage(Window w, XWindowAttributes *wa)
 	Window trans = None;
 	XWindowChanges wc;
 
-	c = ecalloc(1, sizeof(Client));
+	if (!(c = poolalloc(&clientpool)))
+		die("poolalloc:");
 	c->win = w;
 	/* geometry */
 	c->x = c->oldx = wa->x;
@@ -1113,7 +1309,6 @@ manage(Window w, XWindowAttributes *wa)
 	configure(c); /* propagates border_width, if size doesn't change */
 	updatewindowtype(c);
 	updatesizehints(c);
-	updatewmhints(c);
 	XSelectInput(dpy, w, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
 	grabbuttons(c, 0);
 	if (!c->isfloating)
@@ -1122,6 +1317,8 @@ manage(Window w, XWindowAttributes *wa)
 		XRaiseWindow(dpy, c->win);
 	attach(c);
 	attachstack(c);
+	attachhash(c);
+	updatewmhints(c); /* after attach, urgency is counted per tag */
 	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
 		(unsigned char *) &(c->win), 1);
 	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
@@ -1274,7 +1471,7 @@ propertynotify(XEvent *e)
 	XPropertyEvent *ev = &e->xproperty;
 
 	if ((ev->window == root) && (ev->atom == XA_WM_NAME))
-		updatestatus();
+		statuspending = StatusRoot; /* read once in flushstatus */
 	else if (ev->state == PropertyDelete)
 		return; /* ignore */
 	else if ((c = wintoclient(ev->window))) {
@@ -1342,7 +1539,8 @@ resizeclient(Client *c, int x, int y, int w, int h)
 	wc.border_width = c->bw;
 	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
 	configure(c);
-	XSync(dpy, False);
+	if (!syncheld)
+		XSync(dpy, False);
 }
 
 void
@@ -1430,39 +1628,98 @@ restack(Monitor *m)
 void
 run(void)
 {
-	int event_count = 0;
-	const int MAX_EVENTS = 10;
-	struct epoll_event events[MAX_EVENTS];
+	int event_count = 0, fd;
+	struct epoll_event events[MAX(epollevents, 1)];
+	int timeout = -1, statuswait, debouncing = 0, xqueued;
+	struct epoll_event xev = { .events = EPOLLIN };
+	struct timespec now, deadline = { 0 };
 
 	XSync(dpy, False);
 
 	/* main event loop */
 	while (running) {
-		event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		/* send the requests queued by the last iteration in one go;
+		 * events an XSync already read into Xlib's queue are not
+		 * reported by epoll, so don't sleep while there are any */
+		xqueued = XEventsQueued(dpy, QueuedAfterFlush);
+		event_count = epoll_wait(epoll_fd, events, LENGTH(events),
+				xqueued ? 0 : timeout);
+
+		/* X input first, so it never waits behind IPC traffic */
+		for (int i = 0; i < event_count; i++) {
+			if (*(IPCEpollType *)events[i].data.ptr != IPC_EPOLL_DISPLAY)
+				continue;
+			// -1 means EPOLLHUP
+			if (handlexevent(events + i) == -1)
+				return;
+			xqueued = 0;
+		}
+		if (xqueued)
+			handlexevent(&xev);
 
 		for (int i = 0; i < event_count; i++) {
-			int event_fd = events[i].data.fd;
-			DEBUG("Got event from fd %d\n", event_fd);
-
-			if (event_fd == dpy_fd) {
-				// -1 means EPOLLHUP
-				if (handlexevent(events + i) == -1)
-					return;
-			} else if (event_fd == ipc_get_sock_fd()) {
+			IPCEpollType type = *(IPCEpollType *)events[i].data.ptr;
+			DEBUG("Got event of type %d\n", type);
+
+			switch (type) {
+			case IPC_EPOLL_DISPLAY:
+				break;
+			case IPC_EPOLL_SOCKET:
 				ipc_handle_socket_epoll_event(events + i);
-			} else if (ipc_is_client_registered(event_fd)){
-				if (ipc_handle_client_epoll_event(events + i, mons, &lastselmon, selmon,
-							tags, LENGTH(tags), layouts, LENGTH(layouts)) < 0) {
-					fprintf(stderr, "Error handling IPC event on fd %d\n", event_fd);
-				}
-			} else {
-				fprintf(stderr, "Got event from unknown fd %d, ptr %p, u32 %d, u64 %lu",
-						event_fd, events[i].data.ptr, events[i].data.u32,
-						events[i].data.u64);
+				break;
+			case IPC_EPOLL_CLIENT:
+				/* the client is freed if it had to be dropped */
+				fd = ((IPCClient *)events[i].data.ptr)->fd;
+				if (ipc_handle_client_epoll_event(events + i, mons, selmon,
+							tags, LENGTH(tags), layouts, LENGTH(layouts)) < 0)
+					fprintf(stderr, "Error handling IPC event on fd %d\n", fd);
+				break;
+			case IPC_EPOLL_TIMER:
+				ipc_handle_timer_epoll_event(events + i);
+				break;
+			default:
+				fprintf(stderr, "Got event of unknown type %d, ptr %p",
+						type, events[i].data.ptr);
 				fprintf(stderr, " with events %d\n", events[i].events);
 				return;
 			}
 		}
+
+		/* coalesce status updates, at most one redraw every
+		 * statusinterval ms */
+		statuswait = flushstatus();
+
+		/* report the net state change of everything handled so far, at
+		 * most once every ipcdebounce ms */
+		if (!ipcdebounce) {
+			ipc_send_events(mons, &lastselmon, selmon);
+			ipc_flush_clients();
+			timeout = statuswait ? statuswait : -1;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!debouncing) {
+			debouncing = 1;
+			deadline = now;
+			deadline.tv_sec += ipcdebounce / 1000;
+			deadline.tv_nsec += (ipcdebounce % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+		}
+		timeout = (deadline.tv_sec - now.tv_sec) * 1000
+			+ (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+		if (timeout <= 0) {
+			ipc_send_events(mons, &lastselmon, selmon);
+			debouncing = 0;
+			timeout = -1;
+		}
+		if (statuswait && (timeout == -1 || statuswait < timeout))
+			timeout = statuswait;
+
+		/* one write per client for everything queued this iteration */
+		ipc_flush_clients();
 	}
 }
 
@@ -1624,6 +1881,13 @@ setmfact(const Arg *arg)
 	arrange(selmon);
 }
 
+void
+setstatus(const Arg *arg)
+{
+	strncpy(nextstext, arg->v, sizeof(nextstext) - 1);
+	statuspending = StatusText;
+}
+
 void
 setup(void)
 {
@@ -1712,15 +1976,21 @@ setupepoll(void)
 	}
 
 	dpy_event.events = EPOLLIN;
-	dpy_event.data.fd = dpy_fd;
+	dpy_event.data.ptr = &dpy_epoll_type;
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dpy_fd, &dpy_event)) {
 		fputs("Failed to add display file descriptor to epoll", stderr);
 		close(epoll_fd);
 		exit(1);
 	}
 
-	if (ipc_init(ipcsockpath, epoll_fd, ipccommands, LENGTH(ipccommands)) < 0) {
+	if (ipc_init(ipcsockpath, epoll_fd, ipccommands, LENGTH(ipccommands),
+				ipcbeautify, ipchighwater, ipclowwater, ipcevictgrace,
+				ipcbacklog, ipcedgetriggered) < 0) {
 		fputs("Failed to initialize IPC\n", stderr);
+	} else {
+		ipc_stats_pool("client", &clientpool);
+		if (ipcstatepath)
+			ipc_state_init(ipcstatepath);
 	}
 }
 
@@ -1729,7 +1999,9 @@ seturgent(Client *c, int urg)
 {
 	XWMHints *wmh;
 
+	counttags(c, -1);
 	c->isurgent = urg;
+	counttags(c, 1);
 	if (!(wmh = XGetWMHints(dpy, c->win)))
 		return;
 	wmh->flags = urg ? (wmh->flags | XUrgencyHint) : (wmh->flags & ~XUrgencyHint);
@@ -1783,7 +2055,9 @@ void
 tag(const Arg *arg)
 {
 	if (selmon->sel && arg->ui & TAGMASK) {
+		counttags(selmon->sel, -1);
 		selmon->sel->tags = arg->ui & TAGMASK;
+		counttags(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -1857,7 +2131,9 @@ toggletag(const Arg *arg)
 		return;
 	newtags = selmon->sel->tags ^ (arg->ui & TAGMASK);
 	if (newtags) {
+		counttags(selmon->sel, -1);
 		selmon->sel->tags = newtags;
+		counttags(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -1896,6 +2172,7 @@ unmanage(Client *c, int destroyed)
 
 	detach(c);
 	detachstack(c);
+	detachhash(c);
 	if (!destroyed) {
 		wc.border_width = c->oldbw;
 		XGrabServer(dpy); /* avoid race conditions */
@@ -1907,7 +2184,8 @@ unmanage(Client *c, int destroyed)
 		XSetErrorHandler(xerror);
 		XUngrabServer(dpy);
 	}
-	free(c);
+	ipc_client_removed(c->win);
+	poolfree(&clientpool, c);
 	focus(NULL);
 	updateclientlist();
 	arrange(m);
@@ -2023,7 +2301,7 @@ updategeom(void)
 				for (m = mons; m && m->next; m = m->next);
 				while ((c = m->clients)) {
 					dirty = 1;
-					m->clients = c->next;
+					detach(c);
 					detachstack(c);
 					c->mon = mons;
 					attach(c);
@@ -2116,8 +2394,16 @@ updatesizehints(Client *c)
 void
 updatestatus(void)
 {
-	if (!gettextprop(root, XA_WM_NAME, stext, sizeof(stext)))
-		strcpy(stext, "dwm-"VERSION);
+	char text[sizeof(stext)];
+
+	if (statuspending == StatusText)
+		strcpy(text, nextstext);
+	else if (!gettextprop(root, XA_WM_NAME, text, sizeof(text)))
+		strcpy(text, "dwm-"VERSION);
+	statuspending = StatusNone;
+	if (!strcmp(text, stext))
+		return;
+	strcpy(stext, text);
 	drawbar(selmon);
 }
 
@@ -2159,8 +2445,11 @@ updatewmhints(Client *c)
 		if (c == selmon->sel && wmh->flags & XUrgencyHint) {
 			wmh->flags &= ~XUrgencyHint;
 			XSetWMHints(dpy, c->win, wmh);
-		} else
+		} else {
+			counttags(c, -1);
 			c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
+			counttags(c, 1);
+		}
 		if (wmh->flags & InputHint)
 			c->neverfocus = !wmh->input;
 		else
@@ -2185,12 +2474,12 @@ Client *
 wintoclient(Window w)
 {
 	Client *c;
-	Monitor *m;
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->win == w)
-				return c;
+	if (!hashsize)
+		return NULL;
+	for (c = clienthash[HASHWIN(w, hashsize)]; c; c = c->hnext)
+		if (c->win == w)
+			return c;
 	return NULL;
 }
 
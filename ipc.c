@@ -3,14 +3,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <yajl/yajl_gen.h>
+#include <yajl/yajl_parse.h>
 #include <yajl/yajl_tree.h>
 
 #include "util.h"
@@ -18,21 +27,282 @@
 
 static struct sockaddr_un sockaddr;
 static struct epoll_event sock_epoll_event;
+static IPCEpollType sock_epoll_type = IPC_EPOLL_SOCKET;
+// Wakes dwm up once held events may be sent under their rate limit
+static struct epoll_event timer_epoll_event;
+static IPCEpollType timer_epoll_type = IPC_EPOLL_TIMER;
+static int timer_fd = -1;
+// CLOCK_MONOTONIC time in milliseconds the timer is armed for, 0 if disarmed
+static uint64_t ipc_timer_due = 0;
 static IPCClientList ipc_clients = NULL;
+// Connected clients indexed by file descriptor
+static IPCClient **ipc_client_table = NULL;
+static int ipc_client_table_len = 0;
+// Connected clients and the chunks of their scratch arenas, which are kept
+// around for the next clients once the clients are dropped
+static Pool ipc_client_pool = {sizeof(IPCClient), 16};
+static Pool ipc_chunk_pool = {IPC_ARENA_CHUNK, 8};
+// Clients with frames queued since the last ipc_flush_clients
+static IPCClient *ipc_flush_list = NULL;
+// Mapped state snapshot and its path, NULL if there is none. The next update
+// is built in ipc_state_next and only published if it differs.
+static IPCStateSnapshot *ipc_state = NULL;
+static IPCStateSnapshot ipc_state_next;
+static char *ipc_state_path = NULL;
 static int epoll_fd = -1;
 static int sock_fd = -1;
 static IPCCommand *ipc_commands;
 static unsigned int ipc_commands_len;
+// Format of newly connected clients
+static IPCFormat ipc_default_format = IPC_FORMAT_JSON;
+// Limits of the outgoing queue of each client, see ipc_update_congestion
+static uint32_t ipc_high_watermark = 0;
+static uint32_t ipc_low_watermark = 0;
+static unsigned int ipc_evict_grace = 0;
+// EPOLLET if clients are registered edge triggered, 0 otherwise
+static uint32_t ipc_client_trigger = 0;
+// Generators are kept for the lifetime of the module and reused for every
+// message encoded in their format
+static IPCGen ipc_gens[IPC_FORMAT_LAST];
 // Max size is 1 MB
 static const uint32_t MAX_MESSAGE_SIZE = 1000000;
-static const int IPC_SOCKET_BACKLOG = 5;
+// Maximum number of queued frames handed to a single writev() call
+#define IPC_WRITE_IOV_MAX 64
+// Maximum number of pools reported by IPC_TYPE_GET_STATS
+#define IPC_STATS_POOLS 8
+// Maximum length of the reason reported for a failed command
+#define IPC_REASON_MAX 256
+// Offset basis of the FNV-1a hash, see ipc_hash
+#define IPC_HASH_INIT 14695981039346656037ULL
+
+/**
+ * Open addressing hash table from names to their index in an array
+ */
+typedef struct IPCNameSlot {
+  const char *name;
+  int index;
+} IPCNameSlot;
+
+typedef struct IPCNameTable {
+  IPCNameSlot *slots;
+  uint32_t mask;
+} IPCNameTable;
+
+// Lookup tables for the names of ipc_commands and ipc_event_names, built at
+// ipc_init
+static IPCNameTable ipc_command_table;
+static IPCNameTable ipc_event_table;
+
+// Names of the events, indexed by the bit of the IPCEvent. The index is also
+// the ID that clients can use instead of the name, see get_commands.
+static const char *ipc_event_names[] = {
+    "tag_change_event",           "client_focus_change_event",
+    "layout_change_event",        "monitor_focus_change_event",
+    "focused_title_change_event", "focused_state_change_event"};
+
+// Names of the message types in stats, indexed by IPCMessageType
+static const char *ipc_message_type_names[] = {
+    "run_command",       "get_monitors",   "get_tags",
+    "get_layouts",       "get_dwm_client", "subscribe",
+    "event",             "handshake",      "run_batch",
+    "get_changes_since", "get_commands",   "get_stats"};
+
+// Counts dispatched events, see IPCClient.event_round
+static unsigned int ipc_event_round = 0;
+// Number of removed monitors and clients remembered for get_changes_since
+#define IPC_REMOVALS_MAX 256
+
+/**
+ * A monitor or client that was removed, and the generation it was removed at
+ */
+typedef struct IPCRemoval {
+  int is_monitor;
+  unsigned long id;
+  unsigned long generation;
+} IPCRemoval;
+
+// Generation of the most recent change to any monitor or client. Monitors and
+// clients are assigned a new generation when they are found to have changed,
+// see ipc_update_generations.
+static unsigned long ipc_generation = 0;
+// Set once dwm may have changed monitors or clients since the generations were
+// last brought up to date, see ipc_mark_changed
+static int ipc_generations_stale = 1;
+// Encoded replies to queries that only change with dwm's state, indexed by
+// message type and format. The frames carry no request ID.
+static IPCFrame *ipc_reply_cache[IPC_TYPE_GET_COMMANDS + 1][IPC_FORMAT_LAST];
+// Generation the cached get_monitors reply of each format was encoded at
+static unsigned long ipc_monitors_cache_gen[IPC_FORMAT_LAST];
+// Ring of the most recent removals
+static IPCRemoval ipc_removals[IPC_REMOVALS_MAX];
+static unsigned int ipc_removals_start = 0;
+static unsigned int ipc_removals_len = 0;
+// Generation of the newest removal that was pushed out of the ring. Changes
+// since an earlier generation can no longer be computed.
+static unsigned long ipc_removals_floor = 0;
+
+/**
+ * Counters and histograms reported by IPC_TYPE_GET_STATS. Durations are in
+ * microseconds.
+ */
+typedef struct IPCStats {
+  uint64_t start_ms;
+  // Time to handle each type of message, indexed by IPCMessageType
+  IPCHistogram messages[IPC_TYPE_GET_STATS + 1];
+  IPCHistogram send_events;
+  IPCHistogram drawbar;
+  // Number of X events handled per wakeup of the event loop
+  IPCHistogram x_events;
+  // Events of each type that were generated, queued for subscribers, held
+  // back and merged into an event that was already held back, indexed like
+  // IPCClient.filters
+  uint64_t events_emitted[IPC_CLIENT_EVENTS];
+  uint64_t events_sent[IPC_CLIENT_EVENTS];
+  uint64_t events_held[IPC_CLIENT_EVENTS];
+  uint64_t events_conflated[IPC_CLIENT_EVENTS];
+  // Totals over all clients, including the ones that have disconnected
+  uint64_t connections;
+  uint64_t congestions;
+  uint64_t evictions;
+  uint64_t bytes_queued;
+  uint64_t bytes_written;
+  uint32_t buffer_size_max;
+  // Allocation pools registered with ipc_stats_pool
+  const char *pool_names[IPC_STATS_POOLS];
+  const Pool *pools[IPC_STATS_POOLS];
+  unsigned int pools_len;
+} IPCStats;
+
+static IPCStats ipc_stats;
+
+/**
+ * An event that is being dispatched to subscribers, along with everything
+ * needed to encode it again if it is held back for some of them. An event
+ * concerns up to two monitors and client windows, such as the old and new
+ * focused client. Unused entries are -1 and 0 respectively.
+ */
+typedef struct IPCEventData {
+  IPCEvent event;
+  int monitors[2];
+  Window windows[2];
+  // Old and new side of the change, depending on the event. The
+  // client_focus_change_event and monitor_focus_change_event keep theirs in
+  // windows and monitors.
+  union {
+    struct {
+      TagState old_state, new_state;
+    } tag;
+    struct {
+      char old_symbol[16], new_symbol[16];
+      const Layout *old_layout, *new_layout;
+    } layout;
+    struct {
+      char old_name[256], new_name[256];
+    } title;
+    struct {
+      ClientState old_state, new_state;
+    } state;
+  } u;
+  unsigned int round;
+  // Sequence number of the event, see ipc_event_seq. A held event that others
+  // were merged into has the sequence number of the latest one.
+  unsigned long seq;
+  // Format and fields of the group of subscribers being encoded for
+  IPCFormat format;
+  unsigned int fields;
+} IPCEventData;
+
+// Number of recent events remembered to replay to reconnecting subscribers
+#define IPC_REPLAY_MAX 128
+
+/**
+ * An event remembered for replay, along with the frames it was sent in to
+ * subscribers that select all of its fields
+ */
+typedef struct IPCReplayEvent {
+  IPCEventData data;
+  // Encoding of the event with all fields in each format, NULL until the event
+  // is sent or replayed in that format
+  IPCFrame *frames[IPC_FORMAT_LAST];
+} IPCReplayEvent;
+
+// Sequence number of the most recent event. Every event is assigned the next
+// sequence number when it is dispatched, whether or not anyone receives it.
+static unsigned long ipc_event_seq = 0;
+// Ring of the most recent events, the newest one has sequence number
+// ipc_event_seq
+static IPCReplayEvent ipc_replay[IPC_REPLAY_MAX];
+static unsigned int ipc_replay_start = 0;
+static unsigned int ipc_replay_len = 0;
+
+// Names of the event fields that a subscription filter can select
+static const struct {
+  const char *name;
+  IPCEventField field;
+} ipc_event_fields[] = {
+    {"monitor_number", IPC_FIELD_MONITOR_NUMBER},
+    {"old_state", IPC_FIELD_OLD_STATE},
+    {"new_state", IPC_FIELD_NEW_STATE},
+    {"old_win_id", IPC_FIELD_OLD_WIN_ID},
+    {"new_win_id", IPC_FIELD_NEW_WIN_ID},
+    {"old_symbol", IPC_FIELD_OLD_SYMBOL},
+    {"old_address", IPC_FIELD_OLD_ADDRESS},
+    {"new_symbol", IPC_FIELD_NEW_SYMBOL},
+    {"new_address", IPC_FIELD_NEW_ADDRESS},
+    {"old_monitor_number", IPC_FIELD_OLD_MONITOR_NUMBER},
+    {"new_monitor_number", IPC_FIELD_NEW_MONITOR_NUMBER},
+    {"client_window_id", IPC_FIELD_CLIENT_WINDOW_ID},
+    {"old_name", IPC_FIELD_OLD_NAME},
+    {"new_name", IPC_FIELD_NEW_NAME}};
+
+// Names of the client and monitor fields that a query can select, these match
+// the keys written by dump_client and dump_monitor
+static const struct {
+  const char *name;
+  IPCQueryField field;
+} ipc_query_fields[] = {
+    {"generation", IPC_QUERY_GENERATION},
+    {"name", IPC_QUERY_NAME},
+    {"tags", IPC_QUERY_TAGS},
+    {"window_id", IPC_QUERY_WINDOW_ID},
+    {"monitor_number", IPC_QUERY_MONITOR_NUMBER},
+    {"geometry", IPC_QUERY_GEOMETRY},
+    {"size_hints", IPC_QUERY_SIZE_HINTS},
+    {"border_width", IPC_QUERY_BORDER_WIDTH},
+    {"states", IPC_QUERY_STATES},
+    {"master_factor", IPC_QUERY_MASTER_FACTOR},
+    {"num_master", IPC_QUERY_NUM_MASTER},
+    {"num", IPC_QUERY_NUM},
+    {"is_selected", IPC_QUERY_IS_SELECTED},
+    {"monitor_geometry", IPC_QUERY_MONITOR_GEOMETRY},
+    {"window_geometry", IPC_QUERY_WINDOW_GEOMETRY},
+    {"tagset", IPC_QUERY_TAGSET},
+    {"tag_state", IPC_QUERY_TAG_STATE},
+    {"clients", IPC_QUERY_CLIENTS},
+    {"layout", IPC_QUERY_LAYOUT},
+    {"bar", IPC_QUERY_BAR}};
+
+/* compile-time check if the IPC header fits into IPCClient's receive state */
+struct IPCHeaderFits {
+  char exceeded[sizeof(dwm_ipc_header_t) + sizeof(dwm_ipc_header_ext_t) >
+                        IPC_CLIENT_HEADER_MAX
+                    ? -1
+                    : 1];
+};
+
+/* compile-time check if every event has a filter slot in IPCClient */
+struct IPCEventsFit {
+  char exceeded[IPC_EVENT_FOCUSED_STATE_CHANGE >= 1 << IPC_CLIENT_EVENTS ? -1
+                                                                         : 1];
+};
 
 /**
  * Create IPC socket at specified path and return file descriptor to socket.
- * This initializes the static variable sockaddr.
+ * This initializes the static variable sockaddr. Up to backlog connections
+ * wait to be accepted before new ones are refused.
  */
 static int
-ipc_create_socket(const char *filename)
+ipc_create_socket(const char *filename, const int backlog)
 {
   char *normal_filename;
   char *parent;
@@ -72,7 +342,7 @@ ipc_create_socket(const char *filename)
 
   DEBUG("Socket binded\n");
 
-  if (listen(sock_fd, IPC_SOCKET_BACKLOG) < 0) {
+  if (listen(sock_fd, backlog) < 0) {
     fputs("Failed to listen for connections on socket\n", stderr);
     return -1;
   }
@@ -83,476 +353,2538 @@ ipc_create_socket(const char *filename)
 }
 
 /**
- * Internal function used to receive IPC messages from a given file descriptor.
+ * Get the size of the header of the message being received from the client,
+ * including the header extension. Whether there is an extension is only known
+ * once the type at the end of the base header has been read.
+ */
+static uint32_t
+ipc_recv_header_size(const IPCClient *c)
+{
+  const uint32_t base_size = sizeof(dwm_ipc_header_t);
+
+  if (c->recv_header_read >= base_size &&
+      (c->recv_header[base_size - 1] & IPC_TYPE_FLAG_REQUEST_ID))
+    return base_size + sizeof(dwm_ipc_header_ext_t);
+  return base_size;
+}
+
+/**
+ * Internal function used to receive IPC messages from an IPC client. Reading
+ * never blocks: if the rest of the message is not available yet, the partial
+ * header and payload are saved in the client's receive state and reading
+ * resumes from there on the next call.
  *
- * Returns -1 on error reading (could be EAGAIN or EINTR)
+ * Returns 0 if a complete message was received. The payload is allocated from
+ *   the client's scratch arena and is valid until ipc_arena_reset(&c->arena).
+ * Returns -1 on error reading (could be EAGAIN if the message is incomplete)
  * Returns -2 if EOF before header could be read
  * Returns -3 if invalid IPC header
  * Returns -4 if message length exceeds MAX_MESSAGE_SIZE
  */
 static int
-ipc_recv_message(int fd, uint8_t *msg_type, uint32_t *reply_size,
+ipc_recv_message(IPCClient *c, uint8_t *msg_type, uint32_t *reply_size,
                  uint8_t **reply)
 {
-  uint32_t read_bytes = 0;
-  const int32_t to_read = sizeof(dwm_ipc_header_t);
-  char header[to_read];
-  char *walk = header;
+  const uint32_t base_size = sizeof(dwm_ipc_header_t);
+  uint32_t to_read;
 
-  // Try to read header
-  while (read_bytes < to_read) {
-    const ssize_t n = read(fd, header + read_bytes, to_read - read_bytes);
+  // Try to read the rest of the header
+  while (c->recv_header_read < (to_read = ipc_recv_header_size(c))) {
+    const ssize_t n = read(c->fd, c->recv_header + c->recv_header_read,
+                           to_read - c->recv_header_read);
 
     if (n == 0) {
-      if (read_bytes == 0) {
-        fprintf(stderr, "Unexpectedly reached EOF while reading header.");
-        fprintf(stderr,
-                "Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.\n",
-                read_bytes, to_read);
-        return -2;
-      } else {
-        fprintf(stderr, "Unexpectedly reached EOF while reading header.");
-        fprintf(stderr,
-                "Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.\n",
-                read_bytes, to_read);
-        return -3;
-      }
+      fprintf(stderr, "Unexpectedly reached EOF while reading header.");
+      fprintf(stderr,
+              "Read %" PRIu32 " bytes, expected %" PRIu32 " total bytes.\n",
+              c->recv_header_read, to_read);
+      return c->recv_header_read == 0 ? -2 : -3;
     } else if (n == -1) {
+      if (errno == EINTR) continue;
       // errno will still be set
       return -1;
     }
 
-    read_bytes += n;
-  }
+    c->recv_header_read += n;
 
-  // Check if magic string in header matches
-  if (memcmp(walk, IPC_MAGIC, IPC_MAGIC_LEN) != 0) {
-    fprintf(stderr, "Invalid magic string. Got '%.*s', expected '%s'\n",
-            IPC_MAGIC_LEN, walk, IPC_MAGIC);
-    return -3;
-  }
+    if (c->recv_header_read == base_size) {
+      uint8_t *walk = c->recv_header;
 
-  walk += IPC_MAGIC_LEN;
+      // Check if magic string in header matches
+      if (memcmp(walk, IPC_MAGIC, IPC_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Invalid magic string. Got '%.*s', expected '%s'\n",
+                IPC_MAGIC_LEN, (char *)walk, IPC_MAGIC);
+        return -3;
+      }
 
-  // Extract reply size
-  memcpy(reply_size, walk, sizeof(uint32_t));
-  walk += sizeof(uint32_t);
+      walk += IPC_MAGIC_LEN;
 
-  if (*reply_size > MAX_MESSAGE_SIZE) {
-    fprintf(stderr, "Message too long: %" PRIu32 " bytes. ", *reply_size);
-    fprintf(stderr, "Maximum message size is: %d\n", MAX_MESSAGE_SIZE);
-    return -4;
-  }
+      // Extract reply size
+      memcpy(&c->recv_size, walk, sizeof(uint32_t));
+      walk += sizeof(uint32_t);
+
+      if (c->recv_size > MAX_MESSAGE_SIZE) {
+        fprintf(stderr, "Message too long: %" PRIu32 " bytes. ",
+                c->recv_size);
+        fprintf(stderr, "Maximum message size is: %d\n", MAX_MESSAGE_SIZE);
+        return -4;
+      }
 
-  // Extract message type
-  memcpy(msg_type, walk, sizeof(uint8_t));
-  walk += sizeof(uint8_t);
+      // Extract message type
+      memcpy(&c->recv_type, walk, sizeof(uint8_t));
+      walk += sizeof(uint8_t);
 
-  if (*reply_size > 0)
-    (*reply) = malloc(*reply_size);
-  else
-    return 0;
+      c->recv_has_id = (c->recv_type & IPC_TYPE_FLAG_REQUEST_ID) != 0;
+      c->recv_type &= ~IPC_TYPE_FLAG_REQUEST_ID;
+    }
+
+    if (c->recv_header_read < ipc_recv_header_size(c)) continue;
+
+    if (c->recv_has_id) {
+      dwm_ipc_header_ext_t ext;
+      memcpy(&ext, c->recv_header + base_size, sizeof(ext));
+
+      if (ext.version != IPC_HEADER_EXT_VERSION) {
+        fprintf(stderr, "Unsupported header extension version %" PRIu8 "\n",
+                ext.version);
+        return -3;
+      }
+      c->recv_id = ext.request_id;
+    }
+
+    // Leave room to null terminate the payload, see ipc_read_client
+    if (c->recv_size > 0) {
+      c->recv_buffer = ipc_arena_alloc(&c->arena, c->recv_size + 1);
+      if (c->recv_buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+    c->recv_read = 0;
+  }
 
-  read_bytes = 0;
-  while (read_bytes < *reply_size) {
-    const ssize_t n = read(fd, *reply + read_bytes, *reply_size - read_bytes);
+  // Try to read the rest of the payload
+  while (c->recv_read < c->recv_size) {
+    const ssize_t n = read(c->fd, c->recv_buffer + c->recv_read,
+                           c->recv_size - c->recv_read);
 
     if (n == 0) {
       fprintf(stderr, "Unexpectedly reached EOF while reading payload.");
       fprintf(stderr, "Read %" PRIu32 " bytes, expected %" PRIu32 " bytes.\n",
-              read_bytes, *reply_size);
-      free(*reply);
+              c->recv_read, c->recv_size);
       return -2;
     } else if (n == -1) {
-      // TODO: Should we return and wait for another epoll event?
-      // This would require saving the partial read in some way.
-      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
-
-      free(*reply);
+      if (errno == EINTR) continue;
+      // Wait for the next EPOLLIN to read the rest, errno will still be set
       return -1;
     }
 
-    read_bytes += n;
+    c->recv_read += n;
   }
 
+  // Hand the complete message over and start reading the next one. Replies
+  // sent until the next message is received echo its request ID.
+  *msg_type = c->recv_type;
+  *reply_size = c->recv_size;
+  *reply = (uint8_t *)c->recv_buffer;
+  c->reply_has_id = c->recv_has_id;
+  c->reply_id = c->recv_id;
+
+  c->recv_header_read = 0;
+  c->recv_buffer = NULL;
+  c->recv_size = 0;
+  c->recv_read = 0;
+  c->recv_has_id = 0;
+
   return 0;
 }
 
 /**
- * Internal function used to write a buffer to a file descriptor
+ * Internal function used to write a scatter/gather array to a file descriptor
  *
  * Returns number of bytes written if successful write
  * Returns 0 if no bytes were written due to EAGAIN or EWOULDBLOCK
  * Returns -1 on unknown error trying to write, errno will carry over from
- *   write() call
+ *   writev() call
  */
 static ssize_t
-ipc_write_message(int fd, const void *buf, size_t count)
+ipc_write_message(int fd, const struct iovec *iov, int iovcnt)
 {
-  size_t written = 0;
-
-  while (written < count) {
-    const ssize_t n = write(fd, (uint8_t *)buf + written, count - written);
+  while (1) {
+    const ssize_t n = writev(fd, iov, iovcnt);
 
     if (n == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK)
-        return written;
+        return 0;
       else if (errno == EINTR)
         continue;
       else
         return n;
     }
 
-    written += n;
-    DEBUG("Wrote %zu/%zu to client at fd %d\n", written, count, fd);
+    DEBUG("Wrote %zd bytes to client at fd %d\n", n, fd);
+    return n;
   }
+}
 
-  return written;
+/**
+ * Get the generator for the specified format. The generator is allocated the
+ * first time it is needed and is reused afterwards. It must be cleared after
+ * every message, which is done when the message is sent.
+ *
+ * Returns the address of the generator, NULL if it could not be allocated
+ */
+static IPCGen *
+ipc_get_gen(IPCFormat format)
+{
+  IPCGen *gen = &ipc_gens[format];
+
+  if (gen->yajl == NULL && gen->cbor == NULL &&
+      ipc_gen_init(gen, format) < 0) {
+    fputs("Failed to allocate generator for IPC message\n", stderr);
+    return NULL;
+  }
+
+  return gen;
 }
 
 /**
- * Initialization for generic event message. This is used to allocate the yajl
- * handle, set yajl options, and in the future any other initialization that
- * should occur for event messages.
+ * Describe an event concerning the specified monitors and client windows. Pass
+ * -1 and 0 for unused monitors and windows. The old and new side of the
+ * change are filled in by the caller.
  */
-static void
-ipc_event_init_message(yajl_gen *gen)
+static IPCEventData
+ipc_event_data(IPCEvent event, int mon, int other_mon, Window win,
+               Window other_win)
+{
+  IPCEventData e = {.event = event,
+                    .monitors = {mon, other_mon},
+                    .windows = {win, other_win}};
+  return e;
+}
+
+/**
+ * Get the current time of CLOCK_MONOTONIC in milliseconds
+ */
+static uint64_t
+ipc_now_ms(void)
 {
-  *gen = yajl_gen_alloc(NULL);
-  yajl_gen_config(*gen, yajl_gen_beautify, 1);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+ipc_stats_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /**
- * Prepares buffers of IPC subscribers of specified event using buffer from yajl
- * handle.
+ * Add a value to a histogram
  */
 static void
-ipc_event_prepare_send_message(yajl_gen gen, IPCEvent event)
+ipc_histogram_add(IPCHistogram *h, uint64_t value)
 {
-  const unsigned char *buffer;
-  size_t len = 0;
+  int i = 0;
+  while (i < IPC_HISTOGRAM_BUCKETS - 1 && value >> i) i++;
 
-  yajl_gen_get_buf(gen, &buffer, &len);
-  len++;  // For null char
+  h->count++;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+  h->buckets[i]++;
+}
 
-  for (IPCClient *c = ipc_clients; c; c = c->next) {
-    if (c->subscriptions & event) {
-      DEBUG("Sending selected client change event to fd %d\n", c->fd);
-      ipc_prepare_send_message(c, IPC_TYPE_EVENT, len, (char *)buffer);
-    }
-  }
+void
+ipc_stats_drawbar(uint64_t start)
+{
+  ipc_histogram_add(&ipc_stats.drawbar, ipc_stats_time() - start);
+}
 
-  // Not documented, but this frees temp_buffer
-  yajl_gen_free(gen);
+void
+ipc_stats_x_events(unsigned int count)
+{
+  ipc_histogram_add(&ipc_stats.x_events, count);
+}
+
+void
+ipc_stats_pool(const char *name, const Pool *pool)
+{
+  if (ipc_stats.pools_len == IPC_STATS_POOLS) return;
+  ipc_stats.pool_names[ipc_stats.pools_len] = name;
+  ipc_stats.pools[ipc_stats.pools_len++] = pool;
 }
 
 /**
- * Initialization for generic reply message. This is used to allocate the yajl
- * handle, set yajl options, and in the future any other initialization that
- * should occur for reply messages.
+ * Get the index of the event's filter in IPCClient.filters
  */
-static void
-ipc_reply_init_message(yajl_gen *gen)
+static int
+ipc_event_index(IPCEvent event)
 {
-  *gen = yajl_gen_alloc(NULL);
-  yajl_gen_config(*gen, yajl_gen_beautify, 1);
+  int i = 0;
+  while (!(event & (1 << i))) i++;
+  return i;
 }
 
 /**
- * Prepares the IPC client's buffer with a message using the buffer of the yajl
- * handle.
+ * Check if the client is subscribed to the event and the event passes the
+ * client's filter for it
+ *
+ * Returns 1 if the client should be sent the event
+ * Returns 0 otherwise
  */
-static void
-ipc_reply_prepare_send_message(yajl_gen gen, IPCClient *c,
-                               IPCMessageType msg_type)
+static int
+ipc_event_matches(const IPCClient *c, const IPCEventData *t)
 {
-  const unsigned char *buffer;
-  size_t len = 0;
+  if (!(c->subscriptions & t->event)) return 0;
 
-  yajl_gen_get_buf(gen, &buffer, &len);
-  len++;  // For null char
+  const IPCEventFilter *f = &c->filters[ipc_event_index(t->event)];
 
-  ipc_prepare_send_message(c, msg_type, len, (const char *)buffer);
+  if (f->monitor >= 0 && f->monitor != t->monitors[0] &&
+      f->monitor != t->monitors[1])
+    return 0;
+  if (f->window && f->window != t->windows[0] && f->window != t->windows[1])
+    return 0;
 
-  // Not documented, but this frees temp_buffer
-  yajl_gen_free(gen);
+  return 1;
 }
 
 /**
- * Find the IPCCommand with the specified name
+ * Initialization for generic event message. Subscribers that use the same
+ * format and select the same fields are sent the same encoding of an event.
+ * This finds the next such group of matching subscribers that has not been
+ * sent the event yet, and returns the generator to encode the event for them.
+ * Subscribers whose filter does not match are skipped before anything is
+ * encoded.
  *
- * Returns 0 if a command with the specified name was found
- * Returns -1 if a command with the specified name could not be found
+ * Returns the generator for the next group of subscribers
+ * Returns NULL once every matching subscriber has been sent the event
  */
-static int
-ipc_get_ipc_command(const char *name, IPCCommand *ipc_command)
+static IPCGen *
+ipc_event_init_message(IPCEventData *t)
 {
-  for (int i = 0; i < ipc_commands_len; i++) {
-    if (strcmp(ipc_commands[i].name, name) == 0) {
-      *ipc_command = ipc_commands[i];
-      return 0;
-    }
+  IPCClient *c;
+  IPCGen *gen;
+
+  for (c = ipc_clients; c; c = c->next)
+    if (c->event_round != t->round && ipc_event_matches(c, t)) break;
+
+  if (c == NULL) return NULL;
+
+  t->format = c->format;
+  t->fields = c->filters[ipc_event_index(t->event)].fields;
+
+  if ((gen = ipc_get_gen(t->format)) == NULL) return NULL;
+  gen->fields = t->fields;
+
+  return gen;
+}
+
+/**
+ * Build a frame containing the IPC header and the specified message. If
+ * request_id is not NULL, the header is followed by a header extension
+ * carrying the request ID. The frame is returned with a reference count of 1.
+ */
+static IPCFrame *
+ipc_frame_create(const uint8_t msg_type, const uint32_t msg_size,
+                 const char *msg, const uint32_t *request_id)
+{
+  dwm_ipc_header_t header = {
+      .magic = IPC_MAGIC_ARR, .type = msg_type, .size = msg_size};
+  const uint32_t header_size = sizeof(dwm_ipc_header_t);
+  const uint32_t ext_size = request_id ? sizeof(dwm_ipc_header_ext_t) : 0;
+
+  IPCFrame *f = ipc_frame_new(header_size + ext_size + msg_size);
+  if (f == NULL) return NULL;
+
+  if (request_id) {
+    dwm_ipc_header_ext_t ext = {.version = IPC_HEADER_EXT_VERSION,
+                                .request_id = *request_id};
+    header.type |= IPC_TYPE_FLAG_REQUEST_ID;
+    memcpy(f->data + header_size, &ext, ext_size);
   }
 
-  return -1;
+  memcpy(f->data, &header, header_size);
+  memcpy(f->data + header_size + ext_size, msg, msg_size);
+
+  return f;
 }
 
 /**
- * Parse a IPC_TYPE_RUN_COMMAND message from a client. This function extracts
- * the arguments, argument count, argument types, and command name and returns
- * the parsed information as an IPCParsedCommand. If this function returns
- * successfully, the parsed_command must be freed using
- * ipc_free_parsed_command_members.
+ * Get the request ID to echo in replies to the message the client sent last
  *
- * Returns 0 if the message was successfully parsed
- * Returns -1 otherwise
+ * Returns the address of the request ID, NULL if the message had none
  */
-static int
-ipc_parse_run_command(char *msg, IPCParsedCommand *parsed_command)
+static const uint32_t *
+ipc_reply_id(const IPCClient *c)
 {
-  char error_buffer[1000];
-  yajl_val parent = yajl_tree_parse(msg, error_buffer, 1000);
+  return c->reply_has_id ? &c->reply_id : NULL;
+}
 
-  if (parent == NULL) {
-    fputs("Failed to parse command from client\n", stderr);
-    fprintf(stderr, "%s\n", error_buffer);
-    fprintf(stderr, "Tried to parse: %s\n", msg);
-    return -1;
+/**
+ * Update whether a client is congested. A client becomes congested once more
+ * than the high watermark of bytes is queued for it, and stays congested until
+ * its queue drains to the low watermark. Events for a congested client are
+ * held back and conflated, and a client that stays congested for too long is
+ * dropped, see ipc_send_events.
+ */
+static void
+ipc_update_congestion(IPCClient *c)
+{
+  if (ipc_high_watermark == 0) return;
+
+  if (!c->congested && c->buffer_size > ipc_high_watermark) {
+    c->congested = 1;
+    c->congested_since = ipc_now_ms();
+    ipc_stats.congestions++;
+    fprintf(stderr, "IPC client at fd %d fell behind, holding back events\n",
+            c->fd);
+  } else if (c->congested && c->buffer_size <= ipc_low_watermark) {
+    c->congested = 0;
+    DEBUG("IPC client at fd %d caught up\n", c->fd);
+  }
+}
+
+/**
+ * Queue a frame on the client's buffer. The frame is written along with
+ * everything else queued for the client in ipc_flush_clients at the end of the
+ * event loop iteration, unless the client is already waiting to be written to.
+ */
+static void
+ipc_send_frame(IPCClient *c, IPCFrame *f)
+{
+  if (ipc_client_queue_frame(c, f) < 0) {
+    fprintf(stderr, "Failed to queue message for client at fd %d\n", c->fd);
+    return;
   }
 
-  // Format:
-  // {
-  //   "command": "<command name>"
-  //   "args": [ "arg1", "arg2", ... ]
-  // }
-  const char *command_path[] = {"command", 0};
-  yajl_val command_val = yajl_tree_get(parent, command_path, yajl_t_string);
+  c->bytes_queued += f->size;
+  ipc_stats.bytes_queued += f->size;
+  if (c->buffer_size > c->buffer_size_max) c->buffer_size_max = c->buffer_size;
+  if (c->buffer_size > ipc_stats.buffer_size_max)
+    ipc_stats.buffer_size_max = c->buffer_size;
 
-  if (command_val == NULL) {
-    fputs("No command key found in client message\n", stderr);
-    yajl_tree_free(parent);
-    return -1;
+  ipc_update_congestion(c);
+
+  if (!(c->event.events & EPOLLOUT) && !c->flush_queued) {
+    c->flush_queued = 1;
+    c->flush_next = ipc_flush_list;
+    ipc_flush_list = c;
   }
+}
 
-  const char *command_name = YAJL_GET_STRING(command_val);
-  size_t command_name_len = strlen(command_name);
-  parsed_command->name = (char *)malloc((command_name_len + 1) * sizeof(char));
-  strcpy(parsed_command->name, command_name);
+/**
+ * Get the message type to put in the header of a message encoded by the
+ * generator, along with the size of its payload. JSON payloads include the
+ * null char.
+ */
+static uint8_t
+ipc_gen_message(IPCGen *gen, IPCMessageType msg_type,
+                const unsigned char **buffer, size_t *len)
+{
+  ipc_gen_get_buf(gen, buffer, len);
 
-  DEBUG("Received command: %s\n", parsed_command->name);
+  if (gen->format == IPC_FORMAT_CBOR) return msg_type | IPC_TYPE_FLAG_CBOR;
 
-  const char *args_path[] = {"args", 0};
-  yajl_val args_val = yajl_tree_get(parent, args_path, yajl_t_array);
+  (*len)++;  // For null char
+  return msg_type;
+}
 
-  if (args_val == NULL) {
-    fputs("No args key found in client message\n", stderr);
-    yajl_tree_free(parent);
-    return -1;
+/**
+ * Remember an event for replay. Once the ring is full the oldest event and its
+ * frames are forgotten.
+ */
+static void
+ipc_replay_record(const IPCEventData *e)
+{
+  if (ipc_replay_len == IPC_REPLAY_MAX) {
+    IPCReplayEvent *oldest = &ipc_replay[ipc_replay_start];
+    for (int i = 0; i < IPC_FORMAT_LAST; i++)
+      if (oldest->frames[i]) ipc_frame_unref(oldest->frames[i]);
+    ipc_replay_start = (ipc_replay_start + 1) % IPC_REPLAY_MAX;
+    ipc_replay_len--;
   }
 
-  unsigned int *argc = &parsed_command->argc;
-  Arg **args = &parsed_command->args;
-  ArgType **arg_types = &parsed_command->arg_types;
+  IPCReplayEvent *r =
+      &ipc_replay[(ipc_replay_start + ipc_replay_len) % IPC_REPLAY_MAX];
+  r->data = *e;
+  memset(r->frames, 0, sizeof(r->frames));
+  ipc_replay_len++;
+}
 
-  *argc = args_val->u.array.len;
+/**
+ * Keep a frame of an event with all fields for replay, so replaying the event
+ * in the same format does not encode it again
+ */
+static void
+ipc_replay_store_frame(const IPCEventData *e, IPCFrame *f)
+{
+  if (ipc_replay_len == 0 || e->seq + ipc_replay_len <= ipc_event_seq) return;
 
-  // If no arguments are specified, make a dummy argument to pass to the
-  // function. This is just the way dwm's void(Arg*) functions are setup.
-  if (*argc == 0) {
-    *args = (Arg *)malloc(sizeof(Arg));
-    *arg_types = (ArgType *)malloc(sizeof(ArgType));
-    (*arg_types)[0] = ARG_TYPE_NONE;
-    (*args)[0].i = 0;
-    (*argc)++;
-  } else if (*argc > 0) {
-    *args = (Arg *)calloc(*argc, sizeof(Arg));
-    *arg_types = (ArgType *)malloc(*argc * sizeof(ArgType));
-
-    for (int i = 0; i < *argc; i++) {
-      yajl_val arg_val = args_val->u.array.values[i];
-
-      if (YAJL_IS_NUMBER(arg_val)) {
-        if (YAJL_IS_INTEGER(arg_val)) {
-          // Any values below 0 must be a signed int
-          if (YAJL_GET_INTEGER(arg_val) < 0) {
-            (*args)[i].i = YAJL_GET_INTEGER(arg_val);
-            (*arg_types)[i] = ARG_TYPE_SINT;
-            DEBUG("i=%ld\n", (*args)[i].i);
-            // Any values above 0 should be an unsigned int
-          } else if (YAJL_GET_INTEGER(arg_val) >= 0) {
-            (*args)[i].ui = YAJL_GET_INTEGER(arg_val);
-            (*arg_types)[i] = ARG_TYPE_UINT;
-            DEBUG("ui=%ld\n", (*args)[i].i);
-          }
-          // If the number is not an integer, it must be a float
-        } else {
-          (*args)[i].f = (float)YAJL_GET_DOUBLE(arg_val);
-          (*arg_types)[i] = ARG_TYPE_FLOAT;
-          DEBUG("f=%f\n", (*args)[i].f);
-          // If argument is not a number, it must be a string
-        }
-      } else if (YAJL_IS_STRING(arg_val)) {
-        char *arg_s = YAJL_GET_STRING(arg_val);
-        size_t arg_s_size = (strlen(arg_s) + 1) * sizeof(char);
-        (*args)[i].v = (char *)malloc(arg_s_size);
-        (*arg_types)[i] = ARG_TYPE_STR;
-        strcpy((char *)(*args)[i].v, arg_s);
-      }
-    }
+  IPCReplayEvent *r =
+      &ipc_replay[(ipc_replay_start + ipc_replay_len - 1 -
+                   (ipc_event_seq - e->seq)) %
+                  IPC_REPLAY_MAX];
+  if (r->frames[e->format] == NULL) r->frames[e->format] = ipc_frame_ref(f);
+}
+
+/**
+ * Prepares buffers of IPC subscribers of specified event using buffer from the
+ * generator. The message is only encoded once, and the resulting frame is
+ * shared by the group of subscribers it was encoded for, see
+ * ipc_event_init_message.
+ */
+static void
+ipc_event_prepare_send_message(IPCGen *gen, IPCEventData *t)
+{
+  const unsigned char *buffer;
+  size_t len = 0;
+  IPCFrame *frame = NULL;
+  const int index = ipc_event_index(t->event);
+
+  uint8_t type = ipc_gen_message(gen, IPC_TYPE_EVENT, &buffer, &len);
+
+  for (IPCClient *c = ipc_clients; c; c = c->next) {
+    if (c->event_round == t->round || c->format != t->format ||
+        c->filters[index].fields != t->fields || !ipc_event_matches(c, t))
+      continue;
+
+    // Mark the subscriber even if the frame can't be built, so the next call
+    // of ipc_event_init_message moves on to the next group
+    c->event_round = t->round;
+
+    // Only build the frame once there is at least one subscriber
+    if (frame == NULL &&
+        (frame = ipc_frame_create(type, len, (char *)buffer, NULL)) == NULL)
+      continue;
+    DEBUG("Sending selected client change event to fd %d\n", c->fd);
+    ipc_send_frame(c, frame);
+    c->events_sent++;
+    ipc_stats.events_sent[index]++;
   }
 
-  yajl_tree_free(parent);
+  // The replay ring keeps the frame of the newest event if it has all fields
+  if (frame && t->fields == 0) ipc_replay_store_frame(t, frame);
 
-  return 0;
+  // Subscribers hold their own references to the frame
+  if (frame) ipc_frame_unref(frame);
+
+  ipc_gen_clear(gen);
 }
 
 /**
- * Free the members of a IPCParsedCommand struct
+ * Encode an event using the specified generator
  */
 static void
-ipc_free_parsed_command_members(IPCParsedCommand *command)
+ipc_event_dump(IPCGen *gen, const IPCEventData *e)
+{
+  const int mon_num = e->monitors[0];
+
+  if (e->event == IPC_EVENT_TAG_CHANGE)
+    dump_tag_event(gen, e->seq, mon_num, e->u.tag.old_state,
+                   e->u.tag.new_state);
+  else if (e->event == IPC_EVENT_CLIENT_FOCUS_CHANGE)
+    dump_client_focus_change_event(gen, e->seq, e->windows[0], e->windows[1],
+                                   mon_num);
+  else if (e->event == IPC_EVENT_LAYOUT_CHANGE)
+    dump_layout_change_event(gen, e->seq, mon_num, e->u.layout.old_symbol,
+                             e->u.layout.old_layout, e->u.layout.new_symbol,
+                             e->u.layout.new_layout);
+  else if (e->event == IPC_EVENT_MONITOR_FOCUS_CHANGE)
+    dump_monitor_focus_change_event(gen, e->seq, e->monitors[0],
+                                    e->monitors[1]);
+  else if (e->event == IPC_EVENT_FOCUSED_TITLE_CHANGE)
+    dump_focused_title_change_event(gen, e->seq, mon_num, e->windows[0],
+                                    e->u.title.old_name, e->u.title.new_name);
+  else if (e->event == IPC_EVENT_FOCUSED_STATE_CHANGE)
+    dump_focused_state_change_event(gen, e->seq, mon_num, e->windows[0],
+                                    &e->u.state.old_state,
+                                    &e->u.state.new_state);
+}
+
+/**
+ * Get the number of milliseconds until the client may be sent another event
+ * of the specified type under its rate limit. The one second window of the
+ * rate limit is restarted once it has passed.
+ *
+ * Returns 0 if the client may be sent the event now
+ */
+static uint64_t
+ipc_event_rate_wait(IPCClient *c, int index, uint64_t now)
 {
-  for (int i = 0; i < command->argc; i++) {
-    if (command->arg_types[i] == ARG_TYPE_STR) free((void *)command->args[i].v);
+  const unsigned int max_rate = c->filters[index].max_rate;
+  IPCEventRate *rate = &c->rates[index];
+
+  if (max_rate == 0) return 0;
+
+  if (now - rate->start >= 1000) {
+    rate->start = now;
+    rate->count = 0;
   }
-  free(command->args);
-  free(command->arg_types);
-  free(command->name);
+
+  return rate->count < max_rate ? 0 : rate->start + 1000 - now;
 }
 
 /**
- * Check if the given arguments are the correct length and type. Also do any
- * casting to correct the types.
+ * Check if two events are about the same thing, meaning the same event type
+ * and monitor, and also the same client for per client events. The monitor
+ * focus only exists once.
  *
- * Returns 0 if the arguments were the correct length and types
- * Returns -1 if the argument count doesn't match
- * Returns -2 if the argument types don't match
+ * Returns 1 if a later event replaces the earlier one when conflated
+ * Returns 0 otherwise
  */
 static int
-ipc_validate_run_command(IPCParsedCommand *parsed, const IPCCommand actual)
+ipc_event_same_key(const IPCEventData *a, const IPCEventData *b)
 {
-  if (actual.argc != parsed->argc) return -1;
+  if (a->event != b->event) return 0;
+  if (a->event == IPC_EVENT_MONITOR_FOCUS_CHANGE) return 1;
+  if (a->monitors[0] != b->monitors[0]) return 0;
 
-  for (int i = 0; i < parsed->argc; i++) {
-    ArgType ptype = parsed->arg_types[i];
-    ArgType atype = actual.arg_types[i];
+  if (a->event == IPC_EVENT_FOCUSED_TITLE_CHANGE ||
+      a->event == IPC_EVENT_FOCUSED_STATE_CHANGE)
+    return a->windows[0] == b->windows[0];
 
-    if (ptype != atype) {
-      if (ptype == ARG_TYPE_UINT && atype == ARG_TYPE_PTR)
-        // If this argument is supposed to be a void pointer, cast it
-        parsed->args[i].v = (void *)parsed->args[i].ui;
-      else if (ptype == ARG_TYPE_UINT && atype == ARG_TYPE_SINT)
-        // If this argument is supposed to be a signed int, cast it
-        parsed->args[i].i = parsed->args[i].ui;
-      else
-        return -2;
-    }
+  return 1;
+}
+
+/**
+ * Replace the new side of a held event with the new side of a later event
+ * about the same thing. The old side of the held event is kept, so the merged
+ * event reports the whole change since the last event the client was sent.
+ */
+static void
+ipc_event_merge(IPCEventData *held, const IPCEventData *e)
+{
+  held->seq = e->seq;
+
+  if (e->event == IPC_EVENT_TAG_CHANGE) {
+    held->u.tag.new_state = e->u.tag.new_state;
+  } else if (e->event == IPC_EVENT_CLIENT_FOCUS_CHANGE) {
+    held->windows[1] = e->windows[1];
+  } else if (e->event == IPC_EVENT_LAYOUT_CHANGE) {
+    strcpy(held->u.layout.new_symbol, e->u.layout.new_symbol);
+    held->u.layout.new_layout = e->u.layout.new_layout;
+  } else if (e->event == IPC_EVENT_MONITOR_FOCUS_CHANGE) {
+    held->monitors[1] = e->monitors[1];
+  } else if (e->event == IPC_EVENT_FOCUSED_TITLE_CHANGE) {
+    strcpy(held->u.title.new_name, e->u.title.new_name);
+  } else if (e->event == IPC_EVENT_FOCUSED_STATE_CHANGE) {
+    held->u.state.new_state = e->u.state.new_state;
   }
+}
 
-  return 0;
+/**
+ * Find the event held back for a client that is about the same thing as the
+ * specified event
+ *
+ * Returns the held event, NULL if there is none
+ */
+static IPCEventData *
+ipc_event_find_held(IPCClient *c, const IPCEventData *e)
+{
+  for (uint32_t i = 0; i < c->held_len; i++)
+    if (ipc_event_same_key(&c->held[i], e)) return &c->held[i];
+  return NULL;
 }
 
 /**
- * Convert event name to their IPCEvent equivalent enum value
+ * Check if an event must be held back for a client instead of being sent now.
+ * This is the case if the client is congested, if the client conflates the
+ * event and still has messages it hasn't read, if its rate limit for the event
+ * is used up, or if an event about the same thing is already held so the two
+ * don't get reordered.
  *
- * Returns 0 if a valid event name was given
- * Returns -1 otherwise
+ * Returns 1 if the event must be held back
+ * Returns 0 if the event can be sent now
  */
 static int
-ipc_event_stoi(const char *subscription, IPCEvent *event)
+ipc_event_should_hold(IPCClient *c, const IPCEventData *e, uint64_t now)
 {
-  if (strcmp(subscription, "tag_change_event") == 0)
-    *event = IPC_EVENT_TAG_CHANGE;
-  else if (strcmp(subscription, "client_focus_change_event") == 0)
-    *event = IPC_EVENT_CLIENT_FOCUS_CHANGE;
-  else if (strcmp(subscription, "layout_change_event") == 0)
-    *event = IPC_EVENT_LAYOUT_CHANGE;
-  else if (strcmp(subscription, "monitor_focus_change_event") == 0)
-    *event = IPC_EVENT_MONITOR_FOCUS_CHANGE;
-  else if (strcmp(subscription, "focused_title_change_event") == 0)
-    *event = IPC_EVENT_FOCUSED_TITLE_CHANGE;
-  else if (strcmp(subscription, "focused_state_change_event") == 0)
-    *event = IPC_EVENT_FOCUSED_STATE_CHANGE;
-  else
-    return -1;
-  return 0;
+  const int index = ipc_event_index(e->event);
+  const IPCEventFilter *f = &c->filters[index];
+
+  if (c->congested || ipc_event_find_held(c, e) != NULL) return 1;
+  if (f->conflate && c->buffer_len > 0) return 1;
+
+  return ipc_event_rate_wait(c, index, now) > 0;
 }
 
 /**
- * Parse a IPC_TYPE_SUBSCRIBE message from a client. This function extracts the
- * event name and the subscription action from the message.
+ * Hold back an event for a client, merging it into the held event about the
+ * same thing if there is one
  *
- * Returns 0 if message was successfully parsed
- * Returns -1 otherwise
+ * Returns 0 if the event was held
+ * Returns 1 if the event was merged into one that was already held
+ * Returns -1 if there was no memory to hold the event
  */
 static int
-ipc_parse_subscribe(const char *msg, IPCSubscriptionAction *subscribe,
-                    IPCEvent *event)
+ipc_event_hold(IPCClient *c, const IPCEventData *e)
 {
-  char error_buffer[100];
-  yajl_val parent = yajl_tree_parse((char *)msg, error_buffer, 100);
+  IPCEventData *held = ipc_event_find_held(c, e);
 
-  if (parent == NULL) {
-    fputs("Failed to parse command from client\n", stderr);
-    fprintf(stderr, "%s\n", error_buffer);
-    return -1;
+  if (held != NULL) {
+    ipc_event_merge(held, e);
+    return 1;
   }
 
-  // Format:
-  // {
-  //   "event": "<event name>"
-  //   "action": "<subscribe|unsubscribe>"
-  // }
-  const char *event_path[] = {"event", 0};
-  yajl_val event_val = yajl_tree_get(parent, event_path, yajl_t_string);
-
-  if (event_val == NULL) {
-    fputs("No 'event' key found in client message\n", stderr);
-    return -1;
+  if (c->held_len == c->held_cap) {
+    uint32_t cap = c->held_cap ? c->held_cap * 2 : 4;
+    IPCEventData *events = realloc(c->held, cap * sizeof(IPCEventData));
+    if (events == NULL) return -1;
+    c->held = events;
+    c->held_cap = cap;
   }
 
-  const char *event_str = YAJL_GET_STRING(event_val);
-  DEBUG("Received event: %s\n", event_str);
+  c->held[c->held_len++] = *e;
+  return 0;
+}
 
-  if (ipc_event_stoi(event_str, event) < 0) return -1;
+/**
+ * Encode an event for a single client and queue it on the client's buffer
+ */
+static void
+ipc_event_send_to_client(IPCClient *c, const IPCEventData *e)
+{
+  const unsigned char *buffer;
+  size_t len = 0;
+  IPCGen *gen = ipc_get_gen(c->format);
 
-  const char *action_path[] = {"action", 0};
-  yajl_val action_val = yajl_tree_get(parent, action_path, yajl_t_string);
+  if (gen == NULL) return;
+  gen->fields = c->filters[ipc_event_index(e->event)].fields;
 
-  if (action_val == NULL) {
-    fputs("No 'action' key found in client message\n", stderr);
-    return -1;
+  ipc_event_dump(gen, e);
+  uint8_t type = ipc_gen_message(gen, IPC_TYPE_EVENT, &buffer, &len);
+  IPCFrame *frame = ipc_frame_create(type, len, (char *)buffer, NULL);
+
+  if (frame != NULL) {
+    DEBUG("Sending held event to fd %d\n", c->fd);
+    ipc_send_frame(c, frame);
+    ipc_frame_unref(frame);
+    c->events_sent++;
+    ipc_stats.events_sent[ipc_event_index(e->event)]++;
+  } else {
+    fprintf(stderr, "Failed to allocate event for client at fd %d\n", c->fd);
+  }
+
+  ipc_gen_clear(gen);
+}
+
+/**
+ * Replay the remembered events of the specified type after a sequence number
+ * to a client, as far as they pass the client's filter. Replayed events are
+ * held back and conflated like any other event, so they count against the
+ * client's rate limit and are not sent while it is congested, see
+ * ipc_event_should_hold. Subscribers that select all fields are sent the
+ * frames the events were already encoded in, an event that was not encoded in
+ * the client's format yet is encoded once and kept for the next replay.
+ */
+static void
+ipc_replay_send(IPCClient *c, IPCEvent event, unsigned long since)
+{
+  const int index = ipc_event_index(event);
+  const uint64_t now = ipc_now_ms();
+
+  for (unsigned int i = 0; i < ipc_replay_len; i++) {
+    IPCReplayEvent *r = &ipc_replay[(ipc_replay_start + i) % IPC_REPLAY_MAX];
+    IPCFrame **frame = &r->frames[c->format];
+
+    if (r->data.seq <= since || r->data.event != event ||
+        !ipc_event_matches(c, &r->data))
+      continue;
+
+    if (ipc_event_should_hold(c, &r->data, now)) {
+      const int held = ipc_event_hold(c, &r->data);
+      if (held < 0)
+        fprintf(stderr, "Failed to hold event for client at fd %d\n", c->fd);
+      else if (held == 0)
+        ipc_stats.events_held[index]++;
+      else
+        ipc_stats.events_conflated[index]++;
+      continue;
+    }
+    c->rates[index].count++;
+
+    if (c->filters[index].fields != 0) {
+      ipc_event_send_to_client(c, &r->data);
+      continue;
+    }
+
+    if (*frame == NULL) {
+      const unsigned char *buffer;
+      size_t len = 0;
+      IPCGen *gen = ipc_get_gen(c->format);
+
+      if (gen == NULL) return;
+      ipc_event_dump(gen, &r->data);
+      uint8_t type = ipc_gen_message(gen, IPC_TYPE_EVENT, &buffer, &len);
+      *frame = ipc_frame_create(type, len, (char *)buffer, NULL);
+      ipc_gen_clear(gen);
+    }
+
+    if (*frame == NULL) {
+      fprintf(stderr, "Failed to allocate event for client at fd %d\n", c->fd);
+      continue;
+    }
+
+    DEBUG("Replaying event %lu to fd %d\n", r->data.seq, c->fd);
+    ipc_send_frame(c, *frame);
+    c->events_sent++;
+    ipc_stats.events_sent[index]++;
+  }
+}
+
+/**
+ * Send an event to every subscriber whose filter matches it. Subscribers that
+ * are congested or conflate or rate limit the event are first checked for
+ * whether the event must be held back for them, see ipc_flush_held_events.
+ * Everyone else is sent the event right away.
+ */
+static void
+ipc_event_dispatch(IPCEventData *e)
+{
+  const int index = ipc_event_index(e->event);
+  uint64_t now = 0;
+  IPCGen *gen;
+
+  e->round = ++ipc_event_round;
+  e->seq = ++ipc_event_seq;
+  ipc_stats.events_emitted[index]++;
+  ipc_replay_record(e);
+
+  for (IPCClient *c = ipc_clients; c; c = c->next) {
+    const IPCEventFilter *f = &c->filters[index];
+
+    if ((!f->conflate && !f->max_rate && !c->congested) ||
+        !ipc_event_matches(c, e))
+      continue;
+    if (now == 0) now = ipc_now_ms();
+
+    if (!ipc_event_should_hold(c, e, now)) {
+      c->rates[index].count++;
+      continue;
+    }
+
+    const int held = ipc_event_hold(c, e);
+    if (held < 0)
+      fprintf(stderr, "Failed to hold event for client at fd %d\n", c->fd);
+    else if (held == 0)
+      ipc_stats.events_held[index]++;
+    else
+      ipc_stats.events_conflated[index]++;
+
+    // Skip the client when sending the event to everyone else
+    c->event_round = e->round;
+  }
+
+  while ((gen = ipc_event_init_message(e)) != NULL) {
+    ipc_event_dump(gen, e);
+    ipc_event_prepare_send_message(gen, e);
+  }
+}
+
+/**
+ * Send the events held back for a client that may be sent now. Nothing is
+ * sent while the client is congested. Conflated events are released once the
+ * client has read all queued messages, rate limited events once the rate limit
+ * allows another event. Held events that the client is no longer subscribed to
+ * are dropped.
+ *
+ * Returns the number of milliseconds until the next held event may be sent
+ *   under its rate limit, 0 if no held event is waiting for a rate limit
+ */
+static uint64_t
+ipc_flush_held_events(IPCClient *c, uint64_t now)
+{
+  const int drained = c->buffer_len == 0;
+  uint64_t next = 0;
+  uint32_t kept = 0;
+
+  for (uint32_t i = 0; i < c->held_len; i++) {
+    const IPCEventData *e = &c->held[i];
+    const int index = ipc_event_index(e->event);
+
+    if (!ipc_event_matches(c, e)) continue;
+
+    const uint64_t wait = ipc_event_rate_wait(c, index, now);
+
+    if (wait > 0 || c->congested ||
+        (c->filters[index].conflate && !drained)) {
+      if (wait > 0 && (next == 0 || wait < next)) next = wait;
+      if (kept != i) c->held[kept] = *e;
+      kept++;
+      continue;
+    }
+
+    c->rates[index].count++;
+    ipc_event_send_to_client(c, e);
+  }
+
+  c->held_len = kept;
+  return next;
+}
+
+/**
+ * Build the state snapshot from the current state of the monitors and publish
+ * it if anything changed since the last update
+ */
+static void
+ipc_state_publish(Monitor *mons, Monitor *selmon)
+{
+  IPCStateSnapshot *n = &ipc_state_next;
+  const size_t offset = offsetof(IPCStateSnapshot, monitors_len);
+  uint32_t len = 0;
+
+  if (ipc_state == NULL) return;
+
+  memset(n, 0, sizeof(IPCStateSnapshot));
+  for (Monitor *m = mons; m && len < IPC_STATE_MONITORS; m = m->next) {
+    IPCStateMonitor *sm = &n->monitors[len++];
+    Client *sel = m->sel;
+
+    sm->num = m->num;
+    sm->tags_selected = m->tagstate.selected;
+    sm->tags_occupied = m->tagstate.occupied;
+    sm->tags_urgent = m->tagstate.urgent;
+    strncpy(sm->layout_symbol, m->ltsymbol, sizeof(sm->layout_symbol) - 1);
+
+    if (!sel) continue;
+    sm->client_window = sel->win;
+    sm->client_isfixed = !!sel->isfixed;
+    sm->client_isfloating = !!sel->isfloating;
+    sm->client_isurgent = !!sel->isurgent;
+    sm->client_neverfocus = !!sel->neverfocus;
+    sm->client_oldstate = !!sel->oldstate;
+    sm->client_isfullscreen = !!sel->isfullscreen;
+    strncpy(sm->client_name, sel->name, sizeof(sm->client_name) - 1);
+  }
+  n->monitors_len = len;
+  n->selected_monitor = selmon ? selmon->num : -1;
+
+  if (memcmp((char *)n + offset, (char *)ipc_state + offset,
+             sizeof(IPCStateSnapshot) - offset) == 0)
+    return;
+
+  // Readers that see the odd seq, or a seq that changed while they copied,
+  // retry. The fence keeps the writes below from becoming visible first.
+  const uint32_t seq = ipc_state->seq;
+  __atomic_store_n(&ipc_state->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)ipc_state + offset, (char *)n + offset,
+         sizeof(IPCStateSnapshot) - offset);
+  __atomic_store_n(&ipc_state->seq, seq + 2, __ATOMIC_RELEASE);
+
+  syscall(SYS_futex, &ipc_state->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Arm the timer to wake dwm up after the specified number of milliseconds, or
+ * disarm it if 0 is given
+ */
+static void
+ipc_arm_timer(uint64_t ms)
+{
+  struct itimerspec spec = {0};
+
+  if (timer_fd < 0) return;
+
+  ipc_timer_due = ms ? ipc_now_ms() + ms : 0;
+
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+  if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0)
+    fputs("Failed to arm IPC timer\n", stderr);
+}
+
+/**
+ * Initialization for generic reply message. This is used to get the generator
+ * for the format used by the client, and in the future any other
+ * initialization that should occur for reply messages.
+ *
+ * Returns the generator, NULL if it could not be allocated
+ */
+static IPCGen *
+ipc_reply_init_message(IPCClient *c)
+{
+  return ipc_get_gen(c->format);
+}
+
+/**
+ * Prepares the IPC client's buffer with a message using the buffer of the
+ * generator.
+ */
+static void
+ipc_reply_prepare_send_message(IPCGen *gen, IPCClient *c,
+                               IPCMessageType msg_type)
+{
+  const unsigned char *buffer;
+  size_t len = 0;
+
+  uint8_t type = ipc_gen_message(gen, msg_type, &buffer, &len);
+  IPCFrame *f =
+      ipc_frame_create(type, len, (const char *)buffer, ipc_reply_id(c));
+
+  if (f == NULL)
+    fprintf(stderr, "Failed to allocate message for client at fd %d\n", c->fd);
+  else {
+    ipc_send_frame(c, f);
+    ipc_frame_unref(f);
+  }
+
+  ipc_gen_clear(gen);
+}
+
+/**
+ * Hash the specified bytes into a running FNV-1a hash
+ */
+static uint64_t
+ipc_hash(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *bytes = data;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/**
+ * Allocate an empty name table with room for the specified number of names
+ *
+ * Returns 0 on success
+ * Returns -1 if the table could not be allocated
+ */
+static int
+ipc_name_table_init(IPCNameTable *t, unsigned int len)
+{
+  uint32_t cap = 8;
+
+  // Keep the table at most half full so probe sequences stay short
+  while (cap < len * 2) cap *= 2;
+
+  if ((t->slots = calloc(cap, sizeof(IPCNameSlot))) == NULL) return -1;
+  t->mask = cap - 1;
+
+  return 0;
+}
+
+/**
+ * Add a name to a name table. If the name is already in the table the first
+ * index it was added with is kept, just like a linear search would find it.
+ */
+static void
+ipc_name_table_insert(IPCNameTable *t, const char *name, int index)
+{
+  uint32_t i = ipc_hash(IPC_HASH_INIT, name, strlen(name)) & t->mask;
+
+  for (; t->slots[i].name; i = (i + 1) & t->mask)
+    if (strcmp(t->slots[i].name, name) == 0) return;
+
+  t->slots[i].name = name;
+  t->slots[i].index = index;
+}
+
+/**
+ * Look up a name in a name table
+ *
+ * Returns the index the name was added with
+ * Returns -1 if the name is not in the table
+ */
+static int
+ipc_name_table_find(const IPCNameTable *t, const char *name)
+{
+  if (t->slots == NULL) return -1;
+
+  uint32_t i = ipc_hash(IPC_HASH_INIT, name, strlen(name)) & t->mask;
+
+  for (; t->slots[i].name; i = (i + 1) & t->mask)
+    if (strcmp(t->slots[i].name, name) == 0) return t->slots[i].index;
+
+  return -1;
+}
+
+static void
+ipc_name_table_free(IPCNameTable *t)
+{
+  free(t->slots);
+  t->slots = NULL;
+  t->mask = 0;
+}
+
+/**
+ * Member of a command object that the next value belongs to
+ */
+typedef enum IPCCommandKey {
+  IPC_COMMAND_KEY_OTHER,
+  IPC_COMMAND_KEY_COMMAND,
+  IPC_COMMAND_KEY_ARGS
+} IPCCommandKey;
+
+/**
+ * A command being parsed from a IPC_TYPE_RUN_COMMAND or IPC_TYPE_RUN_BATCH
+ * message
+ */
+typedef struct IPCCommandSlot {
+  IPCParsedCommand parsed;
+  unsigned int args_cap;
+  int has_command;
+  int has_args;
+  // Set if the command is not an object or one of its members is invalid
+  int invalid;
+} IPCCommandSlot;
+
+/**
+ * State of the callback parser for IPC_TYPE_RUN_COMMAND and IPC_TYPE_RUN_BATCH
+ * messages. Everything the parser allocates, including yajl's own state, comes
+ * from the scratch arena of the client that sent the message.
+ */
+typedef struct IPCCommandParser {
+  IPCArena *arena;
+  // The message being parsed, string arguments are terminated in place when
+  // yajl hands out a pointer into it
+  char *msg;
+  size_t msg_len;
+  // Non-zero if the message is an array of commands
+  int batch;
+  // Nesting depth of maps and arrays at the current value
+  int depth;
+  IPCCommandKey key;
+  int in_args;
+  IPCCommandSlot *slots;
+  size_t len;
+  size_t cap;
+} IPCCommandParser;
+
+static void *
+ipc_yajl_malloc(void *ctx, size_t size)
+{
+  return ipc_arena_alloc(ctx, size);
+}
+
+static void *
+ipc_yajl_realloc(void *ctx, void *ptr, size_t size)
+{
+  return ipc_arena_realloc(ctx, ptr, size);
+}
+
+static void
+ipc_yajl_free(void *ctx, void *ptr)
+{
+  // Released when the arena is reset
+}
+
+/**
+ * Depth of the command objects in the message being parsed
+ */
+static int
+ipc_command_depth(const IPCCommandParser *p)
+{
+  return p->batch ? 2 : 1;
+}
+
+/**
+ * Start a new command at the end of the parsed commands
+ *
+ * Returns 0 on success
+ * Returns -1 if the command could not be allocated
+ */
+static int
+ipc_command_begin(IPCCommandParser *p)
+{
+  if (p->len == p->cap) {
+    const size_t cap = p->cap ? p->cap * 2 : 4;
+    IPCCommandSlot *slots =
+        ipc_arena_realloc(p->arena, p->slots, cap * sizeof(IPCCommandSlot));
+    if (slots == NULL) return -1;
+    p->slots = slots;
+    p->cap = cap;
+  }
+
+  memset(&p->slots[p->len], 0, sizeof(IPCCommandSlot));
+  p->slots[p->len].parsed.command = -1;
+  p->len++;
+  p->key = IPC_COMMAND_KEY_OTHER;
+  p->in_args = 0;
+
+  return 0;
+}
+
+/**
+ * Finish the command at the end of the parsed commands
+ *
+ * Returns 0 on success
+ * Returns -1 if the dummy argument could not be allocated
+ */
+static int
+ipc_command_end(IPCCommandParser *p)
+{
+  IPCCommandSlot *s = &p->slots[p->len - 1];
+  IPCParsedCommand *parsed = &s->parsed;
+
+  if (!s->has_command || !s->has_args) s->invalid = 1;
+
+  // If no arguments are specified, make a dummy argument to pass to the
+  // function. This is just the way dwm's void(Arg*) functions are setup.
+  if (!s->invalid && parsed->argc == 0) {
+    parsed->args = ipc_arena_alloc(p->arena, sizeof(Arg));
+    parsed->arg_types = ipc_arena_alloc(p->arena, sizeof(ArgType));
+    if (parsed->args == NULL || parsed->arg_types == NULL) return -1;
+    parsed->arg_types[0] = ARG_TYPE_NONE;
+    parsed->args[0].i = 0;
+    parsed->argc = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Append an argument to the command being parsed
+ *
+ * Returns the address of the argument, NULL if it could not be allocated
+ */
+static Arg *
+ipc_command_add_arg(IPCCommandParser *p, ArgType type)
+{
+  IPCCommandSlot *s = &p->slots[p->len - 1];
+  IPCParsedCommand *parsed = &s->parsed;
+
+  if (parsed->argc == s->args_cap) {
+    const unsigned int cap = s->args_cap ? s->args_cap * 2 : 4;
+    Arg *args = ipc_arena_realloc(p->arena, parsed->args, cap * sizeof(Arg));
+    if (args == NULL) return NULL;
+    parsed->args = args;
+
+    ArgType *types =
+        ipc_arena_realloc(p->arena, parsed->arg_types, cap * sizeof(ArgType));
+    if (types == NULL) return NULL;
+    parsed->arg_types = types;
+
+    s->args_cap = cap;
+  }
+
+  parsed->arg_types[parsed->argc] = type;
+  return &parsed->args[parsed->argc++];
+}
+
+/**
+ * Get a null terminated copy of a string value. A string without escapes is
+ * handed out by yajl as a pointer into the message, so its closing quote is
+ * replaced by the terminator instead of copying it.
+ *
+ * Returns the string, NULL if it could not be allocated
+ */
+static char *
+ipc_command_string(IPCCommandParser *p, const unsigned char *val, size_t len)
+{
+  char *str = (char *)val;
+
+  if (str >= p->msg && str + len < p->msg + p->msg_len && str[len] == '"') {
+    str[len] = '\0';
+    return str;
+  }
+
+  if ((str = ipc_arena_alloc(p->arena, len + 1)) == NULL) return NULL;
+  memcpy(str, val, len);
+  str[len] = '\0';
+
+  return str;
+}
+
+/**
+ * Find the command that the next value belongs to as a member or argument.
+ * Values that are not the command itself, a member of it or an argument are
+ * skipped.
+ *
+ * Returns 1 if the value is a member of the command object
+ * Returns 2 if the value is an argument
+ * Returns 0 if the value should be skipped
+ * Returns -1 if the value makes the message invalid
+ */
+static int
+ipc_command_value(IPCCommandParser *p, int is_map, int is_array)
+{
+  const int depth = ipc_command_depth(p);
+
+  if (p->depth == 0) {
+    // The top level value must be a command, or an array of them in a batch
+    if (p->batch ? !is_array : !is_map) return -1;
+    if (!p->batch && ipc_command_begin(p) < 0) return -1;
+    return 0;
+  }
+
+  if (p->depth == depth - 1) {
+    // An element of a batch, each one must be a command object
+    if (ipc_command_begin(p) < 0) return -1;
+    if (!is_map) p->slots[p->len - 1].invalid = 1;
+    return 0;
+  }
+
+  if (p->depth == depth) return 1;
+  if (p->depth == depth + 1 && p->in_args) return 2;
+
+  return 0;
+}
+
+/**
+ * Mark the command being parsed invalid if the value is one of its members or
+ * arguments, since none of them can be of this type
+ */
+static int
+ipc_command_parse_other(void *ctx)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 0, 0);
+
+  if (res < 0) return 0;
+  if ((res == 1 && p->key != IPC_COMMAND_KEY_OTHER) || res == 2)
+    p->slots[p->len - 1].invalid = 1;
+
+  return 1;
+}
+
+static int
+ipc_command_parse_boolean(void *ctx, int val)
+{
+  return ipc_command_parse_other(ctx);
+}
+
+static int
+ipc_command_parse_integer(void *ctx, long long val)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 0, 0);
+  IPCCommandSlot *s = res > 0 ? &p->slots[p->len - 1] : NULL;
+
+  if (res < 0) return 0;
+
+  if (res == 1 && p->key == IPC_COMMAND_KEY_COMMAND) {
+    // Commands can also be referred to by their ID from get_commands
+    if (val >= 0 && val < ipc_commands_len) s->parsed.command = val;
+    s->has_command = 1;
+  } else if (res == 1 && p->key == IPC_COMMAND_KEY_ARGS) {
+    s->invalid = 1;
+  } else if (res == 2) {
+    // Any values below 0 must be a signed int, any others should be an
+    // unsigned int
+    Arg *arg = ipc_command_add_arg(p, val < 0 ? ARG_TYPE_SINT : ARG_TYPE_UINT);
+    if (arg == NULL) return 0;
+    if (val < 0)
+      arg->i = val;
+    else
+      arg->ui = val;
+    DEBUG("i=%lld\n", val);
+  }
+
+  return 1;
+}
+
+static int
+ipc_command_parse_double(void *ctx, double val)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 0, 0);
+
+  if (res < 0) return 0;
+
+  if (res == 1 && p->key != IPC_COMMAND_KEY_OTHER) {
+    p->slots[p->len - 1].invalid = 1;
+  } else if (res == 2) {
+    // If the number is not an integer, it must be a float
+    Arg *arg = ipc_command_add_arg(p, ARG_TYPE_FLOAT);
+    if (arg == NULL) return 0;
+    arg->f = (float)val;
+    DEBUG("f=%f\n", arg->f);
+  }
+
+  return 1;
+}
+
+static int
+ipc_command_parse_string(void *ctx, const unsigned char *val, size_t len)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 0, 0);
+  IPCCommandSlot *s = res > 0 ? &p->slots[p->len - 1] : NULL;
+  char *str;
+
+  if (res < 0) return 0;
+
+  if (res == 1 && p->key == IPC_COMMAND_KEY_COMMAND) {
+    if ((str = ipc_command_string(p, val, len)) == NULL) return 0;
+    s->parsed.command = ipc_name_table_find(&ipc_command_table, str);
+    // The name is only needed to report that the command does not exist
+    if (s->parsed.command < 0) s->parsed.name = str;
+    s->has_command = 1;
+  } else if (res == 1 && p->key == IPC_COMMAND_KEY_ARGS) {
+    s->invalid = 1;
+  } else if (res == 2) {
+    Arg *arg = ipc_command_add_arg(p, ARG_TYPE_STR);
+    if (arg == NULL || (str = ipc_command_string(p, val, len)) == NULL)
+      return 0;
+    arg->v = str;
+  }
+
+  return 1;
+}
+
+static int
+ipc_command_parse_start_map(void *ctx)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 1, 0);
+
+  if (res < 0) return 0;
+  if ((res == 1 && p->key != IPC_COMMAND_KEY_OTHER) || res == 2)
+    p->slots[p->len - 1].invalid = 1;
+
+  p->depth++;
+  p->key = IPC_COMMAND_KEY_OTHER;
+
+  return 1;
+}
+
+static int
+ipc_command_parse_map_key(void *ctx, const unsigned char *key, size_t len)
+{
+  IPCCommandParser *p = ctx;
+
+  if (p->depth != ipc_command_depth(p)) return 1;
+
+  if (len == 7 && memcmp(key, "command", 7) == 0)
+    p->key = IPC_COMMAND_KEY_COMMAND;
+  else if (len == 4 && memcmp(key, "args", 4) == 0)
+    p->key = IPC_COMMAND_KEY_ARGS;
+  else
+    p->key = IPC_COMMAND_KEY_OTHER;
+
+  return 1;
+}
+
+static int
+ipc_command_parse_end_map(void *ctx)
+{
+  IPCCommandParser *p = ctx;
+
+  if (--p->depth == ipc_command_depth(p) - 1 && ipc_command_end(p) < 0)
+    return 0;
+
+  return 1;
+}
+
+static int
+ipc_command_parse_start_array(void *ctx)
+{
+  IPCCommandParser *p = ctx;
+  const int res = ipc_command_value(p, 0, 1);
+
+  if (res < 0) return 0;
+
+  if (res == 1 && p->key == IPC_COMMAND_KEY_ARGS) {
+    IPCCommandSlot *s = &p->slots[p->len - 1];
+    // Arguments given twice replace the first ones
+    s->parsed.argc = 0;
+    s->has_args = 1;
+    p->in_args = 1;
+  } else if ((res == 1 && p->key == IPC_COMMAND_KEY_COMMAND) || res == 2) {
+    p->slots[p->len - 1].invalid = 1;
+  }
+
+  p->depth++;
+
+  return 1;
+}
+
+static int
+ipc_command_parse_end_array(void *ctx)
+{
+  IPCCommandParser *p = ctx;
+
+  if (--p->depth == ipc_command_depth(p)) p->in_args = 0;
+
+  return 1;
+}
+
+static const yajl_callbacks ipc_command_callbacks = {
+    ipc_command_parse_other,      ipc_command_parse_boolean,
+    ipc_command_parse_integer,    ipc_command_parse_double,
+    NULL,                         ipc_command_parse_string,
+    ipc_command_parse_start_map,  ipc_command_parse_map_key,
+    ipc_command_parse_end_map,    ipc_command_parse_start_array,
+    ipc_command_parse_end_array};
+
+/**
+ * Parse a IPC_TYPE_RUN_COMMAND message, or a IPC_TYPE_RUN_BATCH message if
+ * batch is non-zero, from a client. Nothing is allocated outside of the
+ * client's scratch arena, string arguments point into the message or the
+ * arena and are valid until the arena is reset.
+ *
+ * A command that is not an object or is missing its command or args member
+ * is marked invalid and does not stop the rest of a batch from being parsed.
+ *
+ * Returns the number of commands parsed, with their address stored in slots
+ * Returns -1 if the message is not valid JSON of the expected shape
+ */
+static int
+ipc_parse_commands(IPCClient *c, char *msg, size_t msg_len, int batch,
+                   IPCCommandSlot **slots)
+{
+  yajl_alloc_funcs funcs = {ipc_yajl_malloc, ipc_yajl_realloc, ipc_yajl_free,
+                            &c->arena};
+  IPCCommandParser p = {.arena = &c->arena,
+                        .msg = msg,
+                        .msg_len = msg_len,
+                        .batch = batch,
+                        .depth = 0,
+                        .key = IPC_COMMAND_KEY_OTHER,
+                        .in_args = 0,
+                        .slots = NULL,
+                        .len = 0,
+                        .cap = 0};
+  int ret = -1;
+
+  // The payload includes the null character at the end of the JSON
+  if (msg == NULL || msg_len == 0 || msg[msg_len - 1] != '\0') {
+    fputs("Failed to parse command from client\n", stderr);
+    return -1;
+  }
+
+  yajl_handle hand = yajl_alloc(&ipc_command_callbacks, &funcs, &p);
+  if (hand == NULL) {
+    fputs("Failed to allocate parser\n", stderr);
+    return -1;
+  }
+
+  yajl_status status =
+      yajl_parse(hand, (const unsigned char *)msg, msg_len - 1);
+  if (status == yajl_status_ok) status = yajl_complete_parse(hand);
+
+  if (status != yajl_status_ok) {
+    unsigned char *error =
+        yajl_get_error(hand, 0, (const unsigned char *)msg, msg_len - 1);
+    fputs("Failed to parse command from client\n", stderr);
+    if (error != NULL) fprintf(stderr, "%s\n", error);
+    yajl_free_error(hand, error);
+  } else {
+    *slots = p.slots;
+    ret = p.len;
+  }
+
+  yajl_free(hand);
+
+  return ret;
+}
+
+/**
+ * Check if the given arguments are the correct length and type. Also do any
+ * casting to correct the types.
+ *
+ * Returns 0 if the arguments were the correct length and types
+ * Returns -1 if the argument count doesn't match
+ * Returns -2 if the argument types don't match
+ */
+static int
+ipc_validate_run_command(IPCParsedCommand *parsed, const IPCCommand actual)
+{
+  if (actual.argc != parsed->argc) return -1;
+
+  for (int i = 0; i < parsed->argc; i++) {
+    ArgType ptype = parsed->arg_types[i];
+    ArgType atype = actual.arg_types[i];
+
+    if (ptype != atype) {
+      if (ptype == ARG_TYPE_UINT && atype == ARG_TYPE_PTR)
+        // If this argument is supposed to be a void pointer, cast it
+        parsed->args[i].v = (void *)parsed->args[i].ui;
+      else if (ptype == ARG_TYPE_UINT && atype == ARG_TYPE_SINT)
+        // If this argument is supposed to be a signed int, cast it
+        parsed->args[i].i = parsed->args[i].ui;
+      else
+        return -2;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Convert event name to their IPCEvent equivalent enum value
+ *
+ * Returns 0 if a valid event name was given
+ * Returns -1 otherwise
+ */
+static int
+ipc_event_stoi(const char *subscription, IPCEvent *event)
+{
+  const int i = ipc_name_table_find(&ipc_event_table, subscription);
+
+  if (i < 0) return -1;
+  *event = 1 << i;
+  return 0;
+}
+
+/**
+ * Convert an event name, or an event ID from get_commands, to its IPCEvent
+ * equivalent enum value
+ *
+ * Returns 0 if a valid event name or ID was given
+ * Returns -1 otherwise
+ */
+static int
+ipc_event_vtoi(yajl_val val, IPCEvent *event)
+{
+  if (YAJL_IS_INTEGER(val)) {
+    const long long id = YAJL_GET_INTEGER(val);
+    if (id < 0 || id >= LENGTH(ipc_event_names)) return -1;
+    *event = 1 << id;
+    return 0;
+  }
+
+  if (!YAJL_IS_STRING(val)) return -1;
+  return ipc_event_stoi(YAJL_GET_STRING(val), event);
+}
+
+/**
+ * Convert the name of an event field to its IPCEventField equivalent
+ *
+ * Returns 0 if a valid field name was given
+ * Returns -1 otherwise
+ */
+static int
+ipc_event_field_stoi(const char *name, IPCEventField *field)
+{
+  for (int i = 0; i < LENGTH(ipc_event_fields); i++) {
+    if (strcmp(name, ipc_event_fields[i].name) == 0) {
+      *field = ipc_event_fields[i].field;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Parse the filter of a subscription. Keys that are not given leave the
+ * corresponding part of the filter unrestricted. Besides selecting events and
+ * fields, the filter can ask for events to be conflated or rate limited.
+ *
+ * Returns 0 if the filter was successfully parsed
+ * Returns -1 otherwise
+ */
+static int
+ipc_parse_event_filter(yajl_val filter_val, IPCEventFilter *filter)
+{
+  // Format:
+  // {
+  //   "monitor_number": <monitor number>,
+  //   "client_window_id": <window id>,
+  //   "fields": [ "<field name>", ... ],
+  //   "conflate": <true|false>,
+  //   "max_rate": <events per second>
+  // }
+  const char *monitor_path[] = {"monitor_number", 0};
+  const char *window_path[] = {"client_window_id", 0};
+  const char *fields_path[] = {"fields", 0};
+  const char *conflate_path[] = {"conflate", 0};
+  const char *max_rate_path[] = {"max_rate", 0};
+  yajl_val val;
+
+  if (!YAJL_IS_OBJECT(filter_val)) return -1;
+
+  if ((val = yajl_tree_get(filter_val, monitor_path, yajl_t_any)) != NULL) {
+    if (!YAJL_IS_INTEGER(val) || YAJL_GET_INTEGER(val) < 0) return -1;
+    filter->monitor = YAJL_GET_INTEGER(val);
+  }
+
+  if ((val = yajl_tree_get(filter_val, window_path, yajl_t_any)) != NULL) {
+    if (!YAJL_IS_INTEGER(val) || YAJL_GET_INTEGER(val) <= 0) return -1;
+    filter->window = YAJL_GET_INTEGER(val);
+  }
+
+  if ((val = yajl_tree_get(filter_val, fields_path, yajl_t_any)) != NULL) {
+    if (!YAJL_IS_ARRAY(val)) return -1;
+
+    for (size_t i = 0; i < val->u.array.len; i++) {
+      yajl_val field_val = val->u.array.values[i];
+      IPCEventField field;
+
+      if (!YAJL_IS_STRING(field_val) ||
+          ipc_event_field_stoi(YAJL_GET_STRING(field_val), &field) < 0)
+        return -1;
+      filter->fields |= field;
+    }
+  }
+
+  if ((val = yajl_tree_get(filter_val, conflate_path, yajl_t_any)) != NULL) {
+    if (!YAJL_IS_TRUE(val) && !YAJL_IS_FALSE(val)) return -1;
+    filter->conflate = YAJL_IS_TRUE(val);
+  }
+
+  if ((val = yajl_tree_get(filter_val, max_rate_path, yajl_t_any)) != NULL) {
+    if (!YAJL_IS_INTEGER(val) || YAJL_GET_INTEGER(val) < 0 ||
+        YAJL_GET_INTEGER(val) > UINT_MAX)
+      return -1;
+    filter->max_rate = YAJL_GET_INTEGER(val);
+  }
+
+  return 0;
+}
+
+/**
+ * Parse a IPC_TYPE_SUBSCRIBE message from a client. This function extracts the
+ * event name, the subscription action, the optional filter and the optional
+ * sequence number to replay events after from the message.
+ *
+ * Returns 0 if message was successfully parsed
+ * Returns -1 if the event or action is invalid
+ * Returns -2 if the filter is invalid
+ * Returns -3 if the sequence number is invalid
+ */
+static int
+ipc_parse_subscribe(const char *msg, IPCSubscriptionAction *subscribe,
+                    IPCEvent *event, IPCEventFilter *filter, long *since_seq)
+{
+  char error_buffer[100];
+  yajl_val parent = yajl_tree_parse((char *)msg, error_buffer, 100);
+  int ret = -1;
+
+  if (parent == NULL) {
+    fputs("Failed to parse command from client\n", stderr);
+    fprintf(stderr, "%s\n", error_buffer);
+    return -1;
+  }
+
+  // Format:
+  // {
+  //   "event": "<event name>"
+  //   "action": "<subscribe|unsubscribe>"
+  //   "filter": { ... }
+  //   "since_seq": <sequence number of the last event received>
+  // }
+  const char *event_path[] = {"event", 0};
+  const char *action_path[] = {"action", 0};
+  const char *filter_path[] = {"filter", 0};
+  const char *since_path[] = {"since_seq", 0};
+  yajl_val event_val = yajl_tree_get(parent, event_path, yajl_t_any);
+  yajl_val action_val = yajl_tree_get(parent, action_path, yajl_t_string);
+  yajl_val filter_val = yajl_tree_get(parent, filter_path, yajl_t_any);
+  yajl_val since_val = yajl_tree_get(parent, since_path, yajl_t_any);
+  const char *action = action_val ? YAJL_GET_STRING(action_val) : NULL;
+
+  if (event_val == NULL) {
+    fputs("No 'event' key found in client message\n", stderr);
+  } else if (ipc_event_vtoi(event_val, event) < 0) {
+    DEBUG("Received invalid event\n");
+  } else if (action == NULL) {
+    fputs("No 'action' key found in client message\n", stderr);
+  } else if (strcmp(action, "subscribe") == 0) {
+    *subscribe = IPC_ACTION_SUBSCRIBE;
+    ret = 0;
+  } else if (strcmp(action, "unsubscribe") == 0) {
+    *subscribe = IPC_ACTION_UNSUBSCRIBE;
+    ret = 0;
+  } else {
+    fputs("Invalid action specified for subscription\n", stderr);
+  }
+
+  if (ret == 0 && filter_val != NULL &&
+      ipc_parse_event_filter(filter_val, filter) < 0) {
+    fputs("Invalid filter specified for subscription\n", stderr);
+    ret = -2;
+  }
+
+  if (ret == 0 && since_val != NULL) {
+    if (!YAJL_IS_INTEGER(since_val) || YAJL_GET_INTEGER(since_val) < 0 ||
+        YAJL_GET_INTEGER(since_val) > LONG_MAX) {
+      fputs("Invalid since_seq specified for subscription\n", stderr);
+      ret = -3;
+    } else {
+      *since_seq = YAJL_GET_INTEGER(since_val);
+    }
+  }
+
+  yajl_tree_free(parent);
+
+  return ret;
+}
+
+/**
+ * Convert format name to their IPCFormat equivalent enum value
+ *
+ * Returns 0 if a valid format name was given
+ * Returns -1 otherwise
+ */
+static int
+ipc_format_stoi(const char *name, IPCFormat *format)
+{
+  if (strcmp(name, "json") == 0)
+    *format = IPC_FORMAT_JSON;
+  else if (strcmp(name, "cbor") == 0)
+    *format = IPC_FORMAT_CBOR;
+  else
+    return -1;
+  return 0;
+}
+
+/**
+ * Parse an IPC_TYPE_HANDSHAKE message from a client. This function extracts
+ * the format that the client wants replies and events to be encoded in. JSON
+ * is beautified according to the optional "beautify" key, or the configured
+ * default if it is not given.
+ *
+ * Returns 0 if message was successfully parsed
+ * Returns -1 otherwise
+ */
+static int
+ipc_parse_handshake(const char *msg, IPCFormat *format)
+{
+  char error_buffer[100];
+  yajl_val parent = yajl_tree_parse(msg, error_buffer, 100);
+
+  if (parent == NULL) {
+    fputs("Failed to parse message from client\n", stderr);
+    fprintf(stderr, "%s\n", error_buffer);
+    return -1;
+  }
+
+  // Format:
+  // {
+  //   "format": "<json|cbor>",
+  //   "beautify": <true|false>
+  // }
+  const char *format_path[] = {"format", 0};
+  yajl_val format_val = yajl_tree_get(parent, format_path, yajl_t_string);
+
+  if (format_val == NULL) {
+    fputs("No 'format' key found in client message\n", stderr);
+    yajl_tree_free(parent);
+    return -1;
+  }
+
+  int ret = ipc_format_stoi(YAJL_GET_STRING(format_val), format);
+  if (ret < 0) fputs("Invalid format specified for handshake\n", stderr);
+
+  if (ret == 0 && *format == IPC_FORMAT_JSON) {
+    const char *beautify_path[] = {"beautify", 0};
+    yajl_val beautify_val = yajl_tree_get(parent, beautify_path, yajl_t_any);
+
+    if (beautify_val == NULL)
+      *format = ipc_default_format;
+    else if (YAJL_IS_FALSE(beautify_val))
+      *format = IPC_FORMAT_JSON_COMPACT;
+    else if (!YAJL_IS_TRUE(beautify_val)) {
+      fputs("Invalid value specified for 'beautify'\n", stderr);
+      ret = -1;
+    }
+  }
+
+  yajl_tree_free(parent);
+
+  return ret;
+}
+
+/**
+ * Convert the name of a client or monitor field to its IPCQueryField
+ * equivalent
+ *
+ * Returns 0 if a valid field name was given
+ * Returns -1 otherwise
+ */
+static int
+ipc_query_field_stoi(const char *name, IPCQueryField *field)
+{
+  for (int i = 0; i < LENGTH(ipc_query_fields); i++) {
+    if (strcmp(name, ipc_query_fields[i].name) == 0) {
+      *field = ipc_query_fields[i].field;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Parse the optional projection of a get_monitors or get_dwm_client query. The
+ * fields are left at 0, meaning all fields, if the query does not name any.
+ *
+ * Returns 0 if the fields were successfully parsed
+ * Returns -1 if a field is not known or the value is not an array of strings
+ */
+static int
+ipc_parse_query_fields(yajl_val parent, unsigned int *fields)
+{
+  const char *fields_path[] = {"fields", 0};
+  yajl_val val = yajl_tree_get(parent, fields_path, yajl_t_any);
+
+  *fields = 0;
+  if (val == NULL) return 0;
+  if (!YAJL_IS_ARRAY(val)) return -1;
+
+  for (size_t i = 0; i < val->u.array.len; i++) {
+    yajl_val field_val = val->u.array.values[i];
+    IPCQueryField field;
+
+    if (!YAJL_IS_STRING(field_val) ||
+        ipc_query_field_stoi(YAJL_GET_STRING(field_val), &field) < 0)
+      return -1;
+    *fields |= field;
+  }
+
+  return 0;
+}
+
+/**
+ * Parse an IPC_TYPE_GET_MONITORS message from a client. The message may be
+ * empty, in which case all fields of all monitors are requested.
+ *
+ * Returns 0 if message was successfully parsed
+ * Returns -1 otherwise
+ */
+static int
+ipc_parse_get_monitors(const char *msg, int *monitor, unsigned int *fields)
+{
+  char error_buffer[100];
+  int ret = -1;
+
+  *monitor = -1;
+  *fields = 0;
+  if (msg == NULL || msg[0] == '\0') return 0;
+
+  yajl_val parent = yajl_tree_parse(msg, error_buffer, 100);
+
+  if (parent == NULL) {
+    fputs("Failed to parse message from client\n", stderr);
+    fprintf(stderr, "%s\n", error_buffer);
+    return -1;
+  }
+
+  // Format:
+  // {
+  //   "monitor": <monitor number>,
+  //   "fields": [ "<field name>", ... ]
+  // }
+  const char *monitor_path[] = {"monitor", 0};
+  yajl_val val = yajl_tree_get(parent, monitor_path, yajl_t_any);
+
+  if (!YAJL_IS_OBJECT(parent))
+    fputs("Monitor query is not an object\n", stderr);
+  else if (val != NULL &&
+           (!YAJL_IS_INTEGER(val) || YAJL_GET_INTEGER(val) < 0 ||
+            YAJL_GET_INTEGER(val) > INT_MAX))
+    fputs("Invalid monitor number in client message\n", stderr);
+  else if (ipc_parse_query_fields(parent, fields) < 0)
+    fputs("Invalid fields in client message\n", stderr);
+  else {
+    if (val != NULL) *monitor = YAJL_GET_INTEGER(val);
+    ret = 0;
+  }
+
+  yajl_tree_free(parent);
+
+  return ret;
+}
+
+/**
+ * Parse an IPC_TYPE_GET_DWM_CLIENT message from a client. This function
+ * extracts the window id and the optional fields from the message.
+ *
+ * Returns 0 if message was successfully parsed
+ * Returns -1 otherwise
+ */
+static int
+ipc_parse_get_dwm_client(const char *msg, Window *win, unsigned int *fields)
+{
+  char error_buffer[100];
+
+  yajl_val parent = yajl_tree_parse(msg, error_buffer, 100);
+
+  if (parent == NULL) {
+    fputs("Failed to parse message from client\n", stderr);
+    fprintf(stderr, "%s\n", error_buffer);
+    return -1;
+  }
+
+  // Format:
+  // {
+  //   "client_window_id": <client window id>,
+  //   "fields": [ "<field name>", ... ]
+  // }
+  const char *win_path[] = {"client_window_id", 0};
+  yajl_val win_val = yajl_tree_get(parent, win_path, yajl_t_number);
+
+  if (win_val == NULL) {
+    fputs("No client window id found in client message\n", stderr);
+    yajl_tree_free(parent);
+    return -1;
+  }
+
+  if (ipc_parse_query_fields(parent, fields) < 0) {
+    fputs("Invalid fields in client message\n", stderr);
+    yajl_tree_free(parent);
+    return -1;
+  }
+
+  *win = YAJL_GET_INTEGER(win_val);
+
+  yajl_tree_free(parent);
+
+  return 0;
+}
+
+/**
+ * Look up and call the function for a parsed command. If the command could not
+ * be run, a description of the problem is written to reason.
+ *
+ * NOTE: There is currently no check for argument validity beyond the number of
+ * arguments given and types of arguments. There is also no way to check if the
+ * function succeeded based on dwm's void(const Arg*) function types. Pointer
+ * arguments can cause crashes if they are not validated in the function itself.
+ *
+ * Returns 0 if the function for the command was called
+ * Returns -1 if the command does not exist or the arguments are invalid
+ */
+static int
+ipc_exec_command(IPCParsedCommand *parsed_command, char *reason,
+                 size_t reason_len)
+{
+  if (parsed_command->command < 0) {
+    if (parsed_command->name)
+      snprintf(reason, reason_len, "Command %s not found",
+               parsed_command->name);
+    else
+      snprintf(reason, reason_len, "Command ID not found");
+    return -1;
+  }
+
+  const IPCCommand ipc_command = ipc_commands[parsed_command->command];
+
+  int res = ipc_validate_run_command(parsed_command, ipc_command);
+  if (res == -1) {
+    snprintf(reason, reason_len, "%u arguments provided, %u expected",
+             parsed_command->argc, ipc_command.argc);
+    return -1;
+  } else if (res == -2) {
+    snprintf(reason, reason_len, "Type mismatch");
+    return -1;
+  }
+
+  if (parsed_command->argc == 1)
+    ipc_command.func.single_param(parsed_command->args);
+  else if (parsed_command->argc > 1)
+    ipc_command.func.array_param(parsed_command->args, parsed_command->argc);
+  ipc_generations_stale = 1;
+
+  DEBUG("Called function for command %s\n", ipc_command.name);
+
+  return 0;
+}
+
+/**
+ * Called when an IPC_TYPE_RUN_COMMAND message is received from a client. This
+ * function parses, executes the given command, and prepares a reply message to
+ * the client indicating success/failure.
+ *
+ * Returns 0 if message was successfully parsed
+ * Returns -1 on failure parsing message
+ */
+static int
+ipc_run_command(IPCClient *ipc_client, char *msg, size_t msg_len)
+{
+  IPCCommandSlot *slots;
+  char reason[IPC_REASON_MAX];
+
+  if (ipc_parse_commands(ipc_client, msg, msg_len, 0, &slots) < 0 ||
+      slots[0].invalid) {
+    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND,
+                              "Failed to parse run command");
+    return -1;
+  }
+
+  DEBUG("Received command: %d\n", slots[0].parsed.command);
+
+  if (ipc_exec_command(&slots[0].parsed, reason, sizeof(reason)) < 0) {
+    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND, "%s", reason);
+    return -1;
+  }
+
+  ipc_prepare_reply_success(ipc_client, IPC_TYPE_RUN_COMMAND);
+  return 0;
+}
+
+/**
+ * Called when an IPC_TYPE_RUN_BATCH message is received from a client. The
+ * message is an array of objects in the same format as an IPC_TYPE_RUN_COMMAND
+ * message. The commands are run in order and any arrange they cause is held
+ * back until the whole batch has run, so the layout is only recomputed once.
+ * A failing command does not stop the rest of the batch. The reply is an array
+ * with the result of each command.
+ *
+ * Returns 0 if the message was successfully parsed
+ * Returns -1 on failure parsing message
+ */
+static int
+ipc_run_batch(IPCClient *ipc_client, char *msg, size_t msg_len)
+{
+  IPCCommandSlot *slots;
+  IPCGen *gen;
+  const int len = ipc_parse_commands(ipc_client, msg, msg_len, 1, &slots);
+
+  if (len < 0) {
+    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_BATCH,
+                              "Failed to parse batch");
+    return -1;
+  }
+
+  // An empty reason marks a command that was run successfully
+  char(*reasons)[IPC_REASON_MAX] =
+      ipc_arena_alloc(&ipc_client->arena, (len ? len : 1) * sizeof(*reasons));
+
+  if (reasons == NULL) {
+    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_BATCH,
+                              "Failed to allocate batch results");
+    return -1;
+  }
+
+  holdarrange(1);
+  for (int i = 0; i < len; i++) {
+    reasons[i][0] = '\0';
+    if (slots[i].invalid)
+      snprintf(reasons[i], IPC_REASON_MAX, "Failed to parse command %d", i);
+    else
+      ipc_exec_command(&slots[i].parsed, reasons[i], IPC_REASON_MAX);
+  }
+  holdarrange(0);
+
+  // The reply is generated only after all commands have run, since commands
+  // can queue events that share the generators with replies
+  if ((gen = ipc_reply_init_message(ipc_client)) != NULL) {
+    ipc_gen_array_open(gen);
+    for (int i = 0; i < len; i++) {
+      if (reasons[i][0] == '\0')
+        dump_success_message(gen);
+      else
+        dump_error_message(gen, reasons[i]);
+    }
+    ipc_gen_array_close(gen);
+    ipc_reply_prepare_send_message(gen, ipc_client, IPC_TYPE_RUN_BATCH);
+  }
+
+  return 0;
+}
+
+/**
+ * Store the message encoded by the generator as the cached reply of the
+ * specified type in the generator's format, replacing the cached one
+ *
+ * Returns the cached frame, NULL if it could not be allocated
+ */
+static IPCFrame *
+ipc_reply_cache_store(IPCGen *gen, IPCMessageType msg_type)
+{
+  const unsigned char *buffer;
+  size_t len = 0;
+  IPCFrame **cached = &ipc_reply_cache[msg_type][gen->format];
+
+  uint8_t type = ipc_gen_message(gen, msg_type, &buffer, &len);
+
+  if (*cached) ipc_frame_unref(*cached);
+  *cached = ipc_frame_create(type, len, (const char *)buffer, NULL);
+
+  ipc_gen_clear(gen);
+
+  return *cached;
+}
+
+/**
+ * Send a cached reply to a client. The cached frame is shared, unless the
+ * client sent a request ID. The ID goes into the header, so then the payload
+ * is copied into a new frame without being encoded again.
+ */
+static void
+ipc_reply_send_cached(IPCClient *c, IPCFrame *f)
+{
+  const uint32_t *request_id = ipc_reply_id(c);
+  dwm_ipc_header_t header;
+
+  if (request_id == NULL) {
+    ipc_send_frame(c, f);
+    return;
+  }
+
+  memcpy(&header, f->data, sizeof(header));
+  IPCFrame *copy = ipc_frame_create(header.type, header.size,
+                                    f->data + sizeof(header), request_id);
+
+  if (copy == NULL) {
+    fprintf(stderr, "Failed to allocate message for client at fd %d\n", c->fd);
+    return;
+  }
+
+  ipc_send_frame(c, copy);
+  ipc_frame_unref(copy);
+}
+
+/**
+ * Hash everything about a client that dump_client reports
+ */
+static uint64_t
+ipc_client_state_hash(const Client *c)
+{
+  const int vals[] = {c->x,          c->y,          c->w,
+                      c->h,          c->oldx,       c->oldy,
+                      c->oldw,       c->oldh,       c->basew,
+                      c->baseh,      c->incw,       c->inch,
+                      c->maxw,       c->maxh,       c->minw,
+                      c->minh,       c->bw,         c->oldbw,
+                      c->isfixed,    c->isfloating, c->isurgent,
+                      c->neverfocus, c->oldstate,   c->isfullscreen,
+                      c->mon->num,   (int)c->tags};
+  const float ratios[] = {c->mina, c->maxa};
+  uint64_t hash = IPC_HASH_INIT;
+
+  // Include the null char so the name can't run into the next field
+  hash = ipc_hash(hash, c->name, strlen(c->name) + 1);
+  hash = ipc_hash(hash, vals, sizeof(vals));
+  return ipc_hash(hash, ratios, sizeof(ratios));
+}
+
+/**
+ * Hash everything about a monitor that dump_monitor reports
+ */
+static uint64_t
+ipc_monitor_state_hash(const Monitor *m, const Monitor *selmon)
+{
+  const int vals[] = {m->nmaster,
+                      m->num,
+                      m == selmon,
+                      m->mx,
+                      m->my,
+                      m->mw,
+                      m->mh,
+                      m->wx,
+                      m->wy,
+                      m->ww,
+                      m->wh,
+                      (int)m->tagset[m->seltags],
+                      (int)m->tagset[m->seltags ^ 1],
+                      m->tagstate.selected,
+                      m->tagstate.occupied,
+                      m->tagstate.urgent,
+                      m->by,
+                      m->showbar,
+                      m->topbar};
+  const uintptr_t ptrs[] = {(uintptr_t)m->lt[m->sellt],
+                            (uintptr_t)m->lt[m->sellt ^ 1],
+                            m->sel ? m->sel->win : 0, m->barwin};
+  uint64_t hash = IPC_HASH_INIT;
+
+  hash = ipc_hash(hash, vals, sizeof(vals));
+  hash = ipc_hash(hash, ptrs, sizeof(ptrs));
+  hash = ipc_hash(hash, &m->mfact, sizeof(m->mfact));
+  hash = ipc_hash(hash, m->ltsymbol, strlen(m->ltsymbol) + 1);
+  hash = ipc_hash(hash, m->lastltsymbol, strlen(m->lastltsymbol) + 1);
+
+  // The order of both lists is reported, a 0 separates them
+  for (Client *c = m->clients; c; c = c->next)
+    hash = ipc_hash(hash, &c->win, sizeof(c->win));
+  hash = ipc_hash(hash, &(Window){0}, sizeof(Window));
+  for (Client *c = m->stack; c; c = c->snext)
+    hash = ipc_hash(hash, &c->win, sizeof(c->win));
+
+  return hash;
+}
+
+/**
+ * Assign a client a new generation if it is new or has changed since its
+ * generation was last updated
+ */
+static void
+ipc_update_client_generation(Client *c)
+{
+  const uint64_t hash = ipc_client_state_hash(c);
+
+  if (c->gen == 0 || c->genhash != hash) {
+    c->gen = ++ipc_generation;
+    c->genhash = hash;
+  }
+}
+
+/**
+ * Bring the generation of every monitor and client up to date. Changes are
+ * only looked for when a generation is about to be reported, so any number of
+ * changes in between result in a single new generation. Nothing is hashed
+ * unless dwm handled X events, ran IPC commands or ipc_send_events updated the
+ * reported state of a monitor since the last update.
+ */
+static void
+ipc_update_generations(Monitor *mons, Monitor *selmon)
+{
+  if (!ipc_generations_stale) return;
+  ipc_generations_stale = 0;
+
+  for (Monitor *m = mons; m; m = m->next) {
+    const uint64_t hash = ipc_monitor_state_hash(m, selmon);
+
+    if (m->gen == 0 || m->genhash != hash) {
+      m->gen = ++ipc_generation;
+      m->genhash = hash;
+    }
+
+    for (Client *c = m->clients; c; c = c->next)
+      ipc_update_client_generation(c);
   }
+}
+
+/**
+ * Remember that a monitor or client was removed. Once the ring of removals is
+ * full the oldest one is forgotten.
+ */
+static void
+ipc_record_removal(int is_monitor, unsigned long id)
+{
+  if (ipc_removals_len == IPC_REMOVALS_MAX) {
+    ipc_removals_floor = ipc_removals[ipc_removals_start].generation;
+    ipc_removals_start = (ipc_removals_start + 1) % IPC_REMOVALS_MAX;
+    ipc_removals_len--;
+  }
+
+  IPCRemoval *r =
+      &ipc_removals[(ipc_removals_start + ipc_removals_len) % IPC_REMOVALS_MAX];
+  r->is_monitor = is_monitor;
+  r->id = id;
+  r->generation = ++ipc_generation;
+  ipc_removals_len++;
+}
+
+/**
+ * Called when an IPC_TYPE_GET_MONITORS message is received from a client. It
+ * prepares a reply with the properties of the monitors in JSON. The full reply
+ * is cached and only encoded again once a monitor or client changed. Queries
+ * for a single monitor or a subset of the fields are encoded for each request
+ * and only serialize what was asked for.
+ *
+ * Returns 0 if the message was successfully parsed and the monitor was found
+ * Returns -1 otherwise
+ */
+static int
+ipc_get_monitors(IPCClient *c, const char *msg, Monitor *mons, Monitor *selmon)
+{
+  IPCFrame *f = ipc_reply_cache[IPC_TYPE_GET_MONITORS][c->format];
+  unsigned int fields;
+  int monitor;
+  IPCGen *gen;
+
+  if (ipc_parse_get_monitors(msg, &monitor, &fields) < 0) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_GET_MONITORS,
+                              "Invalid monitor query");
+    return -1;
+  }
+
+  ipc_update_generations(mons, selmon);
+
+  if (monitor >= 0 || fields != 0) {
+    Monitor *m = mons;
+    if (monitor >= 0)
+      for (; m && m->num != monitor; m = m->next);
+    if (m == NULL) {
+      ipc_prepare_reply_failure(c, IPC_TYPE_GET_MONITORS,
+                                "Monitor %d not found", monitor);
+      return -1;
+    }
+
+    if ((gen = ipc_reply_init_message(c)) == NULL) return -1;
+    gen->fields = fields;
+
+    // clang-format off
+    YARR(
+      for (; m; m = m->next) {
+        if (monitor < 0 || m->num == monitor)
+          dump_monitor(gen, m, m == selmon);
+      }
+    )
+    // clang-format on
+
+    ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_MONITORS);
+    return 0;
+  }
+
+  if (f == NULL || ipc_monitors_cache_gen[c->format] != ipc_generation) {
+    if ((gen = ipc_reply_init_message(c)) == NULL) return -1;
+    dump_monitors(gen, mons, selmon);
+
+    if ((f = ipc_reply_cache_store(gen, IPC_TYPE_GET_MONITORS)) == NULL) {
+      fprintf(stderr, "Failed to cache monitors for client at fd %d\n", c->fd);
+      return -1;
+    }
+    ipc_monitors_cache_gen[c->format] = ipc_generation;
+  }
+
+  ipc_reply_send_cached(c, f);
+  return 0;
+}
+
+/**
+ * Called when an IPC_TYPE_GET_TAGS message is received from a client. It
+ * prepares a reply with info about all the tags in JSON. Tags come from
+ * config.h, so the reply is encoded once per format and then reused.
+ */
+static void
+ipc_get_tags(IPCClient *c, const char *tags[], const int tags_len)
+{
+  IPCFrame *f = ipc_reply_cache[IPC_TYPE_GET_TAGS][c->format];
+
+  if (f == NULL) {
+    IPCGen *gen = ipc_reply_init_message(c);
+    if (gen == NULL) return;
+    dump_tags(gen, tags, tags_len);
+
+    if ((f = ipc_reply_cache_store(gen, IPC_TYPE_GET_TAGS)) == NULL) {
+      fprintf(stderr, "Failed to cache tags for client at fd %d\n", c->fd);
+      return;
+    }
+  }
+
+  ipc_reply_send_cached(c, f);
+}
+
+/**
+ * Called when an IPC_TYPE_GET_LAYOUTS message is received from a client. It
+ * prepares a reply with a JSON array of available layouts. Layouts come from
+ * config.h, so the reply is encoded once per format and then reused.
+ */
+static void
+ipc_get_layouts(IPCClient *c, const Layout layouts[], const int layouts_len)
+{
+  IPCFrame *f = ipc_reply_cache[IPC_TYPE_GET_LAYOUTS][c->format];
+
+  if (f == NULL) {
+    IPCGen *gen = ipc_reply_init_message(c);
+    if (gen == NULL) return;
+    dump_layouts(gen, layouts, layouts_len);
+
+    if ((f = ipc_reply_cache_store(gen, IPC_TYPE_GET_LAYOUTS)) == NULL) {
+      fprintf(stderr, "Failed to cache layouts for client at fd %d\n", c->fd);
+      return;
+    }
+  }
+
+  ipc_reply_send_cached(c, f);
+}
+
+/**
+ * Called when an IPC_TYPE_GET_COMMANDS message is received from a client. It
+ * replies with the IPC commands and events along with their IDs, which can be
+ * used instead of their names. Like tags and layouts these only change with
+ * config.h, so the reply is encoded once per format and then reused.
+ */
+static void
+ipc_get_commands(IPCClient *c)
+{
+  IPCFrame *f = ipc_reply_cache[IPC_TYPE_GET_COMMANDS][c->format];
 
-  const char *action = YAJL_GET_STRING(action_val);
+  if (f == NULL) {
+    IPCGen *gen = ipc_reply_init_message(c);
+    if (gen == NULL) return;
+    dump_commands(gen, ipc_commands, ipc_commands_len, ipc_event_names,
+                  LENGTH(ipc_event_names));
 
-  if (strcmp(action, "subscribe") == 0)
-    *subscribe = IPC_ACTION_SUBSCRIBE;
-  else if (strcmp(action, "unsubscribe") == 0)
-    *subscribe = IPC_ACTION_UNSUBSCRIBE;
-  else {
-    fputs("Invalid action specified for subscription\n", stderr);
-    return -1;
+    if ((f = ipc_reply_cache_store(gen, IPC_TYPE_GET_COMMANDS)) == NULL) {
+      fprintf(stderr, "Failed to cache commands for client at fd %d\n", c->fd);
+      return;
+    }
   }
 
-  yajl_tree_free(parent);
+  ipc_reply_send_cached(c, f);
+}
 
-  return 0;
+/**
+ * Called when an IPC_TYPE_GET_STATS message is received from a client. It
+ * replies with the counters and histograms collected since ipc_init, and the
+ * counters of every connected client.
+ */
+static void
+ipc_get_stats(IPCClient *c)
+{
+  IPCGen *gen = ipc_reply_init_message(c);
+  if (gen == NULL) return;
+
+  // clang-format off
+  YMAP(
+    YSTR("uptime_ms"); YINT(ipc_now_ms() - ipc_stats.start_ms);
+    YSTR("messages"); YMAP(
+      for (int i = 0; i < LENGTH(ipc_message_type_names); i++) {
+        // Events are only ever sent by dwm
+        if (i == IPC_TYPE_EVENT) continue;
+        YSTR(ipc_message_type_names[i]);
+        dump_histogram(gen, &ipc_stats.messages[i]);
+      }
+    )
+    YSTR("send_events"); dump_histogram(gen, &ipc_stats.send_events);
+    YSTR("drawbar"); dump_histogram(gen, &ipc_stats.drawbar);
+    YSTR("x_events_per_wakeup"); dump_histogram(gen, &ipc_stats.x_events);
+    YSTR("events"); YMAP(
+      for (int i = 0; i < LENGTH(ipc_event_names); i++) {
+        YSTR(ipc_event_names[i]); YMAP(
+          YSTR("emitted"); YINT(ipc_stats.events_emitted[i]);
+          YSTR("sent"); YINT(ipc_stats.events_sent[i]);
+          YSTR("held"); YINT(ipc_stats.events_held[i]);
+          YSTR("conflated"); YINT(ipc_stats.events_conflated[i]);
+        )
+      }
+    )
+    YSTR("connections"); YINT(ipc_stats.connections);
+    YSTR("congestions"); YINT(ipc_stats.congestions);
+    YSTR("evictions"); YINT(ipc_stats.evictions);
+    YSTR("bytes_queued"); YINT(ipc_stats.bytes_queued);
+    YSTR("bytes_written"); YINT(ipc_stats.bytes_written);
+    YSTR("buffer_size_max"); YINT(ipc_stats.buffer_size_max);
+    YSTR("pools"); YMAP(
+      for (int i = 0; i < ipc_stats.pools_len; i++) {
+        const Pool *p = ipc_stats.pools[i];
+        YSTR(ipc_stats.pool_names[i]); YMAP(
+          YSTR("in_use"); YINT(p->inuse);
+          YSTR("hits"); YINT(p->hits);
+          YSTR("misses"); YINT(p->misses);
+        )
+      }
+    )
+    YSTR("clients"); YARR(
+      for (IPCClient *ic = ipc_clients; ic; ic = ic->next) {
+        YMAP(
+          YSTR("fd"); YINT(ic->fd);
+          YSTR("subscriptions"); YARR(
+            for (int i = 0; i < LENGTH(ipc_event_names); i++)
+              if (ic->subscriptions & (1 << i)) YSTR(ipc_event_names[i]);
+          )
+          YSTR("buffer_size"); YINT(ic->buffer_size);
+          YSTR("buffer_size_max"); YINT(ic->buffer_size_max);
+          YSTR("bytes_queued"); YINT(ic->bytes_queued);
+          YSTR("bytes_written"); YINT(ic->bytes_written);
+          YSTR("events_sent"); YINT(ic->events_sent);
+          YSTR("held_events"); YINT(ic->held_len);
+          YSTR("congested"); YBOOL(ic->congested);
+        )
+      }
+    )
+  )
+  // clang-format on
+
+  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_STATS);
 }
 
 /**
- * Parse an IPC_TYPE_GET_DWM_CLIENT message from a client. This function
- * extracts the window id from the message.
+ * Parse an IPC_TYPE_GET_CHANGES_SINCE message from a client. This function
+ * extracts the generation that changes are requested since.
  *
  * Returns 0 if message was successfully parsed
  * Returns -1 otherwise
  */
 static int
-ipc_parse_get_dwm_client(const char *msg, Window *win)
+ipc_parse_get_changes_since(const char *msg, unsigned long *since)
 {
   char error_buffer[100];
-
   yajl_val parent = yajl_tree_parse(msg, error_buffer, 100);
+  int ret = -1;
 
   if (parent == NULL) {
     fputs("Failed to parse message from client\n", stderr);
@@ -562,128 +2894,100 @@ ipc_parse_get_dwm_client(const char *msg, Window *win)
 
   // Format:
   // {
-  //   "client_window_id": <client window id>
+  //   "generation": <generation>
   // }
-  const char *win_path[] = {"client_window_id", 0};
-  yajl_val win_val = yajl_tree_get(parent, win_path, yajl_t_number);
+  const char *generation_path[] = {"generation", 0};
+  yajl_val val = yajl_tree_get(parent, generation_path, yajl_t_any);
 
-  if (win_val == NULL) {
-    fputs("No client window id found in client message\n", stderr);
-    return -1;
+  if (val == NULL || !YAJL_IS_INTEGER(val) || YAJL_GET_INTEGER(val) < 0) {
+    fputs("No valid generation found in client message\n", stderr);
+  } else {
+    *since = YAJL_GET_INTEGER(val);
+    ret = 0;
   }
 
-  *win = YAJL_GET_INTEGER(win_val);
-
   yajl_tree_free(parent);
 
-  return 0;
+  return ret;
 }
 
 /**
- * Called when an IPC_TYPE_RUN_COMMAND message is received from a client. This
- * function parses, executes the given command, and prepares a reply message to
- * the client indicating success/failure.
- *
- * NOTE: There is currently no check for argument validity beyond the number of
- * arguments given and types of arguments. There is also no way to check if the
- * function succeeded based on dwm's void(const Arg*) function types. Pointer
- * arguments can cause crashes if they are not validated in the function itself.
+ * Dump the ids of the monitors or clients removed since the specified
+ * generation as an array, oldest first
+ */
+static void
+ipc_dump_removals(IPCGen *gen, int is_monitor, unsigned long since)
+{
+  // clang-format off
+  YARR(
+    for (unsigned int i = 0; i < ipc_removals_len; i++) {
+      const IPCRemoval *r =
+          &ipc_removals[(ipc_removals_start + i) % IPC_REMOVALS_MAX];
+      if (r->is_monitor == is_monitor && r->generation > since)
+        YINT(r->id);
+    }
+  )
+  // clang-format on
+}
+
+/**
+ * Called when an IPC_TYPE_GET_CHANGES_SINCE message is received from a
+ * client. It replies with the current generation, the monitors and clients
+ * whose generation is newer than the requested one, and the monitors and
+ * clients that were removed since then. Removals should be applied first,
+ * since a monitor number can be removed and added again in between.
  *
- * Returns 0 if message was successfully parsed
- * Returns -1 on failure parsing message
+ * Returns 0 if the message was successfully parsed and the changes since the
+ *   requested generation are known
+ * Returns -1 otherwise
  */
 static int
-ipc_run_command(IPCClient *ipc_client, char *msg)
+ipc_get_changes_since(IPCClient *c, const char *msg, Monitor *mons,
+                      Monitor *selmon)
 {
-  IPCParsedCommand parsed_command;
-  IPCCommand ipc_command;
-
-  // Initialize struct
-  memset(&parsed_command, 0, sizeof(IPCParsedCommand));
+  unsigned long since;
 
-  if (ipc_parse_run_command(msg, &parsed_command) < 0) {
-    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND,
-                              "Failed to parse run command");
+  if (ipc_parse_get_changes_since(msg, &since) < 0) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_GET_CHANGES_SINCE,
+                              "Invalid generation");
     return -1;
   }
 
-  if (ipc_get_ipc_command(parsed_command.name, &ipc_command) < 0) {
-    ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND,
-                              "Command %s not found", parsed_command.name);
-    ipc_free_parsed_command_members(&parsed_command);
-    return -1;
-  }
+  ipc_update_generations(mons, selmon);
 
-  int res = ipc_validate_run_command(&parsed_command, ipc_command);
-  if (res < 0) {
-    if (res == -1)
-      ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND,
-                                "%u arguments provided, %u expected",
-                                parsed_command.argc, ipc_command.argc);
-    else if (res == -2)
-      ipc_prepare_reply_failure(ipc_client, IPC_TYPE_RUN_COMMAND,
-                                "Type mismatch");
-    ipc_free_parsed_command_members(&parsed_command);
+  // Generations are only known for the lifetime of this dwm instance
+  if (since < ipc_removals_floor || since > ipc_generation) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_GET_CHANGES_SINCE,
+                              "Generation %lu is not known, get_monitors "
+                              "must be used to resync",
+                              since);
     return -1;
   }
 
-  if (parsed_command.argc == 1)
-    ipc_command.func.single_param(parsed_command.args);
-  else if (parsed_command.argc > 1)
-    ipc_command.func.array_param(parsed_command.args, parsed_command.argc);
-
-  DEBUG("Called function for command %s\n", parsed_command.name);
-
-  ipc_free_parsed_command_members(&parsed_command);
-
-  ipc_prepare_reply_success(ipc_client, IPC_TYPE_RUN_COMMAND);
+  IPCGen *gen = ipc_reply_init_message(c);
+  if (gen == NULL) return -1;
+
+  // clang-format off
+  YMAP(
+    YSTR("generation"); YINT(ipc_generation);
+    YSTR("monitors"); YARR(
+      for (Monitor *m = mons; m; m = m->next)
+        if (m->gen > since) dump_monitor(gen, m, m == selmon);
+    )
+    YSTR("clients"); YARR(
+      for (Monitor *m = mons; m; m = m->next)
+        for (Client *cl = m->clients; cl; cl = cl->next)
+          if (cl->gen > since) dump_client(gen, cl);
+    )
+    YSTR("removed_monitors"); ipc_dump_removals(gen, 1, since);
+    YSTR("removed_clients"); ipc_dump_removals(gen, 0, since);
+  )
+  // clang-format on
+
+  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_CHANGES_SINCE);
   return 0;
 }
 
-/**
- * Called when an IPC_TYPE_GET_MONITORS message is received from a client. It
- * prepares a reply with the properties of all of the monitors in JSON.
- */
-static void
-ipc_get_monitors(IPCClient *c, Monitor *mons, Monitor *selmon)
-{
-  yajl_gen gen;
-  ipc_reply_init_message(&gen);
-  dump_monitors(gen, mons, selmon);
-
-  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_MONITORS);
-}
-
-/**
- * Called when an IPC_TYPE_GET_TAGS message is received from a client. It
- * prepares a reply with info about all the tags in JSON.
- */
-static void
-ipc_get_tags(IPCClient *c, const char *tags[], const int tags_len)
-{
-  yajl_gen gen;
-  ipc_reply_init_message(&gen);
-
-  dump_tags(gen, tags, tags_len);
-
-  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_TAGS);
-}
-
-/**
- * Called when an IPC_TYPE_GET_LAYOUTS message is received from a client. It
- * prepares a reply with a JSON array of available layouts
- */
-static void
-ipc_get_layouts(IPCClient *c, const Layout layouts[], const int layouts_len)
-{
-  yajl_gen gen;
-  ipc_reply_init_message(&gen);
-
-  dump_layouts(gen, layouts, layouts_len);
-
-  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_GET_LAYOUTS);
-}
-
 /**
  * Called when an IPC_TYPE_GET_DWM_CLIENT message is received from a client. It
  * prepares a JSON reply with the properties of the client with the specified
@@ -694,36 +2998,68 @@ ipc_get_layouts(IPCClient *c, const Layout layouts[], const int layouts_len)
  * Returns -1 if the message could not be parsed
  */
 static int
-ipc_get_dwm_client(IPCClient *ipc_client, const char *msg, const Monitor *mons)
+ipc_get_dwm_client(IPCClient *ipc_client, const char *msg)
 {
+  unsigned int fields;
   Window win;
+  Client *c;
 
-  if (ipc_parse_get_dwm_client(msg, &win) < 0) return -1;
+  if (ipc_parse_get_dwm_client(msg, &win, &fields) < 0) return -1;
 
-  // Find client with specified window XID
-  for (const Monitor *m = mons; m; m = m->next)
-    for (Client *c = m->clients; c; c = c->next)
-      if (c->win == win) {
-        yajl_gen gen;
-        ipc_reply_init_message(&gen);
+  // Find client with specified window XID using dwm's window index
+  if ((c = wintoclient(win))) {
+    IPCGen *gen = ipc_reply_init_message(ipc_client);
+    if (gen == NULL) return -1;
 
-        dump_client(gen, c);
+    ipc_update_client_generation(c);
+    gen->fields = fields;
+    dump_client(gen, c);
 
-        ipc_reply_prepare_send_message(gen, ipc_client,
-                                       IPC_TYPE_GET_DWM_CLIENT);
+    ipc_reply_prepare_send_message(gen, ipc_client, IPC_TYPE_GET_DWM_CLIENT);
 
-        return 0;
-      }
+    return 0;
+  }
 
   ipc_prepare_reply_failure(ipc_client, IPC_TYPE_GET_DWM_CLIENT,
                             "Client with window id %d not found", win);
   return -1;
 }
 
+/**
+ * Called when an IPC_TYPE_HANDSHAKE message is received from a client. It
+ * switches the client to the requested format and replies in that format.
+ *
+ * Returns 0 if the message was successfully parsed
+ * Returns -1 otherwise
+ */
+static int
+ipc_handshake(IPCClient *c, const char *msg)
+{
+  IPCFormat format;
+
+  if (ipc_parse_handshake(msg, &format) < 0) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_HANDSHAKE, "Invalid handshake");
+    return -1;
+  }
+
+  c->format = format;
+
+  IPCGen *gen = ipc_reply_init_message(c);
+  if (gen == NULL) return -1;
+  dump_handshake(gen, format == IPC_FORMAT_CBOR ? "cbor" : "json",
+                 IPC_HEADER_EXT_VERSION);
+  ipc_reply_prepare_send_message(gen, c, IPC_TYPE_HANDSHAKE);
+
+  return 0;
+}
+
 /**
  * Called when an IPC_TYPE_SUBSCRIBE message is received from a client. It
  * subscribes/unsubscribes the client from the specified event and replies with
- * the result.
+ * the result. A subscription with a since_seq is followed by the remembered
+ * events after that sequence number, before any new events. If some of those
+ * events were already forgotten, the client is not subscribed and is told to
+ * resync instead.
  *
  * Returns 0 if the message was successfully parsed.
  * Returns -1 if the message could not be parsed
@@ -733,54 +3069,165 @@ ipc_subscribe(IPCClient *c, const char *msg)
 {
   IPCSubscriptionAction action = IPC_ACTION_SUBSCRIBE;
   IPCEvent event = 0;
+  IPCEventFilter filter = {.monitor = -1, .window = 0, .fields = 0};
+  long since_seq = -1;
 
-  if (ipc_parse_subscribe(msg, &action, &event)) {
+  int res = ipc_parse_subscribe(msg, &action, &event, &filter, &since_seq);
+  if (res == -2) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_SUBSCRIBE, "Invalid filter");
+    return -1;
+  } else if (res == -3) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_SUBSCRIBE, "Invalid since_seq");
+    return -1;
+  } else if (res < 0) {
     ipc_prepare_reply_failure(c, IPC_TYPE_SUBSCRIBE, "Event does not exist");
     return -1;
   }
 
+  // Sequence numbers are only known for the lifetime of this dwm instance
+  if (action == IPC_ACTION_SUBSCRIBE && since_seq >= 0 &&
+      (since_seq > ipc_event_seq ||
+       ipc_event_seq - since_seq > ipc_replay_len)) {
+    ipc_prepare_reply_failure(c, IPC_TYPE_SUBSCRIBE,
+                              "Events since %ld are not available, resync "
+                              "required",
+                              since_seq);
+    return -1;
+  }
+
+  // Subscribing again replaces the filter and restarts the rate limit,
+  // unsubscribing resets them. Held events the client is no longer
+  // subscribed to are dropped when held events are sent.
   if (action == IPC_ACTION_SUBSCRIBE) {
     DEBUG("Subscribing client on fd %d to %d\n", c->fd, event);
     c->subscriptions |= event;
   } else if (action == IPC_ACTION_UNSUBSCRIBE) {
     DEBUG("Unsubscribing client on fd %d to %d\n", c->fd, event);
-    c->subscriptions ^= event;
+    c->subscriptions &= ~event;
   } else {
     ipc_prepare_reply_failure(c, IPC_TYPE_SUBSCRIBE,
                               "Invalid subscription action");
     return -1;
   }
+  c->filters[ipc_event_index(event)] = filter;
+  c->rates[ipc_event_index(event)] = (IPCEventRate){.start = 0, .count = 0};
 
   ipc_prepare_reply_success(c, IPC_TYPE_SUBSCRIBE);
+  if (action == IPC_ACTION_SUBSCRIBE && since_seq >= 0)
+    ipc_replay_send(c, event, since_seq);
   return 0;
 }
 
 int
 ipc_init(const char *socket_path, const int p_epoll_fd, IPCCommand commands[],
-         const int commands_len)
+         const int commands_len, const int beautify,
+         const uint32_t high_watermark, const uint32_t low_watermark,
+         const unsigned int evict_grace, const int backlog,
+         const int edge_triggered)
 {
   // Initialize struct to 0
   memset(&sock_epoll_event, 0, sizeof(sock_epoll_event));
 
-  int socket_fd = ipc_create_socket(socket_path);
+  int socket_fd = ipc_create_socket(socket_path, backlog);
   if (socket_fd < 0) return -1;
 
   ipc_commands = commands;
   ipc_commands_len = commands_len;
 
+  // Commands and events are looked up by name for every message that uses
+  // them, so the names are hashed once here
+  if (ipc_name_table_init(&ipc_command_table, commands_len) < 0 ||
+      ipc_name_table_init(&ipc_event_table, LENGTH(ipc_event_names)) < 0) {
+    fputs("Failed to allocate IPC name tables\n", stderr);
+    ipc_name_table_free(&ipc_command_table);
+    ipc_name_table_free(&ipc_event_table);
+    return -1;
+  }
+  for (int i = 0; i < commands_len; i++)
+    ipc_name_table_insert(&ipc_command_table, commands[i].name, i);
+  for (int i = 0; i < LENGTH(ipc_event_names); i++)
+    ipc_name_table_insert(&ipc_event_table, ipc_event_names[i], i);
+
+  ipc_default_format = beautify ? IPC_FORMAT_JSON : IPC_FORMAT_JSON_COMPACT;
+  ipc_high_watermark = high_watermark;
+  ipc_low_watermark = MIN(low_watermark, high_watermark);
+  ipc_evict_grace = evict_grace;
+  ipc_client_trigger = edge_triggered ? EPOLLET : 0;
+
+  memset(&ipc_stats, 0, sizeof(ipc_stats));
+  ipc_stats.start_ms = ipc_now_ms();
+  ipc_stats_pool("ipc_client", &ipc_client_pool);
+  ipc_stats_pool("ipc_scratch", &ipc_chunk_pool);
+
   epoll_fd = p_epoll_fd;
 
   // Wake up to incoming connection requests
-  sock_epoll_event.data.fd = socket_fd;
+  sock_epoll_event.data.ptr = &sock_epoll_type;
   sock_epoll_event.events = EPOLLIN;
   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &sock_epoll_event)) {
     fputs("Failed to add sock file descriptor to epoll", stderr);
     return -1;
   }
 
+  // Without the timer, rate limited events are sent on the next wakeup
+  memset(&timer_epoll_event, 0, sizeof(timer_epoll_event));
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  timer_epoll_event.data.ptr = &timer_epoll_type;
+  timer_epoll_event.events = EPOLLIN;
+  if (timer_fd < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_epoll_event)) {
+    fputs("Failed to set up IPC timer\n", stderr);
+    if (timer_fd >= 0) close(timer_fd);
+    timer_fd = -1;
+  }
+
   return socket_fd;
 }
 
+int
+ipc_state_init(const char *path)
+{
+  char *normal_path, *parent;
+  int fd;
+  void *map;
+
+  normalizepath(path, &normal_path);
+  parentdir(normal_path, &parent);
+  mkdirp(parent);
+  free(parent);
+
+  // Replace the file rather than truncate it, consumers may still map the
+  // snapshot of a previous instance. The snapshot holds window titles, so only
+  // the user running dwm may read it.
+  unlink(normal_path);
+  fd = open(normal_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0 || ftruncate(fd, sizeof(IPCStateSnapshot)) < 0) {
+    fprintf(stderr, "Failed to create state snapshot at %s\n", normal_path);
+    if (fd >= 0) close(fd);
+    free(normal_path);
+    return -1;
+  }
+
+  map = mmap(NULL, sizeof(IPCStateSnapshot), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map state snapshot at %s\n", normal_path);
+    unlink(normal_path);
+    free(normal_path);
+    return -1;
+  }
+
+  ipc_state = map;
+  ipc_state_path = normal_path;
+  memcpy(ipc_state->magic, IPC_STATE_MAGIC, IPC_STATE_MAGIC_LEN);
+  ipc_state->version = IPC_STATE_VERSION;
+
+  DEBUG("Created state snapshot at %s\n", ipc_state_path);
+
+  return 0;
+}
+
 void
 ipc_cleanup()
 {
@@ -791,22 +3238,71 @@ ipc_cleanup()
     c = ipc_clients;
   }
 
+  free(ipc_client_table);
+  ipc_client_table = NULL;
+  ipc_client_table_len = 0;
+  pooldestroy(&ipc_client_pool);
+  pooldestroy(&ipc_chunk_pool);
+
+  for (int i = 0; i < IPC_FORMAT_LAST; i++) ipc_gen_free(&ipc_gens[i]);
+
+  for (int i = 0; i <= IPC_TYPE_GET_COMMANDS; i++) {
+    for (int j = 0; j < IPC_FORMAT_LAST; j++) {
+      if (ipc_reply_cache[i][j]) ipc_frame_unref(ipc_reply_cache[i][j]);
+      ipc_reply_cache[i][j] = NULL;
+    }
+  }
+
   // Stop waking up for socket events
   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock_fd, &sock_epoll_event);
+  if (timer_fd >= 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, timer_fd, &timer_epoll_event);
+    close(timer_fd);
+    timer_fd = -1;
+    ipc_timer_due = 0;
+  }
 
   // Uninitialize all static variables
   epoll_fd = -1;
   sock_fd = -1;
   ipc_commands = NULL;
   ipc_commands_len = 0;
-  memset(&sock_epoll_event, 0, sizeof(struct epoll_event));
-  memset(&sockaddr, 0, sizeof(struct sockaddr_un));
+  ipc_name_table_free(&ipc_command_table);
+  ipc_name_table_free(&ipc_event_table);
+  ipc_default_format = IPC_FORMAT_JSON;
+  ipc_high_watermark = 0;
+  ipc_low_watermark = 0;
+  ipc_evict_grace = 0;
+  ipc_client_trigger = 0;
+  if (ipc_state != NULL) {
+    munmap(ipc_state, sizeof(IPCStateSnapshot));
+    unlink(ipc_state_path);
+    free(ipc_state_path);
+    ipc_state = NULL;
+    ipc_state_path = NULL;
+  }
+  ipc_removals_start = 0;
+  ipc_removals_len = 0;
+  ipc_removals_floor = 0;
+  ipc_generations_stale = 1;
+  for (unsigned int i = 0; i < ipc_replay_len; i++) {
+    IPCReplayEvent *r = &ipc_replay[(ipc_replay_start + i) % IPC_REPLAY_MAX];
+    for (int j = 0; j < IPC_FORMAT_LAST; j++)
+      if (r->frames[j]) ipc_frame_unref(r->frames[j]);
+  }
+  ipc_replay_start = 0;
+  ipc_replay_len = 0;
+  ipc_event_seq = 0;
 
   // Delete socket
   unlink(sockaddr.sun_path);
 
   shutdown(sock_fd, SHUT_RDWR);
   close(sock_fd);
+
+  sock_fd = -1;
+  memset(&sock_epoll_event, 0, sizeof(struct epoll_event));
+  memset(&sockaddr, 0, sizeof(struct sockaddr_un));
 }
 
 int
@@ -818,7 +3314,8 @@ ipc_get_sock_fd()
 IPCClient *
 ipc_get_client(int fd)
 {
-  return ipc_list_get_client(ipc_clients, fd);
+  if (fd < 0 || fd >= ipc_client_table_len) return NULL;
+  return ipc_client_table[fd];
 }
 
 int
@@ -839,27 +3336,56 @@ ipc_accept_client()
   // have nonstandard fields in the structure
   memset(&client_addr, 0, sizeof(struct sockaddr_un));
 
-  fd = accept(sock_fd, (struct sockaddr *)&client_addr, &len);
-  if (fd < 0 && errno != EINTR) {
-    fputs("Failed to accept IPC connection from client", stderr);
+  // Messages are read incrementally, so reads must never block
+  do {
+    fd = accept4(sock_fd, (struct sockaddr *)&client_addr, &len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+  } while (fd < 0 && errno == EINTR);
+
+  if (fd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+      return -2;
+    fprintf(stderr, "Failed to accept IPC connection from client: %s\n",
+            strerror(errno));
     return -1;
   }
 
-  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+  // Make room for the new client in the fd table
+  if (fd >= ipc_client_table_len) {
+    int len = ipc_client_table_len ? ipc_client_table_len : 16;
+    while (len <= fd) len *= 2;
+
+    IPCClient **table =
+        realloc(ipc_client_table, len * sizeof(IPCClient *));
+    if (table == NULL) {
+      shutdown(fd, SHUT_RDWR);
+      close(fd);
+      fputs("Failed to grow IPC client table", stderr);
+      return -1;
+    }
+
+    memset(table + ipc_client_table_len, 0,
+           (len - ipc_client_table_len) * sizeof(IPCClient *));
+    ipc_client_table = table;
+    ipc_client_table_len = len;
+  }
+
+  IPCClient *nc = ipc_client_new(fd, &ipc_client_pool, &ipc_chunk_pool);
+  if (nc == NULL) {
     shutdown(fd, SHUT_RDWR);
     close(fd);
-    fputs("Failed to set flags on new client fd", stderr);
+    fputs("Failed to allocate IPC client", stderr);
+    return -1;
   }
-
-  IPCClient *nc = ipc_client_new(fd);
-  if (nc == NULL) return -1;
+  nc->format = ipc_default_format;
+  ipc_stats.connections++;
 
   // Wake up to messages from this client
-  nc->event.data.fd = fd;
-  nc->event.events = EPOLLIN | EPOLLHUP;
+  nc->event.events = EPOLLIN | EPOLLHUP | ipc_client_trigger;
   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &nc->event);
 
   ipc_list_add_client(&ipc_clients, nc);
+  ipc_client_table[fd] = nc;
 
   DEBUG("%s%d\n", "New client at fd: ", fd);
 
@@ -879,9 +3405,18 @@ ipc_drop_client(IPCClient *c)
     // Stop waking up to messages from this client
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
     ipc_list_remove_client(&ipc_clients, c);
+    ipc_client_table[fd] = NULL;
+    if (c->flush_queued) {
+      IPCClient **p = &ipc_flush_list;
+      while (*p != c) p = &(*p)->flush_next;
+      *p = c->flush_next;
+    }
 
+    ipc_client_clear_queue(c);
+    free(c->held);
     free(c->buffer);
-    free(c);
+    ipc_arena_free(&c->arena);
+    poolfree(&ipc_client_pool, c);
 
     DEBUG("Successfully removed client on fd %d\n", fd);
   } else if (res < 0 && res != EINTR) {
@@ -897,13 +3432,11 @@ ipc_read_client(IPCClient *c, IPCMessageType *msg_type, uint32_t *msg_size,
 {
   int fd = c->fd;
   int ret =
-      ipc_recv_message(fd, (uint8_t *)msg_type, msg_size, (uint8_t **)msg);
+      ipc_recv_message(c, (uint8_t *)msg_type, msg_size, (uint8_t **)msg);
 
   if (ret < 0) {
-    // This will happen if these errors occur while reading header
-    if (ret == -1 &&
-        (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
-      return -2;
+    // The rest of the message hasn't arrived yet
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -2;
 
     fprintf(stderr, "Error reading message: dropping client at fd %d\n", fd);
     ipc_drop_client(c);
@@ -911,12 +3444,10 @@ ipc_read_client(IPCClient *c, IPCMessageType *msg_type, uint32_t *msg_size,
     return -1;
   }
 
-  // Make sure receive message is null terminated to avoid parsing issues
-  if (*msg_size > 0) {
-    size_t len = *msg_size;
-    nullterminate(msg, &len);
-    *msg_size = len;
-  }
+  // Make sure receive message is null terminated to avoid parsing issues. The
+  // buffer has room for one more byte.
+  if (*msg_size > 0 && (*msg)[*msg_size - 1] != '\0')
+    (*msg)[(*msg_size)++] = '\0';
 
   DEBUG("[fd %d] ", fd);
   if (*msg_size > 0)
@@ -932,66 +3463,97 @@ ipc_read_client(IPCClient *c, IPCMessageType *msg_type, uint32_t *msg_size,
 ssize_t
 ipc_write_client(IPCClient *c)
 {
-  const ssize_t n = ipc_write_message(c->fd, c->buffer, c->buffer_size);
+  struct iovec iov[IPC_WRITE_IOV_MAX];
+  ssize_t written = 0;
 
-  if (n < 0) return n;
+  while (c->buffer_len) {
+    const int iovcnt = ipc_client_fill_iovec(c, iov, IPC_WRITE_IOV_MAX);
+    const ssize_t n = ipc_write_message(c->fd, iov, iovcnt);
 
-  // TODO: Deal with client timeouts
+    if (n < 0) return n;
 
-  if (n == c->buffer_size) {
-    c->buffer_size = 0;
-    free(c->buffer);
-    // No dangling pointers!
-    c->buffer = NULL;
-    // Stop waking up when client is ready to receive messages
-    if (c->event.events & EPOLLOUT) {
-      c->event.events -= EPOLLOUT;
-      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event);
+    // TODO: Deal with client timeouts
+
+    ipc_client_consume_queue(c, n);
+    ipc_update_congestion(c);
+    written += n;
+    c->bytes_written += n;
+    ipc_stats.bytes_written += n;
+
+    // Client isn't ready for more, resume from here once it is writable
+    if (n == 0) {
+      if (!(c->event.events & EPOLLOUT)) {
+        c->event.events |= EPOLLOUT;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event);
+      }
+      return written;
     }
-    return n;
   }
 
-  // Shift unwritten buffer to beginning of buffer and reallocate
-  c->buffer_size -= n;
-  memmove(c->buffer, c->buffer + n, c->buffer_size);
-  c->buffer = (char *)realloc(c->buffer, c->buffer_size);
+  // Stop waking up when client is ready to receive messages
+  if (c->event.events & EPOLLOUT) {
+    c->event.events -= EPOLLOUT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event);
+  }
 
-  return n;
+  return written;
 }
 
 void
-ipc_prepare_send_message(IPCClient *c, const IPCMessageType msg_type,
-                         const uint32_t msg_size, const char *msg)
+ipc_mark_changed()
 {
-  dwm_ipc_header_t header = {
-      .magic = IPC_MAGIC_ARR, .type = msg_type, .size = msg_size};
+  ipc_generations_stale = 1;
+}
 
-  uint32_t header_size = sizeof(dwm_ipc_header_t);
-  uint32_t packet_size = header_size + msg_size;
+void
+ipc_flush_clients()
+{
+  IPCClient *c;
+  uint64_t now = 0;
+
+  while ((c = ipc_flush_list) != NULL) {
+    const int congested = c->congested;
+
+    ipc_flush_list = c->flush_next;
+    c->flush_queued = 0;
+    c->flush_next = NULL;
+    if (c->buffer_len && ipc_write_client(c) < 0) {
+      DEBUG("Failed to write to client at fd %d\n", c->fd);
+      continue;
+    }
 
-  if (c->buffer == NULL)
-    c->buffer = (char *)malloc(c->buffer_size + packet_size);
-  else
-    c->buffer = (char *)realloc(c->buffer, c->buffer_size + packet_size);
+    // Events held until the queue drains or the client catches up were looked
+    // at by ipc_send_events before the write. Releasing them now queues the
+    // client again, so they are written by this loop as well.
+    if (c->held_len && (c->buffer_len == 0 || congested != c->congested)) {
+      if (now == 0) now = ipc_now_ms();
+      const uint64_t wait = ipc_flush_held_events(c, now);
+      if (wait > 0 && (ipc_timer_due == 0 || now + wait < ipc_timer_due))
+        ipc_arm_timer(wait);
+    }
+  }
+}
 
-  // Copy header to end of client buffer
-  memcpy(c->buffer + c->buffer_size, &header, header_size);
-  c->buffer_size += header_size;
+void
+ipc_prepare_send_message(IPCClient *c, const IPCMessageType msg_type,
+                         const uint32_t msg_size, const char *msg)
+{
+  IPCFrame *f = ipc_frame_create(msg_type, msg_size, msg, ipc_reply_id(c));
 
-  // Copy message to end of client buffer
-  memcpy(c->buffer + c->buffer_size, msg, msg_size);
-  c->buffer_size += msg_size;
+  if (f == NULL) {
+    fprintf(stderr, "Failed to allocate message for client at fd %d\n", c->fd);
+    return;
+  }
 
-  // Wake up when client is ready to receive messages
-  c->event.events |= EPOLLOUT;
-  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event);
+  ipc_send_frame(c, f);
+  ipc_frame_unref(f);
 }
 
 void
 ipc_prepare_reply_failure(IPCClient *c, IPCMessageType msg_type,
                           const char *format, ...)
 {
-  yajl_gen gen;
+  IPCGen *gen;
   va_list args;
 
   // Get output size
@@ -1000,14 +3562,14 @@ ipc_prepare_reply_failure(IPCClient *c, IPCMessageType msg_type,
   va_end(args);
   char *buffer = (char *)malloc((len + 1) * sizeof(char));
 
-  ipc_reply_init_message(&gen);
-
   va_start(args, format);
   vsnprintf(buffer, len + 1, format, args);
   va_end(args);
-  dump_error_message(gen, buffer);
 
-  ipc_reply_prepare_send_message(gen, c, msg_type);
+  if ((gen = ipc_reply_init_message(c)) != NULL) {
+    dump_error_message(gen, buffer);
+    ipc_reply_prepare_send_message(gen, c, msg_type);
+  }
   fprintf(stderr, "[fd %d] Error: %s\n", c->fd, buffer);
 
   free(buffer);
@@ -1019,26 +3581,36 @@ ipc_prepare_reply_success(IPCClient *c, IPCMessageType msg_type)
   const char *success_msg = "{\"result\":\"success\"}";
   const size_t msg_len = strlen(success_msg) + 1;  // +1 for null char
 
-  ipc_prepare_send_message(c, msg_type, msg_len, success_msg);
+  if (c->format != IPC_FORMAT_CBOR) {
+    ipc_prepare_send_message(c, msg_type, msg_len, success_msg);
+    return;
+  }
+
+  IPCGen *gen = ipc_reply_init_message(c);
+  if (gen == NULL) return;
+  dump_success_message(gen);
+  ipc_reply_prepare_send_message(gen, c, msg_type);
 }
 
 void
 ipc_tag_change_event(int mon_num, TagState old_state, TagState new_state)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_tag_event(gen, mon_num, old_state, new_state);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_TAG_CHANGE);
+  IPCEventData e = ipc_event_data(IPC_EVENT_TAG_CHANGE, mon_num, -1, 0, 0);
+
+  e.u.tag.old_state = old_state;
+  e.u.tag.new_state = new_state;
+  ipc_event_dispatch(&e);
 }
 
 void
 ipc_client_focus_change_event(int mon_num, Client *old_client,
                               Client *new_client)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_client_focus_change_event(gen, old_client, new_client, mon_num);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_CLIENT_FOCUS_CHANGE);
+  IPCEventData e = ipc_event_data(
+      IPC_EVENT_CLIENT_FOCUS_CHANGE, mon_num, -1,
+      old_client ? old_client->win : 0, new_client ? new_client->win : 0);
+
+  ipc_event_dispatch(&e);
 }
 
 void
@@ -1046,30 +3618,36 @@ ipc_layout_change_event(const int mon_num, const char *old_symbol,
                         const Layout *old_layout, const char *new_symbol,
                         const Layout *new_layout)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_layout_change_event(gen, mon_num, old_symbol, old_layout, new_symbol,
-                           new_layout);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_LAYOUT_CHANGE);
+  IPCEventData e = ipc_event_data(IPC_EVENT_LAYOUT_CHANGE, mon_num, -1, 0, 0);
+
+  strncpy(e.u.layout.old_symbol, old_symbol,
+          sizeof(e.u.layout.old_symbol) - 1);
+  strncpy(e.u.layout.new_symbol, new_symbol,
+          sizeof(e.u.layout.new_symbol) - 1);
+  e.u.layout.old_layout = old_layout;
+  e.u.layout.new_layout = new_layout;
+  ipc_event_dispatch(&e);
 }
 
 void
 ipc_monitor_focus_change_event(const int last_mon_num, const int new_mon_num)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_monitor_focus_change_event(gen, last_mon_num, new_mon_num);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_MONITOR_FOCUS_CHANGE);
+  IPCEventData e = ipc_event_data(IPC_EVENT_MONITOR_FOCUS_CHANGE,
+                                  last_mon_num, new_mon_num, 0, 0);
+
+  ipc_event_dispatch(&e);
 }
 
 void
 ipc_focused_title_change_event(const int mon_num, const Window client_id,
                                const char *old_name, const char *new_name)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_focused_title_change_event(gen, mon_num, client_id, old_name, new_name);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_FOCUSED_TITLE_CHANGE);
+  IPCEventData e = ipc_event_data(IPC_EVENT_FOCUSED_TITLE_CHANGE, mon_num,
+                                  -1, client_id, 0);
+
+  strncpy(e.u.title.old_name, old_name, sizeof(e.u.title.old_name) - 1);
+  strncpy(e.u.title.new_name, new_name, sizeof(e.u.title.new_name) - 1);
+  ipc_event_dispatch(&e);
 }
 
 void
@@ -1077,31 +3655,43 @@ ipc_focused_state_change_event(const int mon_num, const Window client_id,
                                const ClientState *old_state,
                                const ClientState *new_state)
 {
-  yajl_gen gen;
-  ipc_event_init_message(&gen);
-  dump_focused_state_change_event(gen, mon_num, client_id, old_state,
-                                  new_state);
-  ipc_event_prepare_send_message(gen, IPC_EVENT_FOCUSED_STATE_CHANGE);
+  IPCEventData e = ipc_event_data(IPC_EVENT_FOCUSED_STATE_CHANGE, mon_num,
+                                  -1, client_id, 0);
+
+  e.u.state.old_state = *old_state;
+  e.u.state.new_state = *new_state;
+  ipc_event_dispatch(&e);
 }
 
 void
-ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon)
+ipc_client_removed(const Window win)
 {
-  for (Monitor *m = mons; m; m = m->next) {
-    unsigned int urg = 0, occ = 0, tagset = 0;
+  ipc_record_removal(0, win);
+}
 
-    for (Client *c = m->clients; c; c = c->next) {
-      occ |= c->tags;
+void
+ipc_monitor_removed(const int num)
+{
+  ipc_record_removal(1, num);
+}
 
-      if (c->isurgent) urg |= c->tags;
-    }
-    tagset = m->tagset[m->seltags];
+void
+ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon)
+{
+  const uint64_t start = ipc_stats_time();
 
-    TagState new_state = {.selected = tagset, .occupied = occ, .urgent = urg};
+  for (Monitor *m = mons; m; m = m->next) {
+    // Occupied and urgent tags are kept up to date by dwm
+    TagState new_state = {.selected = m->tagset[m->seltags],
+                          .occupied = m->occ,
+                          .urgent = m->urg};
 
+    // The tag state and last layout symbol are part of the monitor's
+    // generation, and may have been reported already in this iteration
     if (memcmp(&m->tagstate, &new_state, sizeof(TagState)) != 0) {
       ipc_tag_change_event(m->num, m->tagstate, new_state);
       m->tagstate = new_state;
+      ipc_generations_stale = 1;
     }
 
     if (m->lastsel != m->sel) {
@@ -1115,6 +3705,7 @@ ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon)
                               m->lt[m->sellt]);
       strcpy(m->lastltsymbol, m->ltsymbol);
       m->lastlt = m->lt[m->sellt];
+      ipc_generations_stale = 1;
     }
 
     if (*lastselmon != selmon) {
@@ -1137,53 +3728,138 @@ ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon)
       *o = n;
     }
   }
+
+  ipc_state_publish(mons, selmon);
+
+  // Release held events that may be sent by now and drop clients that stayed
+  // congested for too long. Wake up again once the next rate limited event
+  // may be sent or the next congested client is due to be dropped.
+  uint64_t now = 0, next = 0;
+  IPCClient *next_c;
+  for (IPCClient *c = ipc_clients; c; c = next_c) {
+    next_c = c->next;
+    if (c->held_len == 0 && !c->congested) continue;
+    if (now == 0) now = ipc_now_ms();
+
+    uint64_t wait = 0;
+    if (c->congested && ipc_evict_grace) {
+      if (now - c->congested_since >= ipc_evict_grace) {
+        fprintf(stderr,
+                "IPC client at fd %d has not read %" PRIu32 " bytes for %u "
+                "ms: dropping client\n",
+                c->fd, c->buffer_size, ipc_evict_grace);
+        ipc_drop_client(c);
+        ipc_stats.evictions++;
+        continue;
+      }
+      wait = c->congested_since + ipc_evict_grace - now;
+    }
+
+    const uint64_t held_wait = ipc_flush_held_events(c, now);
+    if (held_wait > 0 && (wait == 0 || held_wait < wait)) wait = held_wait;
+    if (wait > 0 && (next == 0 || wait < next)) next = wait;
+  }
+  if (now != 0) ipc_arm_timer(next);
+
+  ipc_histogram_add(&ipc_stats.send_events, ipc_stats_time() - start);
+}
+
+/**
+ * Process a single message received from an IPC client and prepare the
+ * corresponding reply.
+ *
+ * Returns 0 if the message was successfully handled
+ * Returns -1 on any error handling the message
+ */
+static int
+ipc_handle_message(IPCClient *c, IPCMessageType msg_type, char *msg,
+                   uint32_t msg_size, Monitor *mons, Monitor *selmon,
+                   const char *tags[], const int tags_len,
+                   const Layout *layouts, const int layouts_len)
+{
+  if (msg_type == IPC_TYPE_GET_MONITORS) {
+    if (ipc_get_monitors(c, msg, mons, selmon) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_GET_TAGS)
+    ipc_get_tags(c, tags, tags_len);
+  else if (msg_type == IPC_TYPE_GET_LAYOUTS)
+    ipc_get_layouts(c, layouts, layouts_len);
+  else if (msg_type == IPC_TYPE_RUN_COMMAND) {
+    if (ipc_run_command(c, msg, msg_size) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_RUN_BATCH) {
+    if (ipc_run_batch(c, msg, msg_size) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_GET_DWM_CLIENT) {
+    if (ipc_get_dwm_client(c, msg) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_GET_COMMANDS) {
+    ipc_get_commands(c);
+  } else if (msg_type == IPC_TYPE_GET_STATS) {
+    ipc_get_stats(c);
+  } else if (msg_type == IPC_TYPE_GET_CHANGES_SINCE) {
+    if (ipc_get_changes_since(c, msg, mons, selmon) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_SUBSCRIBE) {
+    if (ipc_subscribe(c, msg) < 0) return -1;
+  } else if (msg_type == IPC_TYPE_HANDSHAKE) {
+    if (ipc_handshake(c, msg) < 0) return -1;
+  } else {
+    fprintf(stderr, "Invalid message type received from fd %d", c->fd);
+    ipc_prepare_reply_failure(c, msg_type, "Invalid message type: %d",
+                              msg_type);
+  }
+
+  return 0;
 }
 
 int
 ipc_handle_client_epoll_event(struct epoll_event *ev, Monitor *mons,
-                              Monitor **lastselmon, Monitor *selmon,
-                              const char *tags[], const int tags_len,
-                              const Layout *layouts, const int layouts_len)
+                              Monitor *selmon, const char *tags[],
+                              const int tags_len, const Layout *layouts,
+                              const int layouts_len)
 {
-  int fd = ev->data.fd;
-  IPCClient *c = ipc_get_client(fd);
+  IPCClient *c = ev->data.ptr;
+  int fd = c->fd;
 
   if (ev->events & EPOLLHUP) {
     DEBUG("EPOLLHUP received from client at fd %d\n", fd);
     ipc_drop_client(c);
-  } else if (ev->events & EPOLLOUT) {
+    return 0;
+  } else if (!(ev->events & (EPOLLIN | EPOLLOUT))) {
+    fprintf(stderr, "Epoll event returned %d from fd %d\n", ev->events, fd);
+    return -1;
+  }
+
+  // Both are handled in the same wakeup, an edge triggered client isn't
+  // reported again for the one that was skipped
+  if (ev->events & EPOLLOUT) {
     DEBUG("Sending message to client at fd %d...\n", fd);
     if (c->buffer_size) ipc_write_client(c);
-  } else if (ev->events & EPOLLIN) {
+  }
+
+  if (ev->events & EPOLLIN) {
     IPCMessageType msg_type = 0;
     uint32_t msg_size = 0;
     char *msg = NULL;
+    int ret, res = 0;
 
     DEBUG("Received message from fd %d\n", fd);
-    if (ipc_read_client(c, &msg_type, &msg_size, &msg) < 0) return -1;
-
-    if (msg_type == IPC_TYPE_GET_MONITORS)
-      ipc_get_monitors(c, mons, selmon);
-    else if (msg_type == IPC_TYPE_GET_TAGS)
-      ipc_get_tags(c, tags, tags_len);
-    else if (msg_type == IPC_TYPE_GET_LAYOUTS)
-      ipc_get_layouts(c, layouts, layouts_len);
-    else if (msg_type == IPC_TYPE_RUN_COMMAND) {
-      if (ipc_run_command(c, msg) < 0) return -1;
-      ipc_send_events(mons, lastselmon, selmon);
-    } else if (msg_type == IPC_TYPE_GET_DWM_CLIENT) {
-      if (ipc_get_dwm_client(c, msg, mons) < 0) return -1;
-    } else if (msg_type == IPC_TYPE_SUBSCRIBE) {
-      if (ipc_subscribe(c, msg) < 0) return -1;
-    } else {
-      fprintf(stderr, "Invalid message type received from fd %d", fd);
-      ipc_prepare_reply_failure(c, msg_type, "Invalid message type: %d",
-                                msg_type);
+
+    // Handle every complete message that is already waiting on the socket
+    while ((ret = ipc_read_client(c, &msg_type, &msg_size, &msg)) == 0) {
+      const uint64_t start = ipc_stats_time();
+
+      if (ipc_handle_message(c, msg_type, msg, msg_size, mons, selmon, tags,
+                             tags_len, layouts, layouts_len) < 0)
+        res = -1;
+      if (msg_type <= IPC_TYPE_GET_STATS)
+        ipc_histogram_add(&ipc_stats.messages[msg_type],
+                          ipc_stats_time() - start);
+      // The message itself was received into the arena
+      msg = NULL;
+      ipc_arena_reset(&c->arena);
     }
-    free(msg);
-  } else {
-    fprintf(stderr, "Epoll event returned %d from fd %d\n", ev->events, fd);
-    return -1;
+
+    // -2 means the rest of the messages haven't arrived yet
+    if (ret == -1) return -1;
+
+    return res;
   }
 
   return 0;
@@ -1194,9 +3870,29 @@ ipc_handle_socket_epoll_event(struct epoll_event *ev)
 {
   if (!(ev->events & EPOLLIN)) return -1;
 
-  // EPOLLIN means incoming client connection request
+  // EPOLLIN means incoming client connection requests, accept all of them
+  // so a burst of clients doesn't take one wakeup each
   fputs("Received EPOLLIN event on socket\n", stderr);
-  int new_fd = ipc_accept_client();
+  int ret;
+  while ((ret = ipc_accept_client()) >= 0)
+    ;
+
+  // -2 means there are no more connections waiting
+  return ret == -2 ? 0 : -1;
+}
 
-  return new_fd;
+int
+ipc_handle_timer_epoll_event(struct epoll_event *ev)
+{
+  uint64_t expirations;
+
+  if (!(ev->events & EPOLLIN)) return -1;
+
+  // Held events are released by the next ipc_send_events
+  ipc_timer_due = 0;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    return -1;
+
+  return 0;
 }
@@ -12,6 +12,12 @@
 #define IPC_MAGIC_ARR { 'D', 'W', 'M', '-', 'I', 'P', 'C'}
 #define IPC_MAGIC_LEN 7 // Not including null char
 
+// Set in the type of messages sent by dwm if the payload is encoded in CBOR
+#define IPC_TYPE_FLAG_CBOR 0x80
+// Set in the type of messages whose header is followed by a header extension
+#define IPC_TYPE_FLAG_REQUEST_ID 0x40
+#define IPC_HEADER_EXT_VERSION 1
+
 #define IPCCOMMAND(FUNC, ARGC, TYPES)                                          \
   { #FUNC, {FUNC }, ARGC, (ArgType[ARGC])TYPES }
 // clang-format on
@@ -23,9 +29,27 @@ typedef enum IPCMessageType {
   IPC_TYPE_GET_LAYOUTS = 3,
   IPC_TYPE_GET_DWM_CLIENT = 4,
   IPC_TYPE_SUBSCRIBE = 5,
-  IPC_TYPE_EVENT = 6
+  IPC_TYPE_EVENT = 6,
+  IPC_TYPE_HANDSHAKE = 7,
+  IPC_TYPE_RUN_BATCH = 8,
+  IPC_TYPE_GET_CHANGES_SINCE = 9,
+  IPC_TYPE_GET_COMMANDS = 10,
+  IPC_TYPE_GET_STATS = 11
 } IPCMessageType;
 
+/**
+ * Encodings that dwm can send replies and events in. Clients start with
+ * beautified or compact JSON depending on the configuration, and can switch
+ * formats with an IPC_TYPE_HANDSHAKE message. Messages sent to dwm are always
+ * JSON.
+ */
+typedef enum IPCFormat {
+  IPC_FORMAT_JSON = 0,
+  IPC_FORMAT_JSON_COMPACT = 1,
+  IPC_FORMAT_CBOR = 2,
+  IPC_FORMAT_LAST
+} IPCFormat;
+
 typedef enum IPCEvent {
   IPC_EVENT_TAG_CHANGE = 1 << 0,
   IPC_EVENT_CLIENT_FOCUS_CHANGE = 1 << 1,
@@ -40,6 +64,68 @@ typedef enum IPCSubscriptionAction {
   IPC_ACTION_SUBSCRIBE = 1
 } IPCSubscriptionAction;
 
+// Number of buckets of an IPCHistogram
+#define IPC_HISTOGRAM_BUCKETS 24
+
+/**
+ * Distribution of a measurement, such as a duration in microseconds, reported
+ * by IPC_TYPE_GET_STATS. Bucket 0 counts values of 0 and bucket i counts
+ * values from 2^(i-1) up to 2^i. The last bucket also counts anything bigger.
+ */
+typedef struct IPCHistogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[IPC_HISTOGRAM_BUCKETS];
+} IPCHistogram;
+
+#define IPC_STATE_MAGIC "DWMSTATE"
+#define IPC_STATE_MAGIC_LEN 8 // Not including null char
+#define IPC_STATE_VERSION 1
+// Number of monitors an IPCStateSnapshot has room for
+#define IPC_STATE_MONITORS 8
+
+/**
+ * A monitor in an IPCStateSnapshot. The client fields describe the selected
+ * client of the monitor and are all 0 if the monitor has none.
+ */
+typedef struct IPCStateMonitor {
+  int32_t num;
+  uint32_t tags_selected;
+  uint32_t tags_occupied;
+  uint32_t tags_urgent;
+  char layout_symbol[16];
+  uint64_t client_window;
+  uint8_t client_isfixed;
+  uint8_t client_isfloating;
+  uint8_t client_isurgent;
+  uint8_t client_neverfocus;
+  uint8_t client_oldstate;
+  uint8_t client_isfullscreen;
+  uint8_t padding[2];
+  char client_name[256];
+} IPCStateMonitor;
+
+/**
+ * Layout of the state snapshot dwm keeps in a file mapped by read-only
+ * consumers, see ipc_state_init. Strings are always null terminated.
+ *
+ * The snapshot is protected by a sequence lock. seq is odd while dwm updates
+ * the snapshot and goes up by 2 with every update. A consumer reads seq with
+ * acquire semantics, retries while it is odd, copies what it needs, issues an
+ * acquire fence and reads seq again, retrying if it changed. Consumers can
+ * also futex-wait on seq, dwm wakes all waiters after every update.
+ */
+typedef struct IPCStateSnapshot {
+  char magic[IPC_STATE_MAGIC_LEN];
+  uint32_t version;
+  uint32_t seq;
+  uint32_t monitors_len;
+  // num of the selected monitor
+  int32_t selected_monitor;
+  IPCStateMonitor monitors[IPC_STATE_MONITORS];
+} IPCStateSnapshot;
+
 /**
  * Every IPC packet starts with this structure
  */
@@ -49,6 +135,18 @@ typedef struct dwm_ipc_header {
   uint8_t type;
 } __attribute((packed)) dwm_ipc_header_t;
 
+/**
+ * Follows the header of messages with IPC_TYPE_FLAG_REQUEST_ID set in their
+ * type. dwm sends the request ID of a message back in the header extension of
+ * its reply, so that clients can match replies to requests and tell them apart
+ * from events, which never carry an extension. The version determines the
+ * layout of the rest of the extension.
+ */
+typedef struct dwm_ipc_header_ext {
+  uint8_t version;
+  uint32_t request_id;
+} __attribute((packed)) dwm_ipc_header_ext_t;
+
 typedef enum ArgType {
   ARG_TYPE_NONE = 0,
   ARG_TYPE_UINT = 1,
@@ -74,6 +172,11 @@ typedef struct IPCCommand {
 } IPCCommand;
 
 typedef struct IPCParsedCommand {
+  // Index of the command in the IPCCommand array, -1 if there is no such
+  // command
+  int command;
+  // Name given for a command that does not exist, NULL otherwise. Like string
+  // arguments, it points into the message or the client's scratch arena.
   char *name;
   Arg *args;
   ArgType *arg_types;
@@ -87,16 +190,41 @@ typedef struct IPCParsedCommand {
  * @param epoll_fd File descriptor for epoll
  * @param commands Address of IPCCommands array defined in config.h
  * @param commands_len Length of commands[] array
+ * @param beautify Non-zero to send beautified JSON to clients by default
+ * @param high_watermark Number of bytes queued for a client above which
+ *   events for it are held back and conflated, 0 for no limit
+ * @param low_watermark Number of bytes queued below which held back events
+ *   are sent again
+ * @param evict_grace Milliseconds a client may stay above the high watermark
+ *   before it is dropped, 0 to never drop it
+ * @param backlog Number of connections waiting to be accepted before new ones
+ *   are refused
+ * @param edge_triggered Non-zero to register clients with EPOLLET. Every
+ *   wakeup reads and writes until the socket would block either way.
  *
  * @return int The file descriptor of the socket if it was successfully created,
  *   -1 otherwise
  */
 int ipc_init(const char *socket_path, const int p_epoll_fd,
-             IPCCommand commands[], const int commands_len);
+             IPCCommand commands[], const int commands_len,
+             const int beautify, const uint32_t high_watermark,
+             const uint32_t low_watermark, const unsigned int evict_grace,
+             const int backlog, const int edge_triggered);
+
+/**
+ * Create the state snapshot at the specified path. The snapshot is brought up
+ * to date with every call to ipc_send_events that finds a change.
+ *
+ * @param path Path of the file to create, any existing file is replaced. The
+ *   file is only readable by the user running dwm.
+ *
+ * @return 0 if the snapshot was created, -1 otherwise
+ */
+int ipc_state_init(const char *path);
 
 /**
  * Uninitialize the socket and module. Free allocated memory and restore static
- * variables to their state before ipc_init
+ * variables to their state before ipc_init. The state snapshot is removed too.
  */
 void ipc_cleanup();
 
@@ -112,7 +240,7 @@ int ipc_get_sock_fd();
  *
  * @param fd File descriptor of IPC Client
  *
- * @return Address to IPCClient with specified file descriptor, -1 otherwise
+ * @return Address to IPCClient with specified file descriptor, NULL otherwise
  */
 IPCClient *ipc_get_client(int fd);
 
@@ -140,7 +268,8 @@ int ipc_drop_client(IPCClient *c);
  * Accept an IPC Client requesting to connect to the socket and add it to the
  *   list of clients
  *
- * @return File descriptor of new client, -1 on error
+ * @return File descriptor of new client, -2 if no connection is waiting, -1
+ *   on error
  */
 int ipc_accept_client();
 
@@ -153,10 +282,13 @@ int ipc_accept_client();
  * @param msg_size Address to uint32_t variable which will be assigned the size
  *   of the received message
  * @param msg Address to char* variable which will be assigned the address of
- *   the received message. This must be freed using free().
+ *   the received message. The message is allocated from the client's scratch
+ *   arena and is valid until ipc_arena_reset(&c->arena), it must not be freed.
  *
- * @return 0 on success, -1 on error reading message, -2 if reading the message
- * resulted in EAGAIN, EINTR, or EWOULDBLOCK.
+ * @return 0 on success, -1 on error reading message, -2 if a complete message
+ * has not been received yet. Any partially received message is kept in the
+ * client's receive state, so reading can be resumed on the next EPOLLIN. On -1
+ * the client has been dropped and freed, so c must not be used anymore.
  */
 int ipc_read_client(IPCClient *c, IPCMessageType *msg_type, uint32_t *msg_size,
                     char **msg);
@@ -273,9 +405,58 @@ void ipc_focused_title_change_event(const int mon_num, const Window client_id,
 void ipc_focused_state_change_event(const int mon_num, const Window client_id,
                                     const ClientState *old_state,
                                     const ClientState *new_state);
+/**
+ * Record that a client was unmanaged, so that get_changes_since can report it
+ * as removed. Should be called whenever dwm stops managing a client.
+ *
+ * @param win Window XID of the client
+ */
+void ipc_client_removed(const Window win);
+
+/**
+ * Record that a monitor was removed, so that get_changes_since can report it
+ * as removed. Should be called whenever a monitor is freed.
+ *
+ * @param num Index of the monitor
+ */
+void ipc_monitor_removed(const int num);
+
+/**
+ * Get a timestamp in microseconds for measuring how long something takes with
+ * the ipc_stats_* functions
+ */
+uint64_t ipc_stats_time(void);
+
+/**
+ * Record how long drawing a bar took in the stats of IPC_TYPE_GET_STATS
+ *
+ * @param start Timestamp from ipc_stats_time taken before drawing
+ */
+void ipc_stats_drawbar(uint64_t start);
+
+/**
+ * Record the number of X events handled in one wakeup of the event loop in the
+ * stats of IPC_TYPE_GET_STATS
+ *
+ * @param count Number of X events handled
+ */
+void ipc_stats_x_events(unsigned int count);
+
+/**
+ * Report the hits and misses of an allocation pool in the stats of
+ * IPC_TYPE_GET_STATS. The pool must stay valid until ipc_cleanup.
+ *
+ * @param name Name to report the pool under
+ * @param pool Address of the Pool
+ */
+void ipc_stats_pool(const char *name, const Pool *pool);
+
 /**
  * Check to see if an event has occured and call the *_change_event functions
- * accordingly
+ * accordingly. Only the net change since the last call is reported, so this
+ * is called once after all pending X events and IPC messages were handled.
+ * Events held back for subscribers that conflate or rate limit them are sent
+ * here as well once they may be.
  *
  * @param mons Address of Monitor pointing to start of linked list
  * @param lastselmon Address of pointer to previously selected monitor
@@ -283,16 +464,32 @@ void ipc_focused_state_change_event(const int mon_num, const Window client_id,
  */
 void ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon);
 
+/**
+ * Note that dwm may have changed monitors or clients, for example while
+ * handling X events. The generations reported by get_monitors and
+ * get_changes_since are only brought up to date after this was called, so
+ * cached replies are reused without looking at every client in between.
+ */
+void ipc_mark_changed();
+
+/**
+ * Write the frames queued for clients during this event loop iteration. Each
+ * client is written to once with everything queued for it, and only clients
+ * that can't take all of it are woken up later by EPOLLOUT. Events held back
+ * until a client's queue drained are released once it did, and written too.
+ * Call this at the end of every event loop iteration, after ipc_send_events.
+ */
+void ipc_flush_clients();
+
 /**
  * Handle an epoll event caused by a registered IPC client. Read, process, and
- * handle any received messages from clients. Write pending buffer to client if
- * the client is ready to receive messages. Drop clients that have sent an
- * EPOLLHUP.
+ * handle all complete messages waiting on the client's socket. Write pending
+ * buffer to client if the client is ready to receive messages. Drop clients
+ * that have sent an EPOLLHUP.
  *
  * @param ev Associated epoll event returned by epoll_wait
  * @param mons Address of Monitor pointing to start of linked list
  * @param selmon Address of selected Monitor
- * @param lastselmon Address of pointer to previously selected monitor
  * @param tags Array of tag names
  * @param tags_len Length of tags array
  * @param layouts Array of available layouts
@@ -302,13 +499,14 @@ void ipc_send_events(Monitor *mons, Monitor **lastselmon, Monitor *selmon);
  * or handling incoming messages or unhandled epoll event.
  */
 int ipc_handle_client_epoll_event(struct epoll_event *ev, Monitor *mons,
-                                  Monitor **lastselmon, Monitor *selmon,
-                                  const char *tags[], const int tags_len,
-                                  const Layout *layouts, const int layouts_len);
+                                  Monitor *selmon, const char *tags[],
+                                  const int tags_len, const Layout *layouts,
+                                  const int layouts_len);
 
 /**
  * Handle an epoll event caused by the IPC socket. This function only handles an
- * EPOLLIN event indicating a new client requesting to connect to the socket.
+ * EPOLLIN event indicating new clients requesting to connect to the socket.
+ * Every connection waiting to be accepted is accepted.
  *
  * @param ev Associated epoll event returned by epoll_wait
  *
@@ -317,4 +515,16 @@ int ipc_handle_client_epoll_event(struct epoll_event *ev, Monitor *mons,
  */
 int ipc_handle_socket_epoll_event(struct epoll_event *ev);
 
+/**
+ * Handle an epoll event caused by the IPC timer. The timer wakes dwm up once
+ * an event held back by a subscriber's rate limit may be sent, which happens
+ * in the following call to ipc_send_events.
+ *
+ * @param ev Associated epoll event returned by epoll_wait
+ *
+ * @return 0 if the event was successfully handled, -1 if not an EPOLLIN event
+ * or if the timer could not be read
+ */
+int ipc_handle_timer_epoll_event(struct epoll_event *ev);
+
 #endif /* IPC_H_ */
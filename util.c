@@ -36,6 +36,57 @@ die(const char *fmt, ...) {
 	exit(1);
 }
 
+/* objects are carved from slabs of p->perslab objects at once and put on the
+ * free list when freed, slabs are only released by pooldestroy */
+void *
+poolalloc(Pool *p)
+{
+	char *slab, *o;
+	size_t size = (MAX(p->size, sizeof(void *)) + POOLALIGN - 1) & ~(POOLALIGN - 1);
+	unsigned int i;
+
+	if (p->free) {
+		p->hits++;
+	} else {
+		if (!(slab = malloc(POOLALIGN + p->perslab * size)))
+			return NULL;
+		*(void **)slab = p->slabs;
+		p->slabs = slab;
+		for (i = p->perslab; i > 0; i--) {
+			o = slab + POOLALIGN + (i - 1) * size;
+			*(void **)o = p->free;
+			p->free = o;
+		}
+		p->misses++;
+	}
+	o = p->free;
+	p->free = *(void **)o;
+	p->inuse++;
+	memset(o, 0, p->size);
+	return o;
+}
+
+void
+poolfree(Pool *p, void *o)
+{
+	*(void **)o = p->free;
+	p->free = o;
+	p->inuse--;
+}
+
+void
+pooldestroy(Pool *p)
+{
+	void *slab;
+
+	while ((slab = p->slabs)) {
+		p->slabs = *(void **)slab;
+		free(slab);
+	}
+	p->free = NULL;
+	p->inuse = 0;
+}
+
 int
 normalizepath(const char *path, char **normal)
 {
@@ -155,16 +206,3 @@ mkdirp(const char *path)
 
   return 0;
 }
-
-int
-nullterminate(char **str, size_t *len)
-{
-  if ((*str)[*len - 1] == '\0')
-    return 0;
-
-  (*len)++;
-  *str = (char*)realloc(*str, *len * sizeof(char));
-  (*str)[*len - 1] = '\0';
-
-  return 0;
-}
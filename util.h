@@ -1,5 +1,8 @@
 /* See LICENSE file for copyright and license details. */
 
+#ifndef UTIL_H_
+#define UTIL_H_
+
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define BETWEEN(X, A, B)        ((A) <= (X) && (X) <= (B))
@@ -10,9 +13,23 @@
 #define DEBUG(...)
 #endif
 
+#define POOLALIGN               16 /* alignment of pool objects */
+
+typedef struct Pool Pool;
+struct Pool {
+	size_t size; /* object size */
+	unsigned int perslab; /* objects allocated at once */
+	void *free, *slabs; /* linked through their first word */
+	unsigned long inuse, hits, misses; /* misses needed a new slab */
+};
+
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+void *poolalloc(Pool *p);
+void poolfree(Pool *p, void *o);
+void pooldestroy(Pool *p);
 int normalizepath(const char *path, char **normal);
 int mkdirp(const char *path);
 int parentdir(const char *path, char **parent);
-int nullterminate(char **str, size_t *len);
+
+#endif /* UTIL_H_ */
@@ -3,7 +3,121 @@
 #include <stdint.h>
 
 int
-dump_tag(yajl_gen gen, const char *name, const int tag_mask)
+ipc_gen_init(IPCGen *gen, IPCFormat format)
+{
+  gen->format = format;
+  gen->yajl = NULL;
+  gen->cbor = NULL;
+  gen->fields = 0;
+
+  if (format == IPC_FORMAT_CBOR) {
+    gen->cbor = cbor_gen_alloc();
+    if (gen->cbor == NULL) return -1;
+  } else {
+    gen->yajl = yajl_gen_alloc(NULL);
+    if (gen->yajl == NULL) return -1;
+    yajl_gen_config(gen->yajl, yajl_gen_beautify, format == IPC_FORMAT_JSON);
+  }
+
+  return 0;
+}
+
+void
+ipc_gen_clear(IPCGen *gen)
+{
+  gen->fields = 0;
+  if (gen->cbor) cbor_gen_clear(gen->cbor);
+  if (gen->yajl) {
+    yajl_gen_clear(gen->yajl);
+    yajl_gen_reset(gen->yajl, NULL);
+  }
+}
+
+void
+ipc_gen_get_buf(IPCGen *gen, const unsigned char **buf, size_t *len)
+{
+  if (gen->format == IPC_FORMAT_CBOR)
+    cbor_gen_get_buf(gen->cbor, buf, len);
+  else
+    yajl_gen_get_buf(gen->yajl, buf, len);
+}
+
+void
+ipc_gen_free(IPCGen *gen)
+{
+  if (gen->cbor) cbor_gen_free(gen->cbor);
+  // Not documented, but this frees temp_buffer
+  if (gen->yajl) yajl_gen_free(gen->yajl);
+  gen->cbor = NULL;
+  gen->yajl = NULL;
+}
+
+int
+ipc_gen_integer(IPCGen *gen, long long num)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_integer(gen->cbor, num);
+  return yajl_gen_integer(gen->yajl, num) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_double(IPCGen *gen, double num)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_double(gen->cbor, num);
+  return yajl_gen_double(gen->yajl, num) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_bool(IPCGen *gen, int boolean)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_bool(gen->cbor, boolean);
+  return yajl_gen_bool(gen->yajl, boolean) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_null(IPCGen *gen)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_null(gen->cbor);
+  return yajl_gen_null(gen->yajl) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_string(IPCGen *gen, const unsigned char *str, size_t len)
+{
+  if (gen->format == IPC_FORMAT_CBOR)
+    return cbor_gen_string(gen->cbor, str, len);
+  return yajl_gen_string(gen->yajl, str, len) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_map_open(IPCGen *gen)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_map_open(gen->cbor);
+  return yajl_gen_map_open(gen->yajl) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_map_close(IPCGen *gen)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_map_close(gen->cbor);
+  return yajl_gen_map_close(gen->yajl) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_array_open(IPCGen *gen)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_array_open(gen->cbor);
+  return yajl_gen_array_open(gen->yajl) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+ipc_gen_array_close(IPCGen *gen)
+{
+  if (gen->format == IPC_FORMAT_CBOR) return cbor_gen_array_close(gen->cbor);
+  return yajl_gen_array_close(gen->yajl) == yajl_gen_status_ok ? 0 : -1;
+}
+
+int
+dump_tag(IPCGen *gen, const char *name, const int tag_mask)
 {
   // clang-format off
   YMAP(
@@ -16,7 +130,7 @@ dump_tag(yajl_gen gen, const char *name, const int tag_mask)
 }
 
 int
-dump_tags(yajl_gen gen, const char *tags[], int tags_len)
+dump_tags(IPCGen *gen, const char *tags[], int tags_len)
 {
   // clang-format off
   YARR(
@@ -29,16 +143,17 @@ dump_tags(yajl_gen gen, const char *tags[], int tags_len)
 }
 
 int
-dump_client(yajl_gen gen, Client *c)
+dump_client(IPCGen *gen, Client *c)
 {
   // clang-format off
   YMAP(
-    YSTR("name"); YSTR(c->name);
-    YSTR("tags"); YINT(c->tags);
-    YSTR("window_id"); YINT(c->win);
-    YSTR("monitor_number"); YINT(c->mon->num);
+    YFIELD(IPC_QUERY_GENERATION, "generation", YINT(c->gen));
+    YFIELD(IPC_QUERY_NAME, "name", YSTR(c->name));
+    YFIELD(IPC_QUERY_TAGS, "tags", YINT(c->tags));
+    YFIELD(IPC_QUERY_WINDOW_ID, "window_id", YINT(c->win));
+    YFIELD(IPC_QUERY_MONITOR_NUMBER, "monitor_number", YINT(c->mon->num));
 
-    YSTR("geometry"); YMAP(
+    YFIELD(IPC_QUERY_GEOMETRY, "geometry", YMAP(
       YSTR("current"); YMAP (
         YSTR("x"); YINT(c->x);
         YSTR("y"); YINT(c->y);
@@ -51,9 +166,9 @@ dump_client(yajl_gen gen, Client *c)
         YSTR("width"); YINT(c->oldw);
         YSTR("height"); YINT(c->oldh);
       )
-    )
+    ));
 
-    YSTR("size_hints"); YMAP(
+    YFIELD(IPC_QUERY_SIZE_HINTS, "size_hints", YMAP(
       YSTR("base"); YMAP(
         YSTR("width"); YINT(c->basew);
         YSTR("height"); YINT(c->baseh);
@@ -74,21 +189,21 @@ dump_client(yajl_gen gen, Client *c)
         YSTR("min"); YDOUBLE(c->mina);
         YSTR("max"); YDOUBLE(c->maxa);
       )
-    )
+    ));
 
-    YSTR("border_width"); YMAP(
+    YFIELD(IPC_QUERY_BORDER_WIDTH, "border_width", YMAP(
       YSTR("current"); YINT(c->bw);
       YSTR("old"); YINT(c->oldbw);
-    )
+    ));
 
-    YSTR("states"); YMAP(
+    YFIELD(IPC_QUERY_STATES, "states", YMAP(
       YSTR("is_fixed"); YBOOL(c->isfixed);
       YSTR("is_floating"); YBOOL(c->isfloating);
       YSTR("is_urgent"); YBOOL(c->isurgent);
       YSTR("never_focus"); YBOOL(c->neverfocus);
       YSTR("old_state"); YBOOL(c->oldstate);
       YSTR("is_fullscreen"); YBOOL(c->isfullscreen);
-    )
+    ));
   )
   // clang-format on
 
@@ -96,37 +211,39 @@ dump_client(yajl_gen gen, Client *c)
 }
 
 int
-dump_monitor(yajl_gen gen, Monitor *mon, int is_selected)
+dump_monitor(IPCGen *gen, Monitor *mon, int is_selected)
 {
   // clang-format off
   YMAP(
-    YSTR("master_factor"); YDOUBLE(mon->mfact);
-    YSTR("num_master"); YINT(mon->nmaster);
-    YSTR("num"); YINT(mon->num);
-    YSTR("is_selected"); YBOOL(is_selected);
+    YFIELD(IPC_QUERY_GENERATION, "generation", YINT(mon->gen));
+    YFIELD(IPC_QUERY_MASTER_FACTOR, "master_factor", YDOUBLE(mon->mfact));
+    YFIELD(IPC_QUERY_NUM_MASTER, "num_master", YINT(mon->nmaster));
+    YFIELD(IPC_QUERY_NUM, "num", YINT(mon->num));
+    YFIELD(IPC_QUERY_IS_SELECTED, "is_selected", YBOOL(is_selected));
 
-    YSTR("monitor_geometry"); YMAP(
+    YFIELD(IPC_QUERY_MONITOR_GEOMETRY, "monitor_geometry", YMAP(
       YSTR("x"); YINT(mon->mx);
       YSTR("y"); YINT(mon->my);
       YSTR("width"); YINT(mon->mw);
       YSTR("height"); YINT(mon->mh);
-    )
+    ));
 
-    YSTR("window_geometry"); YMAP(
+    YFIELD(IPC_QUERY_WINDOW_GEOMETRY, "window_geometry", YMAP(
       YSTR("x"); YINT(mon->wx);
       YSTR("y"); YINT(mon->wy);
       YSTR("width"); YINT(mon->ww);
       YSTR("height"); YINT(mon->wh);
-    )
+    ));
 
-    YSTR("tagset"); YMAP(
+    YFIELD(IPC_QUERY_TAGSET, "tagset", YMAP(
       YSTR("current");  YINT(mon->tagset[mon->seltags]);
       YSTR("old"); YINT(mon->tagset[mon->seltags ^ 1]);
-    )
+    ));
 
-    YSTR("tag_state"); dump_tag_state(gen, mon->tagstate);
+    YFIELD(IPC_QUERY_TAG_STATE, "tag_state",
+      dump_tag_state(gen, mon->tagstate));
 
-    YSTR("clients"); YMAP(
+    YFIELD(IPC_QUERY_CLIENTS, "clients", YMAP(
       YSTR("selected"); YINT(mon->sel ? mon->sel->win : 0);
       YSTR("stack"); YARR(
         for (Client* c = mon->stack; c; c = c->snext)
@@ -136,9 +253,9 @@ dump_monitor(yajl_gen gen, Monitor *mon, int is_selected)
         for (Client* c = mon->clients; c; c = c->next)
           YINT(c->win);
       )
-    )
+    ));
 
-    YSTR("layout"); YMAP(
+    YFIELD(IPC_QUERY_LAYOUT, "layout", YMAP(
       YSTR("symbol"); YMAP(
         YSTR("current"); YSTR(mon->ltsymbol);
         YSTR("old"); YSTR(mon->lastltsymbol);
@@ -147,14 +264,14 @@ dump_monitor(yajl_gen gen, Monitor *mon, int is_selected)
         YSTR("current"); YINT((uintptr_t)mon->lt[mon->sellt]);
         YSTR("old"); YINT((uintptr_t)mon->lt[mon->sellt ^ 1]);
       )
-    )
+    ));
 
-    YSTR("bar"); YMAP(
+    YFIELD(IPC_QUERY_BAR, "bar", YMAP(
       YSTR("y"); YINT(mon->by);
       YSTR("is_shown"); YBOOL(mon->showbar);
       YSTR("is_top"); YBOOL(mon->topbar);
       YSTR("window_id"); YINT(mon->barwin);
-    )
+    ));
   )
   // clang-format on
 
@@ -162,7 +279,7 @@ dump_monitor(yajl_gen gen, Monitor *mon, int is_selected)
 }
 
 int
-dump_monitors(yajl_gen gen, Monitor *mons, Monitor *selmon)
+dump_monitors(IPCGen *gen, Monitor *mons, Monitor *selmon)
 {
   // clang-format off
   YARR(
@@ -179,7 +296,7 @@ dump_monitors(yajl_gen gen, Monitor *mons, Monitor *selmon)
 }
 
 int
-dump_layouts(yajl_gen gen, const Layout layouts[], const int layouts_len)
+dump_layouts(IPCGen *gen, const Layout layouts[], const int layouts_len)
 {
   // clang-format off
   YARR(
@@ -198,7 +315,66 @@ dump_layouts(yajl_gen gen, const Layout layouts[], const int layouts_len)
 }
 
 int
-dump_tag_state(yajl_gen gen, TagState state)
+dump_commands(IPCGen *gen, const IPCCommand commands[],
+              const int commands_len, const char *events[],
+              const int events_len)
+{
+  // Indexed by ArgType
+  const char *arg_type_names[] = {"none", "uint", "sint",
+                                  "float", "ptr", "str"};
+
+  // clang-format off
+  YMAP(
+    YSTR("commands"); YARR(
+      for (int i = 0; i < commands_len; i++) {
+        YMAP(
+          YSTR("id"); YINT(i);
+          YSTR("name"); YSTR(commands[i].name);
+          YSTR("args"); YARR(
+            for (int j = 0; j < commands[i].argc; j++)
+              YSTR(arg_type_names[commands[i].arg_types[j]]);
+          )
+        )
+      }
+    )
+    YSTR("events"); YARR(
+      for (int i = 0; i < events_len; i++) {
+        YMAP(
+          YSTR("id"); YINT(i);
+          YSTR("name"); YSTR(events[i]);
+        )
+      }
+    )
+  )
+  // clang-format on
+
+  return 0;
+}
+
+int
+dump_histogram(IPCGen *gen, const IPCHistogram *h)
+{
+  // Trailing empty buckets are left out
+  int len = IPC_HISTOGRAM_BUCKETS;
+  while (len > 0 && h->buckets[len - 1] == 0) len--;
+
+  // clang-format off
+  YMAP(
+    YSTR("count"); YINT(h->count);
+    YSTR("sum"); YINT(h->sum);
+    YSTR("max"); YINT(h->max);
+    YSTR("buckets"); YARR(
+      for (int i = 0; i < len; i++)
+        YINT(h->buckets[i]);
+    )
+  )
+  // clang-format on
+
+  return 0;
+}
+
+int
+dump_tag_state(IPCGen *gen, TagState state)
 {
   // clang-format off
   YMAP(
@@ -212,15 +388,16 @@ dump_tag_state(yajl_gen gen, TagState state)
 }
 
 int
-dump_tag_event(yajl_gen gen, int mon_num, TagState old_state,
+dump_tag_event(IPCGen *gen, unsigned long seq, int mon_num, TagState old_state,
                TagState new_state)
 {
   // clang-format off
   YMAP(
     YSTR("tag_change_event"); YMAP(
-      YSTR("monitor_number"); YINT(mon_num);
-      YSTR("old_state"); dump_tag_state(gen, old_state);
-      YSTR("new_state"); dump_tag_state(gen, new_state);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_MONITOR_NUMBER, "monitor_number", YINT(mon_num));
+      YFIELD(IPC_FIELD_OLD_STATE, "old_state", dump_tag_state(gen, old_state));
+      YFIELD(IPC_FIELD_NEW_STATE, "new_state", dump_tag_state(gen, new_state));
     )
   )
   // clang-format on
@@ -229,15 +406,18 @@ dump_tag_event(yajl_gen gen, int mon_num, TagState old_state,
 }
 
 int
-dump_client_focus_change_event(yajl_gen gen, Client *old_client,
-                               Client *new_client, int mon_num)
+dump_client_focus_change_event(IPCGen *gen, unsigned long seq, Window old_win,
+                               Window new_win, int mon_num)
 {
   // clang-format off
   YMAP(
     YSTR("client_focus_change_event"); YMAP(
-      YSTR("monitor_number"); YINT(mon_num);
-      YSTR("old_win_id"); old_client == NULL ? YNULL() : YINT(old_client->win);
-      YSTR("new_win_id"); new_client == NULL ? YNULL() : YINT(new_client->win);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_MONITOR_NUMBER, "monitor_number", YINT(mon_num));
+      YFIELD(IPC_FIELD_OLD_WIN_ID, "old_win_id",
+        old_win == 0 ? YNULL() : YINT(old_win));
+      YFIELD(IPC_FIELD_NEW_WIN_ID, "new_win_id",
+        new_win == 0 ? YNULL() : YINT(new_win));
     )
   )
   // clang-format on
@@ -246,18 +426,19 @@ dump_client_focus_change_event(yajl_gen gen, Client *old_client,
 }
 
 int
-dump_layout_change_event(yajl_gen gen, const int mon_num,
+dump_layout_change_event(IPCGen *gen, unsigned long seq, const int mon_num,
                          const char *old_symbol, const Layout *old_layout,
                          const char *new_symbol, const Layout *new_layout)
 {
   // clang-format off
   YMAP(
     YSTR("layout_change_event"); YMAP(
-      YSTR("monitor_number"); YINT(mon_num);
-      YSTR("old_symbol"); YSTR(old_symbol);
-      YSTR("old_address"); YINT((uintptr_t)old_layout);
-      YSTR("new_symbol"); YSTR(new_symbol);
-      YSTR("new_address"); YINT((uintptr_t)new_layout);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_MONITOR_NUMBER, "monitor_number", YINT(mon_num));
+      YFIELD(IPC_FIELD_OLD_SYMBOL, "old_symbol", YSTR(old_symbol));
+      YFIELD(IPC_FIELD_OLD_ADDRESS, "old_address", YINT((uintptr_t)old_layout));
+      YFIELD(IPC_FIELD_NEW_SYMBOL, "new_symbol", YSTR(new_symbol));
+      YFIELD(IPC_FIELD_NEW_ADDRESS, "new_address", YINT((uintptr_t)new_layout));
     )
   )
   // clang-format on
@@ -266,14 +447,17 @@ dump_layout_change_event(yajl_gen gen, const int mon_num,
 }
 
 int
-dump_monitor_focus_change_event(yajl_gen gen, const int last_mon_num,
-                                const int new_mon_num)
+dump_monitor_focus_change_event(IPCGen *gen, unsigned long seq,
+                                const int last_mon_num, const int new_mon_num)
 {
   // clang-format off
   YMAP(
     YSTR("monitor_focus_change_event"); YMAP(
-      YSTR("old_monitor_number"); YINT(last_mon_num);
-      YSTR("new_monitor_number"); YINT(new_mon_num);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_OLD_MONITOR_NUMBER, "old_monitor_number",
+        YINT(last_mon_num));
+      YFIELD(IPC_FIELD_NEW_MONITOR_NUMBER, "new_monitor_number",
+        YINT(new_mon_num));
     )
   )
   // clang-format on
@@ -282,17 +466,18 @@ dump_monitor_focus_change_event(yajl_gen gen, const int last_mon_num,
 }
 
 int
-dump_focused_title_change_event(yajl_gen gen, const int mon_num,
-                                const Window client_id, const char *old_name,
-                                const char *new_name)
+dump_focused_title_change_event(IPCGen *gen, unsigned long seq,
+                                const int mon_num, const Window client_id,
+                                const char *old_name, const char *new_name)
 {
   // clang-format off
   YMAP(
     YSTR("focused_title_change_event"); YMAP(
-      YSTR("monitor_number"); YINT(mon_num);
-      YSTR("client_window_id"); YINT(client_id);
-      YSTR("old_name"); YSTR(old_name);
-      YSTR("new_name"); YSTR(new_name);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_MONITOR_NUMBER, "monitor_number", YINT(mon_num));
+      YFIELD(IPC_FIELD_CLIENT_WINDOW_ID, "client_window_id", YINT(client_id));
+      YFIELD(IPC_FIELD_OLD_NAME, "old_name", YSTR(old_name));
+      YFIELD(IPC_FIELD_NEW_NAME, "new_name", YSTR(new_name));
     )
   )
   // clang-format on
@@ -301,7 +486,7 @@ dump_focused_title_change_event(yajl_gen gen, const int mon_num,
 }
 
 int
-dump_client_state(yajl_gen gen, const ClientState *state)
+dump_client_state(IPCGen *gen, const ClientState *state)
 {
   // clang-format off
   YMAP(
@@ -318,18 +503,21 @@ dump_client_state(yajl_gen gen, const ClientState *state)
 }
 
 int
-dump_focused_state_change_event(yajl_gen gen, const int mon_num,
-                                const Window client_id,
+dump_focused_state_change_event(IPCGen *gen, unsigned long seq,
+                                const int mon_num, const Window client_id,
                                 const ClientState *old_state,
                                 const ClientState *new_state)
 {
   // clang-format off
   YMAP(
     YSTR("focused_state_change_event"); YMAP(
-      YSTR("monitor_number"); YINT(mon_num);
-      YSTR("client_window_id"); YINT(client_id);
-      YSTR("old_state"); dump_client_state(gen, old_state);
-      YSTR("new_state"); dump_client_state(gen, new_state);
+      YSTR("seq"); YINT(seq);
+      YFIELD(IPC_FIELD_MONITOR_NUMBER, "monitor_number", YINT(mon_num));
+      YFIELD(IPC_FIELD_CLIENT_WINDOW_ID, "client_window_id", YINT(client_id));
+      YFIELD(IPC_FIELD_OLD_STATE, "old_state",
+        dump_client_state(gen, old_state));
+      YFIELD(IPC_FIELD_NEW_STATE, "new_state",
+        dump_client_state(gen, new_state));
     )
   )
   // clang-format on
@@ -338,7 +526,7 @@ dump_focused_state_change_event(yajl_gen gen, const int mon_num,
 }
 
 int
-dump_error_message(yajl_gen gen, const char *reason)
+dump_error_message(IPCGen *gen, const char *reason)
 {
   // clang-format off
   YMAP(
@@ -349,3 +537,29 @@ dump_error_message(yajl_gen gen, const char *reason)
 
   return 0;
 }
+
+int
+dump_success_message(IPCGen *gen)
+{
+  // clang-format off
+  YMAP(
+    YSTR("result"); YSTR("success");
+  )
+  // clang-format on
+
+  return 0;
+}
+
+int
+dump_handshake(IPCGen *gen, const char *format, int header_version)
+{
+  // clang-format off
+  YMAP(
+    YSTR("result"); YSTR("success");
+    YSTR("format"); YSTR(format);
+    YSTR("header_extension"); YINT(header_version);
+  )
+  // clang-format on
+
+  return 0;
+}
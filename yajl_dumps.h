@@ -4,62 +4,179 @@
 #include <string.h>
 #include <yajl/yajl_gen.h>
 
-#define YSTR(str) yajl_gen_string(gen, (unsigned char *)str, strlen(str))
-#define YINT(num) yajl_gen_integer(gen, num)
-#define YDOUBLE(num) yajl_gen_double(gen, num)
-#define YBOOL(v) yajl_gen_bool(gen, v)
-#define YNULL() yajl_gen_null(gen)
+#include "cbor_gen.h"
+
+#define YSTR(str) ipc_gen_string(gen, (unsigned char *)str, strlen(str))
+#define YINT(num) ipc_gen_integer(gen, num)
+#define YDOUBLE(num) ipc_gen_double(gen, num)
+#define YBOOL(v) ipc_gen_bool(gen, v)
+#define YNULL() ipc_gen_null(gen)
 #define YARR(body)                                                             \
   {                                                                            \
-    yajl_gen_array_open(gen);                                                  \
+    ipc_gen_array_open(gen);                                                   \
     body;                                                                      \
-    yajl_gen_array_close(gen);                                                 \
+    ipc_gen_array_close(gen);                                                  \
   }
 #define YMAP(body)                                                             \
   {                                                                            \
-    yajl_gen_map_open(gen);                                                    \
+    ipc_gen_map_open(gen);                                                     \
     body;                                                                      \
-    yajl_gen_map_close(gen);                                                   \
+    ipc_gen_map_close(gen);                                                    \
   }
-
-int dump_tag(yajl_gen gen, const char *name, const int tag_mask);
-
-int dump_tags(yajl_gen gen, const char *tags[], int tags_len);
-
-int dump_client(yajl_gen gen, Client *c);
-
-int dump_monitor(yajl_gen gen, Monitor *mon, int is_selected);
-
-int dump_monitors(yajl_gen gen, Monitor *mons, Monitor *selmon);
-
-int dump_layouts(yajl_gen gen, const Layout layouts[], const int layouts_len);
-
-int dump_tag_state(yajl_gen gen, TagState state);
-
-int dump_tag_event(yajl_gen gen, int mon_num, TagState old_state,
-                   TagState new_state);
-
-int dump_client_focus_change_event(yajl_gen gen, Client *old_client,
-                                   Client *new_client, int mon_num);
-
-int dump_layout_change_event(yajl_gen gen, const int mon_num,
+// Write a key and its value unless the generator's fields exclude the key
+#define YFIELD(field, key, body)                                               \
+  do {                                                                         \
+    if (gen->fields == 0 || (gen->fields & (field))) {                         \
+      YSTR(key);                                                               \
+      body;                                                                    \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Fields of event messages that subscribers can select with a filter
+ */
+typedef enum IPCEventField {
+  IPC_FIELD_MONITOR_NUMBER = 1 << 0,
+  IPC_FIELD_OLD_STATE = 1 << 1,
+  IPC_FIELD_NEW_STATE = 1 << 2,
+  IPC_FIELD_OLD_WIN_ID = 1 << 3,
+  IPC_FIELD_NEW_WIN_ID = 1 << 4,
+  IPC_FIELD_OLD_SYMBOL = 1 << 5,
+  IPC_FIELD_OLD_ADDRESS = 1 << 6,
+  IPC_FIELD_NEW_SYMBOL = 1 << 7,
+  IPC_FIELD_NEW_ADDRESS = 1 << 8,
+  IPC_FIELD_OLD_MONITOR_NUMBER = 1 << 9,
+  IPC_FIELD_NEW_MONITOR_NUMBER = 1 << 10,
+  IPC_FIELD_CLIENT_WINDOW_ID = 1 << 11,
+  IPC_FIELD_OLD_NAME = 1 << 12,
+  IPC_FIELD_NEW_NAME = 1 << 13
+} IPCEventField;
+
+/**
+ * Fields of clients and monitors that get_dwm_client and get_monitors queries
+ * can select. The generation field is shared by both.
+ */
+typedef enum IPCQueryField {
+  IPC_QUERY_GENERATION = 1 << 0,
+  IPC_QUERY_NAME = 1 << 1,
+  IPC_QUERY_TAGS = 1 << 2,
+  IPC_QUERY_WINDOW_ID = 1 << 3,
+  IPC_QUERY_MONITOR_NUMBER = 1 << 4,
+  IPC_QUERY_GEOMETRY = 1 << 5,
+  IPC_QUERY_SIZE_HINTS = 1 << 6,
+  IPC_QUERY_BORDER_WIDTH = 1 << 7,
+  IPC_QUERY_STATES = 1 << 8,
+  IPC_QUERY_MASTER_FACTOR = 1 << 9,
+  IPC_QUERY_NUM_MASTER = 1 << 10,
+  IPC_QUERY_NUM = 1 << 11,
+  IPC_QUERY_IS_SELECTED = 1 << 12,
+  IPC_QUERY_MONITOR_GEOMETRY = 1 << 13,
+  IPC_QUERY_WINDOW_GEOMETRY = 1 << 14,
+  IPC_QUERY_TAGSET = 1 << 15,
+  IPC_QUERY_TAG_STATE = 1 << 16,
+  IPC_QUERY_CLIENTS = 1 << 17,
+  IPC_QUERY_LAYOUT = 1 << 18,
+  IPC_QUERY_BAR = 1 << 19
+} IPCQueryField;
+
+/**
+ * Generator for a message in one of the supported IPC formats. The dump
+ * functions write through the macros above, so the same dump function can
+ * produce both JSON and CBOR. Only the handle of the selected format is used.
+ */
+typedef struct IPCGen {
+  IPCFormat format;
+  yajl_gen yajl;
+  cbor_gen cbor;
+  // IPCEventField bits of the fields that event dumps write, or IPCQueryField
+  // bits of the fields that client and monitor dumps write, 0 for all
+  unsigned int fields;
+} IPCGen;
+
+/**
+ * Allocate the handle for the specified format
+ *
+ * @return 0 on success, -1 if the handle could not be allocated
+ */
+int ipc_gen_init(IPCGen *gen, IPCFormat format);
+
+/**
+ * Empty the buffer of the generator and reset its state, including the
+ * selected fields, so it can be reused for a new message. The memory allocated
+ * for the buffer is kept.
+ */
+void ipc_gen_clear(IPCGen *gen);
+
+/**
+ * Get the encoded message. The buffer is owned by the generator and is valid
+ * until ipc_gen_clear or ipc_gen_free is called.
+ */
+void ipc_gen_get_buf(IPCGen *gen, const unsigned char **buf, size_t *len);
+
+/**
+ * Free the handle of the generator and its buffer
+ */
+void ipc_gen_free(IPCGen *gen);
+
+int ipc_gen_integer(IPCGen *gen, long long num);
+int ipc_gen_double(IPCGen *gen, double num);
+int ipc_gen_bool(IPCGen *gen, int boolean);
+int ipc_gen_null(IPCGen *gen);
+int ipc_gen_string(IPCGen *gen, const unsigned char *str, size_t len);
+int ipc_gen_map_open(IPCGen *gen);
+int ipc_gen_map_close(IPCGen *gen);
+int ipc_gen_array_open(IPCGen *gen);
+int ipc_gen_array_close(IPCGen *gen);
+
+int dump_tag(IPCGen *gen, const char *name, const int tag_mask);
+
+int dump_tags(IPCGen *gen, const char *tags[], int tags_len);
+
+int dump_client(IPCGen *gen, Client *c);
+
+int dump_monitor(IPCGen *gen, Monitor *mon, int is_selected);
+
+int dump_monitors(IPCGen *gen, Monitor *mons, Monitor *selmon);
+
+int dump_layouts(IPCGen *gen, const Layout layouts[], const int layouts_len);
+
+int dump_commands(IPCGen *gen, const IPCCommand commands[],
+                  const int commands_len, const char *events[],
+                  const int events_len);
+
+int dump_histogram(IPCGen *gen, const IPCHistogram *h);
+
+int dump_tag_state(IPCGen *gen, TagState state);
+
+int dump_tag_event(IPCGen *gen, unsigned long seq, int mon_num,
+                   TagState old_state, TagState new_state);
+
+int dump_client_focus_change_event(IPCGen *gen, unsigned long seq,
+                                   Window old_win, Window new_win, int mon_num);
+
+int dump_layout_change_event(IPCGen *gen, unsigned long seq, const int mon_num,
                              const char *old_symbol, const Layout *old_layout,
                              const char *new_symbol, const Layout *new_layout);
 
-int dump_monitor_focus_change_event(yajl_gen gen, const int last_mon_num,
+int dump_monitor_focus_change_event(IPCGen *gen, unsigned long seq,
+                                    const int last_mon_num,
                                     const int new_mon_num);
 
-int dump_focused_title_change_event(yajl_gen gen, const int mon_num,
-                                    const Window client_id,
+int dump_focused_title_change_event(IPCGen *gen, unsigned long seq,
+                                    const int mon_num, const Window client_id,
                                     const char *old_name, const char *new_name);
 
-int dump_client_state(yajl_gen gen, const ClientState *state);
+int dump_client_state(IPCGen *gen, const ClientState *state);
 
-int dump_focused_state_change_event(yajl_gen gen, const int mon_num,
-                                    const Window client_id,
+int dump_focused_state_change_event(IPCGen *gen, unsigned long seq,
+                                    const int mon_num, const Window client_id,
                                     const ClientState *old_state,
                                     const ClientState *new_state);
 
-int dump_error_message(yajl_gen gen, const char *reason);
+int dump_error_message(IPCGen *gen, const char *reason);
+
+int dump_success_message(IPCGen *gen);
+
+int dump_handshake(IPCGen *gen, const char *format, int header_version);
 
 #endif  // YAJL_DUMPS_H_